@@ -17,6 +17,11 @@
  * permitted as long as the number of samples is one greater than a multiple of 8. When
  * multiple channels are present, they are interleaved in the data with an 8-sample
  * interval. 
+ *
+ * The lower bitrate 2-bit and 3-bit variants (the _ex functions with bps) use the same
+ * block headers and step table, but interleave the channels every 16 samples (4 bytes)
+ * or every 32 samples (12 bytes) respectively, with the codes packed starting at the
+ * least significant bit. This is the same layout as other decoders use for these.
  */
 
 /********************************* 4-bit ADPCM encoder ********************************/
@@ -47,6 +52,54 @@ static const int index_table[] = {
     -1, -1, -1, -1, 2, 4, 6, 8
 };
 
+static const int index_table_2bit[] = { -1, 2 };
+static const int index_table_3bit[] = { -1, -1, 1, 2 };
+
+/* Return the number of samples per channel in an interleave group for the given
+ * bits per sample (the group is 4 bytes per channel, except 12 bytes for 3-bit).
+ */
+
+#define GROUP_SAMPLES(bps) ((bps) == 3 ? 32 : 32 / (bps))
+#define GROUP_BYTES(bps) ((bps) == 3 ? 12 : 4)
+
+/* Return the step index adjustment and the signed PCM delta for the given code. The 4-bit
+ * delta is the standard sum of shifted steps, and the others are the equivalent rounded
+ * products (for 4-bit these would differ in the LSBs).
+ */
+
+static int code_index (int code, int bps)
+{
+    switch (bps) {
+        case 2: return index_table_2bit [code & 1];
+        case 3: return index_table_3bit [code & 3];
+        default: return index_table [code & 7];
+    }
+}
+
+static int32_t code_delta (int code, int step, int bps)
+{
+    int32_t delta;
+
+    if (bps == 4) {
+        delta = step >> 3;
+
+        if (code & 1) delta += (step >> 2);
+        if (code & 2) delta += (step >> 1);
+        if (code & 4) delta += step;
+        if (code & 8) delta = -delta;
+    }
+    else {
+        int shift = bps - 1;
+
+        delta = ((2 * (code & ((1 << shift) - 1)) + 1) * step) >> shift;
+
+        if (code & (1 << shift))
+            delta = -delta;
+    }
+
+    return delta;
+}
+
 struct adpcm_channel {
     int32_t pcmdata;                        // current PCM value
     int32_t error, weight, history [2];     // for noise shaping
@@ -54,11 +107,12 @@ struct adpcm_channel {
 };
 
 struct adpcm_context {
-    struct adpcm_channel channels [2];
-    int num_channels, lookahead, noise_shaping;
+    struct adpcm_channel channels [ADPCM_MAX_CHANNELS];
+    int num_channels, lookahead, noise_shaping, bps;
 };
 
-/* Create ADPCM encoder context with given number of channels.
+/* Create ADPCM encoder context with given number of channels
+ * (up to ADPCM_MAX_CHANNELS, with an initial delta for each).
  * The returned pointer is used for subsequent calls. Note that
  * even though an ADPCM encoder could be set up to encode frames
  * independently, we use a context so that we can use previous
@@ -66,15 +120,19 @@ struct adpcm_context {
  * for encoding independent frames).
  */
 
-void *adpcm_create_context (int num_channels, int lookahead, int noise_shaping, int32_t initial_deltas [2])
+void *adpcm_create_context (int num_channels, int lookahead, int noise_shaping, int32_t initial_deltas [])
 {
-    struct adpcm_context *pcnxt = malloc (sizeof (struct adpcm_context));
+    struct adpcm_context *pcnxt;
     int ch, i;
 
+    if (num_channels < 1 || num_channels > ADPCM_MAX_CHANNELS || !(pcnxt = malloc (sizeof (struct adpcm_context))))
+        return NULL;
+
     memset (pcnxt, 0, sizeof (struct adpcm_context));
     pcnxt->noise_shaping = noise_shaping;
     pcnxt->num_channels = num_channels;
     pcnxt->lookahead = lookahead;
+    pcnxt->bps = 4;
 
     // given the supplied initial deltas, search for and store the closest index
 
@@ -188,13 +246,72 @@ static double minimum_error (const struct adpcm_channel *pchan, int nch, int32_t
     return min_error;
 }
 
+// the same search for the 2-bit and 3-bit codes (kept apart so the 4-bit one stays fast)
+
+static double minimum_error_ex (const struct adpcm_channel *pchan, int nch, int bps, int32_t csample, const int16_t *sample, int depth, int *best_nibble)
+{
+    int32_t delta = csample - pchan->pcmdata;
+    struct adpcm_channel chan = *pchan;
+    int step = step_table[chan.index];
+    int sign = 1 << (bps - 1), max_mag = sign - 1;
+    int nibble, nibble2;
+    double min_error;
+
+    if (delta < 0) {
+        int mag = (-delta << (bps - 2)) / step;
+        nibble = sign | (mag > max_mag ? max_mag : mag);
+    }
+    else {
+        int mag = (delta << (bps - 2)) / step;
+        nibble = mag > max_mag ? max_mag : mag;
+    }
+
+    chan.pcmdata += code_delta (nibble, step, bps);
+    CLIP(chan.pcmdata, -32768, 32767);
+    if (best_nibble) *best_nibble = nibble;
+    min_error = (double) (chan.pcmdata - csample) * (chan.pcmdata - csample);
+
+    if (depth) {
+        chan.index += code_index (nibble, bps);
+        CLIP(chan.index, 0, 88);
+        min_error += minimum_error_ex (&chan, nch, bps, sample [nch], sample + nch, depth - 1, NULL);
+    }
+    else
+        return min_error;
+
+    for (nibble2 = 0; nibble2 <= sign + max_mag; ++nibble2) {
+        double error;
+
+        if (nibble2 == nibble)
+            continue;
+
+        chan = *pchan;
+        chan.pcmdata += code_delta (nibble2, step, bps);
+        CLIP(chan.pcmdata, -32768, 32767);
+
+        error = (double) (chan.pcmdata - csample) * (chan.pcmdata - csample);
+
+        if (error < min_error) {
+            chan.index += code_index (nibble2, bps);
+            CLIP(chan.index, 0, 88);
+            error += minimum_error_ex (&chan, nch, bps, sample [nch], sample + nch, depth - 1, NULL);
+
+            if (error < min_error) {
+                if (best_nibble) *best_nibble = nibble2;
+                min_error = error;
+            }
+        }
+    }
+
+    return min_error;
+}
+
 static uint8_t encode_sample (struct adpcm_context *pcnxt, int ch, const int16_t *sample, int num_samples)
 {
     struct adpcm_channel *pchan = pcnxt->channels + ch;
     int32_t csample = *sample;
     int depth = num_samples - 1, nibble;
     int step = step_table[pchan->index];
-    int trial_delta = (step >> 3);
 
     if (pcnxt->noise_shaping == NOISE_SHAPING_DYNAMIC) {
         int32_t sam = (3 * pchan->history [0] - pchan->history [1]) >> 1;
@@ -224,15 +341,13 @@ static uint8_t encode_sample (struct adpcm_context *pcnxt, int ch, const int16_t
     if (depth > pcnxt->lookahead)
         depth = pcnxt->lookahead;
 
-    minimum_error (pchan, pcnxt->num_channels, csample, sample, depth, &nibble);
-
-    if (nibble & 1) trial_delta += (step >> 2);
-    if (nibble & 2) trial_delta += (step >> 1);
-    if (nibble & 4) trial_delta += step;
-    if (nibble & 8) trial_delta = -trial_delta;
+    if (pcnxt->bps == 4)
+        minimum_error (pchan, pcnxt->num_channels, csample, sample, depth, &nibble);
+    else
+        minimum_error_ex (pchan, pcnxt->num_channels, pcnxt->bps, csample, sample, depth, &nibble);
 
-    pchan->pcmdata += trial_delta;
-    pchan->index += index_table[nibble & 0x07];
+    pchan->pcmdata += code_delta (nibble, step, pcnxt->bps);
+    pchan->index += code_index (nibble, pcnxt->bps);
     CLIP(pchan->index, 0, 88);
     CLIP(pchan->pcmdata, -32768, 32767);
 
@@ -242,33 +357,87 @@ static uint8_t encode_sample (struct adpcm_context *pcnxt, int ch, const int16_t
     return nibble;
 }
 
-static void encode_chunks (struct adpcm_context *pcnxt, uint8_t **outbuf, size_t *outbufsize, const int16_t **inbuf, int inbufcount)
+// encode one interleave group (8 samples per channel at 4 bits), with inbufcount composite
+// samples left in the block starting at inbuf (for the lookahead, which stops at the block end)
+
+static void encode_chunk (struct adpcm_context *pcnxt, uint8_t **outbuf, const int16_t *inbuf, int inbufcount)
 {
     const int16_t *pcmbuf;
-    int chunks, ch, i;
+    int ch, i;
 
-    chunks = (inbufcount - 1) / 8;
-    *outbufsize += (chunks * 4) * pcnxt->num_channels;
+    if (pcnxt->bps != 4) {
+        for (ch = 0; ch < pcnxt->num_channels; ch++) {
+            uint32_t bits = 0;
+            int num_bits = 0;
 
-    while (chunks--)
-    {
-        for (ch = 0; ch < pcnxt->num_channels; ch++)
-        {
-            pcmbuf = *inbuf + ch;
+            pcmbuf = inbuf + ch;
 
-            for (i = 0; i < 4; i++) {
-                **outbuf = encode_sample (pcnxt, ch, pcmbuf, chunks * 8 + (3 - i) * 2 + 2);
+            for (i = 0; i < GROUP_SAMPLES (pcnxt->bps); i++) {
+                bits |= (uint32_t) encode_sample (pcnxt, ch, pcmbuf, inbufcount - i) << num_bits;
                 pcmbuf += pcnxt->num_channels;
-                **outbuf |= encode_sample (pcnxt, ch, pcmbuf, chunks * 8 + (3 - i) * 2 + 1) << 4;
-                pcmbuf += pcnxt->num_channels;
-                (*outbuf)++;
+
+                for (num_bits += pcnxt->bps; num_bits >= 8; num_bits -= 8) {
+                    *(*outbuf)++ = bits;
+                    bits >>= 8;
+                }
             }
         }
 
-        *inbuf += 8 * pcnxt->num_channels;
+        return;
+    }
+
+    for (ch = 0; ch < pcnxt->num_channels; ch++)
+    {
+        pcmbuf = inbuf + ch;
+
+        for (i = 0; i < 4; i++) {
+            **outbuf = encode_sample (pcnxt, ch, pcmbuf, inbufcount - i * 2);
+            pcmbuf += pcnxt->num_channels;
+            **outbuf |= encode_sample (pcnxt, ch, pcmbuf, inbufcount - i * 2 - 1) << 4;
+            pcmbuf += pcnxt->num_channels;
+            (*outbuf)++;
+        }
+    }
+}
+
+static void encode_chunks (struct adpcm_context *pcnxt, uint8_t **outbuf, size_t *outbufsize, const int16_t **inbuf, int inbufcount)
+{
+    int group = GROUP_SAMPLES (pcnxt->bps), chunks;
+
+    chunks = (inbufcount - 1) / group;
+    *outbufsize += (chunks * GROUP_BYTES (pcnxt->bps)) * pcnxt->num_channels;
+
+    while (chunks--)
+    {
+        encode_chunk (pcnxt, outbuf, *inbuf, chunks * group + group);
+        *inbuf += group * pcnxt->num_channels;
     }
 }
 
+// start a block with the first (composite) sample, which goes into its header
+
+static void encode_header (struct adpcm_context *pcnxt, uint8_t **outbuf, size_t *outbufsize, const int16_t **inbuf)
+{
+    int32_t init_pcmdata[ADPCM_MAX_CHANNELS];
+    int8_t init_index[ADPCM_MAX_CHANNELS];
+    int ch;
+
+    get_decode_parameters(pcnxt, init_pcmdata, init_index);
+
+    for (ch = 0; ch < pcnxt->num_channels; ch++) {
+        init_pcmdata[ch] = *(*inbuf)++;
+        (*outbuf)[0] = init_pcmdata[ch];
+        (*outbuf)[1] = init_pcmdata[ch] >> 8;
+        (*outbuf)[2] = init_index[ch];
+        (*outbuf)[3] = 0;
+
+        *outbuf += 4;
+        *outbufsize += 4;
+    }
+
+    set_decode_parameters(pcnxt, init_pcmdata, init_index);
+}
+
 /* Encode a block of 16-bit PCM data into 4-bit ADPCM.
  *
  * Parameters:
@@ -287,31 +456,101 @@ static void encode_chunks (struct adpcm_context *pcnxt, uint8_t **outbuf, size_t
 int adpcm_encode_block (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount)
 {
     struct adpcm_context *pcnxt = (struct adpcm_context *) p;
-    int32_t init_pcmdata[2];
-    int8_t init_index[2];
-    int ch;
 
     *outbufsize = 0;
 
     if (!inbufcount)
         return 1;
 
-    get_decode_parameters(pcnxt, init_pcmdata, init_index);
+    encode_header (pcnxt, &outbuf, outbufsize, &inbuf);
+    encode_chunks (pcnxt, &outbuf, outbufsize, &inbuf, inbufcount);
 
-    for (ch = 0; ch < pcnxt->num_channels; ch++) {
-        init_pcmdata[ch] = *inbuf++;
-        outbuf[0] = init_pcmdata[ch];
-        outbuf[1] = init_pcmdata[ch] >> 8;
-        outbuf[2] = init_index[ch];
-        outbuf[3] = 0;
+    return 1;
+}
 
-        outbuf += 4;
-        *outbufsize += 4;
-    }
+/* Encode a block of 16-bit PCM data into 2-bit, 3-bit or 4-bit ADPCM (bps). This is otherwise just
+ * like adpcm_encode_block(), and the bps also applies to any following adpcm_encode_block_header()
+ * and adpcm_encode_block_chunk() calls with this context. The number of composite samples must be one
+ * greater than a multiple of the interleave group size (adpcm_block_samples() gives the count that
+ * fits in a given block size), or the extra samples are ignored.
+ *
+ * Returns 1 for success or 0 for an unsupported bps
+ */
 
-    set_decode_parameters(pcnxt, init_pcmdata, init_index);
-    encode_chunks (pcnxt, &outbuf, outbufsize, &inbuf, inbufcount);
+int adpcm_encode_block_ex (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount, int bps)
+{
+    struct adpcm_context *pcnxt = (struct adpcm_context *) p;
+
+    *outbufsize = 0;
 
+    if (bps < 2 || bps > 4)
+        return 0;
+
+    pcnxt->bps = bps;
+    return adpcm_encode_block (p, outbuf, outbufsize, inbuf, inbufcount);
+}
+
+/* Return the number of composite samples in a (complete) block of block_size bytes, or the size of
+ * the (possibly partial) block needed for num_samples composite samples, with the given number of
+ * channels and bits per sample. The samples are one more than a whole number of interleave groups,
+ * and a partial block is rounded up to one (the encoder then pads with the last sample).
+ */
+
+int adpcm_block_samples (size_t block_size, int channels, int bps)
+{
+    if (block_size < (size_t) channels * 4)
+        return 0;
+
+    return (block_size - channels * 4) / (GROUP_BYTES (bps) * channels) * GROUP_SAMPLES (bps) + 1;
+}
+
+size_t adpcm_block_size (int num_samples, int channels, int bps)
+{
+    int groups = (num_samples + GROUP_SAMPLES (bps) - 2) / GROUP_SAMPLES (bps);
+
+    return channels * 4 + (size_t) groups * GROUP_BYTES (bps) * channels;
+}
+
+/* Encode a block incrementally, for low latency. The block header is written from the
+ * first composite sample alone, then each interleave group (8 composite samples, 4 bytes
+ * per channel) as soon as the samples for its lookahead are available. Calling these in
+ * sequence over a block gives exactly what adpcm_encode_block() would.
+ *
+ * Parameters:
+ *  p               the context returned by adpcm_begin()
+ *  outbuf          destination buffer (4 bytes per channel, 12 at 3 bits)
+ *  outbufsize      pointer to variable where the number of bytes written
+ *                   will be stored
+ *  inbuf           source PCM samples, the first sample of the block for the
+ *                   header and the next 8 composite samples for a chunk (16
+ *                   at 2 bits and 32 at 3 bits, see adpcm_encode_block_ex())
+ *  inbufcount      number of composite PCM samples left in the block starting at
+ *                   inbuf (at least one chunk); only the first chunk + lookahead
+ *                   of them (or all if less) are read
+ *
+ * Returns 1 (for success as there is no error checking)
+ */
+
+int adpcm_encode_block_header (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf)
+{
+    struct adpcm_context *pcnxt = (struct adpcm_context *) p;
+
+    *outbufsize = 0;
+    encode_header (pcnxt, &outbuf, outbufsize, &inbuf);
+    return 1;
+}
+
+int adpcm_encode_block_chunk (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount)
+{
+    struct adpcm_context *pcnxt = (struct adpcm_context *) p;
+
+    *outbufsize = 0;
+
+    if (inbufcount < GROUP_SAMPLES (pcnxt->bps))
+        return 1;
+
+    encode_chunk (pcnxt, &outbuf, inbuf, inbufcount);
+    *outbufsize = pcnxt->num_channels * GROUP_BYTES (pcnxt->bps);
     return 1;
 }
 
@@ -334,10 +573,10 @@ int adpcm_encode_block (void *p, uint8_t *outbuf, size_t *outbufsize, const int1
 int adpcm_decode_block (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels)
 {
     int ch, samples = 1, chunks;
-    int32_t pcmdata[2];
-    int8_t index[2];
+    int32_t pcmdata[ADPCM_MAX_CHANNELS];
+    int8_t index[ADPCM_MAX_CHANNELS];
 
-    if (inbufsize < (uint32_t) channels * 4)
+    if (channels < 1 || channels > ADPCM_MAX_CHANNELS || inbufsize < (uint32_t) channels * 4)
         return 0;
 
     for (ch = 0; ch < channels; ch++) {
@@ -398,3 +637,474 @@ int adpcm_decode_block (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize,
     return samples;
 }
 
+/* Decode one 2-bit or 3-bit code, updating the PCM value and step index of a channel.
+ */
+
+#define DECODE_CODE(pcmdata, index, code, bps) do { \
+    int shift = (bps) - 1, mag = (code) & ((1 << shift) - 1); \
+    int32_t delta = ((2 * mag + 1) * step_table [index]) >> shift; \
+    pcmdata += ((code) >> shift) ? -delta : delta; \
+    index += (bps) == 2 ? index_table_2bit [mag] : index_table_3bit [mag]; \
+    CLIP(index, 0, 88); \
+    CLIP(pcmdata, -32768, 32767); \
+} while (0)
+
+// decode an interleave group of one channel at 2 bits: one 32-bit word holding 16 codes
+
+static void decode_group_2bit (int16_t *outbuf, const uint8_t *inbuf, int channels, int32_t *pcmdata, int *index)
+{
+    uint32_t codes = inbuf [0] | (inbuf [1] << 8) | ((uint32_t) inbuf [2] << 16) | ((uint32_t) inbuf [3] << 24);
+    int i;
+
+    for (i = 0; i < 16; ++i, codes >>= 2) {
+        DECODE_CODE (*pcmdata, *index, codes & 3, 2);
+        outbuf [i * channels] = *pcmdata;
+    }
+}
+
+// decode an interleave group of one channel at 3 bits: 12 bytes holding 32 codes
+
+static void decode_group_3bit (int16_t *outbuf, const uint8_t *inbuf, int channels, int32_t *pcmdata, int *index)
+{
+    uint32_t codes = 0;
+    int i, bits = 0;
+
+    for (i = 0; i < 32; ++i, codes >>= 3, bits -= 3) {
+        if (bits < 3) {
+            codes |= (uint32_t) *inbuf++ << bits;
+            bits += 8;
+        }
+
+        DECODE_CODE (*pcmdata, *index, codes & 7, 3);
+        outbuf [i * channels] = *pcmdata;
+    }
+}
+
+/* Decode a block of 2-bit, 3-bit or 4-bit ADPCM data (bps) into PCM. This is otherwise just
+ * like adpcm_decode_block(), which is used for 4-bit.
+ *
+ * Returns number of converted composite samples (or zero on error)
+ */
+
+int adpcm_decode_block_ex (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int bps)
+{
+    int ch, samples = 1, chunks, index [ADPCM_MAX_CHANNELS];
+    int32_t pcmdata [ADPCM_MAX_CHANNELS];
+
+    if (bps == 4)
+        return adpcm_decode_block (outbuf, inbuf, inbufsize, channels);
+
+    if ((bps != 2 && bps != 3) || channels < 1 || channels > ADPCM_MAX_CHANNELS || inbufsize < (uint32_t) channels * 4)
+        return 0;
+
+    for (ch = 0; ch < channels; ch++) {
+        *outbuf++ = pcmdata [ch] = (int16_t) (inbuf [0] | (inbuf [1] << 8));
+        index [ch] = inbuf [2];
+
+        if (index [ch] > 88 || inbuf [3])       // sanitize the input a little...
+            return 0;
+
+        inbufsize -= 4;
+        inbuf += 4;
+    }
+
+    chunks = inbufsize / (GROUP_BYTES (bps) * channels);
+    samples += chunks * GROUP_SAMPLES (bps);
+
+    while (chunks--) {
+        for (ch = 0; ch < channels; ++ch) {
+            if (bps == 2)
+                decode_group_2bit (outbuf + ch, inbuf, channels, pcmdata + ch, index + ch);
+            else
+                decode_group_3bit (outbuf + ch, inbuf, channels, pcmdata + ch, index + ch);
+
+            inbuf += GROUP_BYTES (bps);
+        }
+
+        outbuf += GROUP_SAMPLES (bps) * channels;
+    }
+
+    return samples;
+}
+
+/* Decode one 4-bit code, updating the PCM value and step index of a channel. This is
+ * the same as the inner loop of adpcm_decode_block() and is shared by the functions that
+ * can start (and stop) in the middle of a block.
+ */
+
+#define DECODE_NIBBLE(pcmdata, index, code) do { \
+    int step = step_table [index], delta = step >> 3; \
+    if ((code) & 1) delta += (step >> 2); \
+    if ((code) & 2) delta += (step >> 1); \
+    if ((code) & 4) delta += step; \
+    if ((code) & 8) delta = -delta; \
+    pcmdata += delta; \
+    index += index_table [(code) & 0x7]; \
+    CLIP(index, 0, 88); \
+    CLIP(pcmdata, -32768, 32767); \
+} while (0)
+
+/* Return the 4-bit code that produces composite sample "sample" (which must be > 0) of
+ * the given channel in a block.
+ */
+
+#define NIBBLE_CODE(inbuf, channels, ch, sample) \
+    (((inbuf) [(channels) * 4 + (((sample) - 1) >> 3) * (channels) * 4 + (ch) * 4 + ((((sample) - 1) & 7) >> 1)] >> \
+    ((((sample) - 1) & 1) << 2)) & 0xf)
+
+// the same for 2-bit and 3-bit codes, which may straddle bytes
+
+static int block_code (const uint8_t *inbuf, int channels, int ch, int sample, int bps)
+{
+    int group = GROUP_SAMPLES (bps), bit = (sample - 1) % group * bps, code;
+    const uint8_t *chunk = inbuf + channels * 4 + ((sample - 1) / group * channels + ch) * GROUP_BYTES (bps) + (bit >> 3);
+
+    code = chunk [0] >> (bit & 7);
+
+    if ((bit & 7) + bps > 8)
+        code |= chunk [1] << (8 - (bit & 7));
+
+    return code & ((1 << bps) - 1);
+}
+
+// decode composite sample "sample" (> 0) of a channel at any bps, following the previous one
+
+#define DECODE_SAMPLE(pcmdata, index, inbuf, channels, ch, sample, bps) do { \
+    if ((bps) == 4) { \
+        int code = NIBBLE_CODE (inbuf, channels, ch, sample); \
+        DECODE_NIBBLE (pcmdata, index, code); \
+    } \
+    else { \
+        int code = block_code (inbuf, channels, ch, sample, bps); \
+        DECODE_CODE (pcmdata, index, code, bps); \
+    } \
+} while (0)
+
+/* Validate a range of samples in a block and clip the count to the end of the block.
+ * Returns the number of samples in the range, or -1 for an invalid range.
+ */
+
+static int block_range (size_t inbufsize, int channels, int bps, int sample_index, int sample_count, const uint8_t *state)
+{
+    int samples;
+
+    if (channels < 1 || inbufsize < (uint32_t) channels * 4 || (sample_index && !state) || bps < 2 || bps > 4)
+        return -1;
+
+    samples = adpcm_block_samples (inbufsize, channels, bps);
+
+    if (sample_index < 0 || sample_index >= samples || sample_count < 0)
+        return -1;
+
+    return sample_count > samples - sample_index ? samples - sample_index : sample_count;
+}
+
+/* Get the starting state (PCM value and step index) of a channel for a range of samples,
+ * from either the block header or the supplied state. Returns 0 if invalid.
+ */
+
+static int range_state (const uint8_t *inbuf, const uint8_t *state, int sample_index, int ch, int32_t *pcmdata, int *index)
+{
+    const uint8_t *header = sample_index ? state + ch * 4 : inbuf + ch * 4;
+
+    *pcmdata = (int16_t) (header [0] | (header [1] << 8));
+    *index = header [2];
+
+    return *index <= 88 && !header [3];     // sanitize the input a little...
+}
+
+static void store_state (uint8_t *state, int ch, int32_t pcmdata, int index)
+{
+    state [ch * 4] = pcmdata;
+    state [ch * 4 + 1] = pcmdata >> 8;
+    state [ch * 4 + 2] = index;
+    state [ch * 4 + 3] = 0;
+}
+
+/* Decode a range of samples from a block of ADPCM data into PCM. Unlike adpcm_decode_block() this
+ * can start in the middle of a block, in which case the decoder state (the PCM value of the previous
+ * sample and the current step index) must be provided instead of the block header. This is stored
+ * in the same 4-byte-per-channel layout as the block header itself, so the state at any sample can
+ * be used as a "synthetic" header. On return the state is updated to follow the last sample decoded,
+ * so successive calls can walk through a block, and calling with a NULL outbuf simply captures the
+ * state at a given point.
+ *
+ * Parameters:
+ *  outbuf          destination for interleaved PCM samples (or NULL to only update state)
+ *  inbuf           source ADPCM block
+ *  inbufsize       size of source ADPCM block
+ *  channels        number of channels in block (must be determined from other context)
+ *  sample_index    index of first composite sample to decode (0 = block header sample)
+ *  sample_count    number of composite samples to decode
+ *  state           decoder state (channels * 4 bytes), input if sample_index is non-zero, and
+ *                   always updated on output (may be NULL if sample_index is zero)
+ *
+ * Returns number of converted composite samples (or zero on error)
+ */
+
+int adpcm_decode_block_range (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state)
+{
+    return adpcm_decode_block_range_ex (outbuf, inbuf, inbufsize, channels, 4, sample_index, sample_count, state);
+}
+
+int adpcm_decode_block_range_ex (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state)
+{
+    int ch, sample, index;
+    int32_t pcmdata;
+
+    if ((sample_count = block_range (inbufsize, channels, bps, sample_index, sample_count, state)) < 0)
+        return 0;
+
+    for (ch = 0; ch < channels; ch++) {
+        if (!range_state (inbuf, state, sample_index, ch, &pcmdata, &index))
+            return 0;
+
+        for (sample = sample_index; sample < sample_index + sample_count; ++sample) {
+            if (sample)
+                DECODE_SAMPLE (pcmdata, index, inbuf, channels, ch, sample, bps);
+
+            if (outbuf)
+                outbuf [(sample - sample_index) * channels + ch] = pcmdata;
+        }
+
+        if (state)
+            store_state (state, ch, pcmdata, index);
+    }
+
+    return sample_count;
+}
+
+/* Decode a range of samples from a block of ADPCM data and add them straight into a 32-bit mix
+ * buffer, scaled by a gain for each combination of source and mix channel. This is otherwise just
+ * like adpcm_decode_block_range() but no PCM is stored, so any number of blocks (voices) can be
+ * mixed together without intermediate buffers and the result is only clipped once at the end.
+ *
+ * Parameters:
+ *  mixbuf          interleaved mix buffer, added to
+ *  mix_channels    number of channels in the mix buffer
+ *  gains           for each source channel, mix_channels gains (ADPCM_MIX_UNITY = 1.0)
+ *  inbuf           source ADPCM block
+ *  inbufsize       size of source ADPCM block
+ *  channels        number of channels in block (must be determined from other context)
+ *  sample_index    index of first composite sample to decode (0 = block header sample)
+ *  sample_count    number of composite samples to decode
+ *  state           decoder state (channels * 4 bytes), as for adpcm_decode_block_range()
+ *
+ * Returns number of mixed composite samples (or zero on error)
+ */
+
+int adpcm_mix_block_range (int32_t *mixbuf, int mix_channels, const int32_t *gains, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state)
+{
+    return adpcm_mix_block_range_ex (mixbuf, mix_channels, gains, inbuf, inbufsize, channels, 4, sample_index, sample_count, state);
+}
+
+int adpcm_mix_block_range_ex (int32_t *mixbuf, int mix_channels, const int32_t *gains, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state)
+{
+    int ch, sample, index, m;
+    int32_t pcmdata;
+
+    if ((sample_count = block_range (inbufsize, channels, bps, sample_index, sample_count, state)) < 0)
+        return 0;
+
+    for (ch = 0; ch < channels; ch++) {
+        const int32_t *chan_gains = gains + ch * mix_channels;
+        int32_t *mixptr = mixbuf;
+
+        if (!range_state (inbuf, state, sample_index, ch, &pcmdata, &index))
+            return 0;
+
+        for (sample = sample_index; sample < sample_index + sample_count; ++sample) {
+            if (sample)
+                DECODE_SAMPLE (pcmdata, index, inbuf, channels, ch, sample, bps);
+
+            for (m = 0; m < mix_channels; ++m)
+                *mixptr++ += (pcmdata * chan_gains [m]) >> 12;
+        }
+
+        if (state)
+            store_state (state, ch, pcmdata, index);
+    }
+
+    return sample_count;
+}
+
+/* Scale, dither and reduce a 16-bit sample to the given number of bits (shift = 16 - bits), returning
+ * it still signed. The dither is TPDF of +/- 1 LSB of the reduced resolution (from a simple LCG
+ * seeded by the caller) and is only applied when dither is not NULL.
+ */
+
+static int32_t reduce_sample (int32_t value, int shift, int32_t gain, uint32_t *dither)
+{
+    if (gain != ADPCM_MIX_UNITY)
+        value = (value * gain) >> 12;
+
+    if (dither) {
+        int32_t r1, r2;
+
+        *dither = *dither * 1664525 + 1013904223;
+        r1 = *dither >> 16;
+        *dither = *dither * 1664525 + 1013904223;
+        r2 = *dither >> 16;
+
+        // the dither has 16 bits below the reduced LSB, which are kept until the final rounding so
+        // that it stays symmetric (truncating it first would bias it by half an LSB)
+
+        value = (int32_t) (((int64_t) value * 65536 + (r1 - r2) * (1 << shift) + (1 << (shift + 15))) >> (shift + 16));
+    }
+    else if (shift)
+        value = (value + (1 << (shift - 1))) >> shift;
+
+    CLIP(value, -32768 >> shift, 32767 >> shift);
+    return value;
+}
+
+/* Convert a single 16-bit sample to the given output format (one of ADPCM_FORMAT_*) with gain
+ * (ADPCM_MIX_UNITY = 1.0) and optional dither, and store it at outbuf. This is what
+ * adpcm_decode_block_convert() does to each sample, for callers producing their own samples.
+ *
+ * Returns the pointer to where the next sample goes.
+ */
+
+void *adpcm_convert_sample (void *outbuf, int format, int32_t value, int32_t gain, uint32_t *dither)
+{
+    switch (format) {
+        case ADPCM_FORMAT_U8:
+            *(uint8_t *) outbuf = reduce_sample (value, 8, gain, dither) + 0x80;
+            return (uint8_t *) outbuf + 1;
+
+        case ADPCM_FORMAT_U12:
+            *(uint16_t *) outbuf = reduce_sample (value, 4, gain, dither) + 0x800;
+            return (uint16_t *) outbuf + 1;
+
+        case ADPCM_FORMAT_U16:
+            *(uint16_t *) outbuf = reduce_sample (value, 0, gain, dither) + 0x8000;
+            return (uint16_t *) outbuf + 1;
+
+        default:
+            *(int16_t *) outbuf = reduce_sample (value, 0, gain, dither);
+            return (int16_t *) outbuf + 1;
+    }
+}
+
+/* Decode a range of samples from a block of ADPCM data directly into the given output format, with
+ * gain and optional dither applied in the same pass. This is otherwise just like
+ * adpcm_decode_block_range() and takes the same state (which may not be NULL here).
+ *
+ * Parameters:
+ *  outbuf          destination for interleaved samples in format
+ *  format          ADPCM_FORMAT_S16 (signed 16-bit), ADPCM_FORMAT_U16 (offset binary 16-bit),
+ *                   ADPCM_FORMAT_U12 (unsigned 12-bit in 16-bit words) or ADPCM_FORMAT_U8
+ *  gain            gain applied before reducing resolution (ADPCM_MIX_UNITY = 1.0)
+ *  dither          LCG state for TPDF dither, or NULL for no dither
+ *  inbuf           source ADPCM block
+ *  inbufsize       size of source ADPCM block
+ *  channels        number of channels in block (must be determined from other context)
+ *  sample_index    index of first composite sample to decode (0 = block header sample)
+ *  sample_count    number of composite samples to decode
+ *  state           decoder state (channels * 4 bytes), as for adpcm_decode_block_range()
+ *
+ * Returns number of converted composite samples (or zero on error)
+ */
+
+#define CONVERT_RANGE(type, shift, offset) \
+    for (ch = 0; ch < channels; ch++) { \
+        type *outptr = (type *) outbuf + ch; \
+        if (!range_state (inbuf, state, sample_index, ch, &pcmdata, &index)) \
+            return 0; \
+        for (sample = sample_index; sample < sample_index + sample_count; ++sample) { \
+            if (sample) \
+                DECODE_SAMPLE (pcmdata, index, inbuf, channels, ch, sample, bps); \
+            *outptr = reduce_sample (pcmdata, shift, gain, dither) + offset; \
+            outptr += channels; \
+        } \
+        store_state (state, ch, pcmdata, index); \
+    }
+
+int adpcm_decode_block_convert (void *outbuf, int format, int32_t gain, uint32_t *dither, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state)
+{
+    return adpcm_decode_block_convert_ex (outbuf, format, gain, dither, inbuf, inbufsize, channels, 4, sample_index, sample_count, state);
+}
+
+int adpcm_decode_block_convert_ex (void *outbuf, int format, int32_t gain, uint32_t *dither, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state)
+{
+    int ch, sample, index;
+    int32_t pcmdata;
+
+    if (!state || (sample_count = block_range (inbufsize, channels, bps, sample_index, sample_count, state)) < 0)
+        return 0;
+
+    switch (format) {
+        case ADPCM_FORMAT_U8:
+            CONVERT_RANGE (uint8_t, 8, 0x80);
+            break;
+
+        case ADPCM_FORMAT_U12:
+            CONVERT_RANGE (uint16_t, 4, 0x800);
+            break;
+
+        case ADPCM_FORMAT_U16:
+            CONVERT_RANGE (uint16_t, 0, 0x8000);
+            break;
+
+        default:
+            CONVERT_RANGE (int16_t, 0, 0);
+            break;
+    }
+
+    return sample_count;
+}
+
+/* Make a new block from a range of samples of an existing block without re-encoding them, for
+ * lossless editing (e.g. trimming a clip). The decoder state at the first sample of the range
+ * becomes the new block header and the codes of the samples that follow are moved up to follow
+ * it, so the new block decodes to exactly the same samples. The range may start anywhere, but
+ * unless it's the whole block the result is a short block, which in a .wav file can only be the
+ * last one. The unused codes of the last interleave group are zero.
+ *
+ * Parameters:
+ *  outbuf          destination for the new block (may not be inbuf)
+ *  outbufsize      pointer to variable where the size of the new block will be stored
+ *  inbuf           source ADPCM block
+ *  inbufsize       size of source ADPCM block
+ *  channels        number of channels in block (must be determined from other context)
+ *  sample_index    index of first composite sample to copy (0 = block header sample)
+ *  sample_count    number of composite samples to copy
+ *
+ * Returns number of composite samples in the new block (or zero on error)
+ */
+
+int adpcm_extract_block (uint8_t *outbuf, size_t *outbufsize, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count)
+{
+    return adpcm_extract_block_ex (outbuf, outbufsize, inbuf, inbufsize, channels, 4, sample_index, sample_count);
+}
+
+int adpcm_extract_block_ex (uint8_t *outbuf, size_t *outbufsize, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count)
+{
+    int ch, sample;
+
+    // (the state for the range is written straight into the new header)
+
+    if ((sample_count = block_range (inbufsize, channels, bps, sample_index, sample_count, outbuf)) <= 0)
+        return 0;
+
+    *outbufsize = adpcm_block_size (sample_count, channels, bps);
+    memset (outbuf, 0, *outbufsize);
+
+    if (!adpcm_decode_block_range_ex (NULL, inbuf, inbufsize, channels, bps, 0, sample_index + 1, outbuf))
+        return 0;
+
+    for (ch = 0; ch < channels; ch++)
+        for (sample = 1; sample < sample_count; ++sample) {
+            int group = GROUP_SAMPLES (bps), bit = (sample - 1) % group * bps;
+            uint8_t *chunk = outbuf + channels * 4 + ((sample - 1) / group * channels + ch) * GROUP_BYTES (bps) + (bit >> 3);
+            int code = bps == 4 ? NIBBLE_CODE (inbuf, channels, ch, sample_index + sample) :
+                block_code (inbuf, channels, ch, sample_index + sample, bps);
+
+            chunk [0] |= code << (bit & 7);
+
+            if ((bit & 7) + bps > 8)
+                chunk [1] |= code >> (8 - (bit & 7));
+        }
+
+    return sample_count;
+}
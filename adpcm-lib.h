@@ -22,13 +22,37 @@ typedef __int8  int8_t;
 #include <stdint.h>
 #endif
 
-void *adpcm_create_context (int num_channels, int lookahead, int noise_shaping, int32_t initial_deltas [2]);
+void *adpcm_create_context (int num_channels, int lookahead, int noise_shaping, int32_t initial_deltas []);
 int adpcm_encode_block (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount);
+int adpcm_encode_block_ex (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount, int bps);
+int adpcm_encode_block_header (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf);
+int adpcm_encode_block_chunk (void *p, uint8_t *outbuf, size_t *outbufsize, const int16_t *inbuf, int inbufcount);
 int adpcm_decode_block (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels);
+int adpcm_decode_block_ex (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int bps);
+int adpcm_decode_block_range (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state);
+int adpcm_decode_block_range_ex (int16_t *outbuf, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state);
+int adpcm_mix_block_range (int32_t *mixbuf, int mix_channels, const int32_t *gains, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state);
+int adpcm_mix_block_range_ex (int32_t *mixbuf, int mix_channels, const int32_t *gains, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state);
+int adpcm_decode_block_convert (void *outbuf, int format, int32_t gain, uint32_t *dither, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count, uint8_t *state);
+int adpcm_decode_block_convert_ex (void *outbuf, int format, int32_t gain, uint32_t *dither, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count, uint8_t *state);
+int adpcm_block_samples (size_t block_size, int channels, int bps);
+size_t adpcm_block_size (int num_samples, int channels, int bps);
+int adpcm_extract_block (uint8_t *outbuf, size_t *outbufsize, const uint8_t *inbuf, size_t inbufsize, int channels, int sample_index, int sample_count);
+int adpcm_extract_block_ex (uint8_t *outbuf, size_t *outbufsize, const uint8_t *inbuf, size_t inbufsize, int channels, int bps, int sample_index, int sample_count);
+void *adpcm_convert_sample (void *outbuf, int format, int32_t value, int32_t gain, uint32_t *dither);
 void adpcm_free_context (void *p);
 
+#define ADPCM_MAX_CHANNELS      8   // e.g. 7.1, channels interleaved in the standard groups
+
 #define NOISE_SHAPING_OFF       0   // flat noise (no shaping)
 #define NOISE_SHAPING_STATIC    1   // first-order highpass shaping
 #define NOISE_SHAPING_DYNAMIC   2   // dynamically tilted noise based on signal
 
+#define ADPCM_MIX_UNITY         4096    // unity gain for adpcm_mix_block_range() & conversions
+
+#define ADPCM_FORMAT_S16        0   // signed 16-bit
+#define ADPCM_FORMAT_U16        1   // offset binary 16-bit (e.g. I2S DACs)
+#define ADPCM_FORMAT_U12        2   // unsigned 12-bit in low bits of 16-bit word (e.g. MCU DACs)
+#define ADPCM_FORMAT_U8         3   // unsigned 8-bit (e.g. PWM)
+
 #endif /* ADPCMLIB_H_ */
@@ -0,0 +1,376 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** ADPCM-XQ ****                           //
+//                  Xtreme Quality ADPCM Encoder/Decoder                  //
+//                    Copyright (c) 2015 David Bryant.                    //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "adpcm-riff.h"
+
+/* This module parses the header of a RIFF (or RF64/BW64) WAVE file up to the start of the audio
+ * data, for both the command-line program and the embedded decoder. It does no I/O of its own: the
+ * caller passes it the bytes of the file that it asks for (want bytes, starting at position) and
+ * it returns as soon as it reaches the data chunk. Every chunk that it has to look at is asked for
+ * together with the header of the chunk after it, so a typical header takes only a few reads (or
+ * just one call when the caller already has the start of the file in memory and passes all of it).
+ * Chunks that it doesn't need are never asked for, so the caller can seek past them (or read them,
+ * e.g., to copy them to another file); they are reported through the optional chunk function.
+ */
+
+// first chunk of RF64/BW64 files (where the 32-bit sizes are -1), sizes as 64-bit low/high pairs
+
+typedef struct {
+    uint32_t RiffSizeLow, RiffSizeHigh, DataSizeLow, DataSizeHigh;
+    uint32_t SampleCountLow, SampleCountHigh, TableLength;
+} DS64Chunk;
+
+#define DS64ChunkFormat "LLLLLLL"
+
+typedef struct {
+    uint32_t Manufacturer, Product, SamplePeriod, MIDIUnityNote, MIDIPitchFraction;
+    uint32_t SMPTEFormat, SMPTEOffset, NumSampleLoops, SamplerData;
+    uint32_t CuePointID, Type, Start, End, Fraction, PlayCount;
+} SamplerChunk;
+
+#define SamplerChunkFormat "LLLLLLLLLLLLLLL"
+
+#define RIFF_STATE_START    0       // want the RIFF header and the first chunk header
+#define RIFF_STATE_HEADER   1       // want a chunk header
+#define RIFF_STATE_BODY     2       // want (the start of) a chunk we look at, maybe with the next header
+
+void adpcm_riff_init (RiffParser *parser, RiffChunkFunc chunk_func, void *context)
+{
+    memset (parser, 0, sizeof (RiffParser));
+    parser->want = sizeof (RiffChunkHeader) + sizeof (ChunkHeader);
+    parser->chunk_func = chunk_func;
+    parser->context = context;
+}
+
+// Return the number of bytes at the start of the current chunk that we need to look at (the rest
+// of it is skipped), which is zero for the chunks we don't use at all.
+
+static uint32_t chunk_interest (const ChunkHeader *chunk)
+{
+    uint32_t smpl_bytes = sizeof (SamplerChunk) + sizeof (LoopState) + ADPCM_MAX_CHANNELS * 4;
+
+    if (!strncmp (chunk->ckID, "fmt ", 4))
+        return chunk->ckSize;
+    else if (!strncmp (chunk->ckID, "fact", 4))
+        return 4;
+    else if (!strncmp (chunk->ckID, "ds64", 4))
+        return sizeof (DS64Chunk);
+    else if (!strncmp (chunk->ckID, "smpl", 4))
+        return chunk->ckSize < smpl_bytes ? chunk->ckSize : smpl_bytes;
+    else
+        return 0;
+}
+
+// Get what we need from the start of the current chunk (chunk_interest() bytes at data).
+
+static int parse_chunk (RiffParser *parser, const unsigned char *data)
+{
+    ChunkHeader *chunk = &parser->chunk;
+    WaveHeader *wave = &parser->wave;
+
+    if (!strncmp (chunk->ckID, "fmt ", 4)) {
+        int supported = 1;
+
+        memset (wave, 0, sizeof (WaveHeader));
+        memcpy (wave, data, chunk->ckSize);
+        adpcm_little_endian_to_native (wave, WaveHeaderFormat);
+        parser->wave_size = chunk->ckSize;
+
+        parser->format = (wave->FormatTag == WAVE_FORMAT_EXTENSIBLE && chunk->ckSize == 40) ?
+            wave->SubFormat : wave->FormatTag;
+
+        parser->bits_per_sample = (chunk->ckSize == 40 && wave->Samples.ValidBitsPerSample) ?
+            wave->Samples.ValidBitsPerSample : wave->BitsPerSample;
+
+        if (wave->NumChannels < 1 || wave->NumChannels > ADPCM_MAX_CHANNELS)
+            supported = 0;
+        else if (parser->format == WAVE_FORMAT_PCM || parser->format == WAVE_FORMAT_IEEE_FLOAT) {
+            int sample_bytes = wave->BlockAlign / wave->NumChannels;
+
+            // integer samples of 2 to 4 bytes, or 32-bit floats
+
+            if (wave->BlockAlign != wave->NumChannels * sample_bytes || sample_bytes < 2 || sample_bytes > 4)
+                supported = 0;
+            else if (parser->format == WAVE_FORMAT_IEEE_FLOAT ? parser->bits_per_sample != 32 || sample_bytes != 4 :
+                parser->bits_per_sample < 9 || parser->bits_per_sample > sample_bytes * 8)
+                    supported = 0;
+        }
+        else if (parser->format == WAVE_FORMAT_IMA_ADPCM) {
+            if (parser->bits_per_sample < 2 || parser->bits_per_sample > 4)
+                supported = 0;
+            else if (wave->BlockAlign < wave->NumChannels * 4 ||
+                wave->Samples.SamplesPerBlock != adpcm_block_samples (wave->BlockAlign, wave->NumChannels, parser->bits_per_sample))
+                    return ADPCM_RIFF_INVALID;
+        }
+        else
+            supported = 0;
+
+        if (!supported)
+            return ADPCM_RIFF_UNSUPPORTED;
+    }
+    else if (!strncmp (chunk->ckID, "fact", 4)) {
+        memcpy (&parser->fact_samples, data, 4);
+        adpcm_little_endian_to_native (&parser->fact_samples, "L");
+    }
+    else if (!strncmp (chunk->ckID, "ds64", 4)) {
+        DS64Chunk ds64;
+
+        memcpy (&ds64, data, sizeof (DS64Chunk));
+        adpcm_little_endian_to_native (&ds64, DS64ChunkFormat);
+        parser->ds64_data_size = ((uint64_t) ds64.DataSizeHigh << 32) | ds64.DataSizeLow;
+        parser->ds64_samples = ((uint64_t) ds64.SampleCountHigh << 32) | ds64.SampleCountLow;
+    }
+    else if (!strncmp (chunk->ckID, "smpl", 4) && chunk->ckSize >= sizeof (SamplerChunk)) {
+        int num_channels = wave->NumChannels;
+        SamplerChunk sampler;
+
+        // only the first loop is used, and its decoder state only if we know it belongs to this format
+
+        memcpy (&sampler, data, sizeof (SamplerChunk));
+        adpcm_little_endian_to_native (&sampler, SamplerChunkFormat);
+
+        if (sampler.NumSampleLoops && sampler.Start <= sampler.End) {
+            parser->has_loop = 1;
+            parser->loop_start = sampler.Start;
+            parser->loop_end = sampler.End;
+        }
+
+        if (parser->has_loop && sampler.NumSampleLoops == 1 && num_channels &&
+            sampler.SamplerData >= sizeof (LoopState) + num_channels * 4 &&
+            chunk->ckSize >= sizeof (SamplerChunk) + sizeof (LoopState) + num_channels * 4) {
+                memcpy (&parser->loop_state, data + sizeof (SamplerChunk), sizeof (LoopState));
+                adpcm_little_endian_to_native (&parser->loop_state, LoopStateFormat);
+                memcpy (parser->loop_state_data, data + sizeof (SamplerChunk) + sizeof (LoopState), num_channels * 4);
+                parser->has_loop_state = !strncmp (parser->loop_state.ID, "xqls", 4);
+        }
+    }
+
+    return ADPCM_RIFF_MORE;
+}
+
+// On the data chunk, work out the size and number of samples (zero if unknown, i.e., streamed).
+// For ADPCM the last block may be partial, and then the fact chunk (or ds64) has the real count,
+// unless it's clearly wrong (some old encoders counted both channels of stereo).
+
+static int data_chunk (RiffParser *parser)
+{
+    WaveHeader *wave = &parser->wave;
+
+    if (!wave->NumChannels)         // make sure we saw a "fmt" chunk...
+        return ADPCM_RIFF_INVALID;
+
+    parser->data_offset = parser->position;
+    parser->data_size = parser->chunk.ckSize == (uint32_t) -1 ? parser->ds64_data_size : parser->chunk.ckSize;
+
+    if (!parser->data_size)
+        parser->num_samples = 0;
+    else if (parser->format != WAVE_FORMAT_IMA_ADPCM) {
+        if (parser->data_size % wave->BlockAlign)
+            return ADPCM_RIFF_INVALID;
+
+        parser->num_samples = parser->data_size / wave->BlockAlign;
+    }
+    else {
+        uint64_t complete_blocks = parser->data_size / wave->BlockAlign, num_samples, fact_samples = parser->fact_samples;
+        int leftover_bytes = (int) (parser->data_size % wave->BlockAlign), samples_last_block;
+
+        num_samples = complete_blocks * wave->Samples.SamplesPerBlock;
+
+        if (leftover_bytes) {
+            if (leftover_bytes < wave->NumChannels * 4 || adpcm_block_size (adpcm_block_samples (leftover_bytes,
+                wave->NumChannels, parser->bits_per_sample), wave->NumChannels, parser->bits_per_sample) != (size_t) leftover_bytes)
+                    return ADPCM_RIFF_INVALID;
+
+            samples_last_block = adpcm_block_samples (leftover_bytes, wave->NumChannels, parser->bits_per_sample);
+            num_samples += samples_last_block;
+        }
+        else
+            samples_last_block = wave->Samples.SamplesPerBlock;
+
+        if (fact_samples == (uint32_t) -1 && parser->ds64_samples) {
+            if (parser->ds64_samples < num_samples && parser->ds64_samples > num_samples - samples_last_block)
+                num_samples = parser->ds64_samples;
+        }
+        else if (fact_samples && fact_samples != num_samples) {
+            if (fact_samples < num_samples && fact_samples > num_samples - samples_last_block)
+                num_samples = fact_samples;
+            else if (wave->NumChannels == 2 && (fact_samples >>= 1) < num_samples && fact_samples > num_samples - samples_last_block)
+                num_samples = fact_samples;
+        }
+
+        parser->num_samples = num_samples;
+    }
+
+    return ADPCM_RIFF_DATA;
+}
+
+/* Parse as much of the header as possible from the given bytes of the file, which must start at
+ * parser->position. Bytes past what the parser wants are used too, so a caller that has the whole
+ * header in memory can pass it all at once. Otherwise the caller reads just the want bytes (which
+ * never go past the start of the audio data, so this works on pipes and simple readers) after
+ * skipping (or reading) any bytes between its position in the file and parser->position.
+ *
+ * Parameters:
+ *  parser          parser state, from adpcm_riff_init() (and the results, once complete)
+ *  data            bytes of the file starting at parser->position
+ *  size            number of bytes at data (less than parser->want just returns ADPCM_RIFF_MORE)
+ *
+ * Returns ADPCM_RIFF_DATA when the data chunk is found (the results are then valid and the audio
+ * starts at data_offset), ADPCM_RIFF_MORE when the next call should pass want bytes starting at
+ * (the now updated) position, or ADPCM_RIFF_INVALID or ADPCM_RIFF_UNSUPPORTED.
+ */
+
+int adpcm_riff_parse (RiffParser *parser, const void *data, size_t size)
+{
+    const unsigned char *dp = data;
+    uint32_t bytes;
+
+#define CONSUME(n) do { dp += (n); size -= (n); parser->position += (n); } while (0)
+#define SKIP(n) do { if ((n) <= size) CONSUME (n); else { parser->position += (n); size = 0; } } while (0)
+
+    while (size >= parser->want) {
+        if (parser->state == RIFF_STATE_START) {
+            RiffChunkHeader riff_chunk_header;
+
+            memcpy (&riff_chunk_header, dp, sizeof (RiffChunkHeader));
+
+            if ((strncmp (riff_chunk_header.ckID, "RIFF", 4) && strncmp (riff_chunk_header.ckID, "RF64", 4) &&
+                strncmp (riff_chunk_header.ckID, "BW64", 4)) || strncmp (riff_chunk_header.formType, "WAVE", 4))
+                    return ADPCM_RIFF_INVALID;
+
+            CONSUME (sizeof (RiffChunkHeader));
+            parser->state = RIFF_STATE_HEADER;
+            parser->want = sizeof (ChunkHeader);
+        }
+        else if (parser->state == RIFF_STATE_HEADER) {
+            ChunkHeader *chunk = &parser->chunk;
+            uint32_t interest;
+
+            memcpy (chunk, dp, sizeof (ChunkHeader));
+            adpcm_little_endian_to_native (chunk, ChunkHeaderFormat);
+            CONSUME (sizeof (ChunkHeader));
+
+            if (!strncmp (chunk->ckID, "data", 4))
+                return data_chunk (parser);
+
+            if (chunk->ckSize == (uint32_t) -1 ||
+                (!strncmp (chunk->ckID, "fmt ", 4) && (chunk->ckSize < 16 || chunk->ckSize > sizeof (WaveHeader))) ||
+                (!strncmp (chunk->ckID, "fact", 4) && chunk->ckSize < 4) ||
+                (!strncmp (chunk->ckID, "ds64", 4) && chunk->ckSize < sizeof (DS64Chunk)))
+                    return ADPCM_RIFF_INVALID;
+
+            bytes = chunk->ckSize + (chunk->ckSize & 1);
+
+            // ask for the part we look at, along with the next chunk header if that's all of it
+
+            if ((interest = chunk_interest (chunk))) {
+                parser->state = RIFF_STATE_BODY;
+                parser->want = interest == bytes ? bytes + sizeof (ChunkHeader) : interest;
+                continue;
+            }
+
+            if (parser->chunk_func)
+                parser->chunk_func (parser->context, chunk, parser->position, dp, size < bytes ? (uint32_t) size : bytes);
+
+            SKIP (bytes);
+        }
+        else {
+            uint32_t interest = chunk_interest (&parser->chunk);
+            int res = parse_chunk (parser, dp);
+
+            if (res != ADPCM_RIFF_MORE)
+                return res;
+
+            if (!strncmp (parser->chunk.ckID, "smpl", 4) && parser->chunk_func)
+                parser->chunk_func (parser->context, &parser->chunk, parser->position, dp, interest);
+
+            bytes = parser->chunk.ckSize + (parser->chunk.ckSize & 1) - interest;
+            CONSUME (interest);
+            SKIP (bytes);
+            parser->state = RIFF_STATE_HEADER;
+        }
+
+        parser->want = sizeof (ChunkHeader);
+    }
+
+#undef CONSUME
+#undef SKIP
+
+    return ADPCM_RIFF_MORE;
+}
+
+/* Convert the fields of a structure between the little-endian byte order of the file and native
+ * order, where format has an 'L' for each 32-bit field, an 'S' for each 16-bit field and digits
+ * for bytes to leave alone (e.g., "4L" for a chunk header).
+ */
+
+void adpcm_little_endian_to_native (void *data, const char *format)
+{
+    unsigned char *cp = (unsigned char *) data;
+    int32_t temp;
+
+    while (*format) {
+        switch (*format) {
+            case 'L':
+                temp = cp [0] + ((int32_t) cp [1] << 8) + ((int32_t) cp [2] << 16) + ((int32_t) cp [3] << 24);
+                * (int32_t *) cp = temp;
+                cp += 4;
+                break;
+
+            case 'S':
+                temp = cp [0] + (cp [1] << 8);
+                * (short *) cp = (short) temp;
+                cp += 2;
+                break;
+
+            default:
+                if (isdigit ((unsigned char) *format))
+                    cp += *format - '0';
+
+                break;
+        }
+
+        format++;
+    }
+}
+
+void adpcm_native_to_little_endian (void *data, const char *format)
+{
+    unsigned char *cp = (unsigned char *) data;
+    int32_t temp;
+
+    while (*format) {
+        switch (*format) {
+            case 'L':
+                temp = * (int32_t *) cp;
+                *cp++ = (unsigned char) temp;
+                *cp++ = (unsigned char) (temp >> 8);
+                *cp++ = (unsigned char) (temp >> 16);
+                *cp++ = (unsigned char) (temp >> 24);
+                break;
+
+            case 'S':
+                temp = * (short *) cp;
+                *cp++ = (unsigned char) temp;
+                *cp++ = (unsigned char) (temp >> 8);
+                break;
+
+            default:
+                if (isdigit ((unsigned char) *format))
+                    cp += *format - '0';
+
+                break;
+        }
+
+        format++;
+    }
+}
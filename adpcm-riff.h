@@ -0,0 +1,105 @@
+////////////////////////////////////////////////////////////////////////////
+//                           **** ADPCM-XQ ****                           //
+//                  Xtreme Quality ADPCM Encoder/Decoder                  //
+//                    Copyright (c) 2015 David Bryant.                    //
+//                          All Rights Reserved.                          //
+//      Distributed under the BSD Software License (see license.txt)      //
+////////////////////////////////////////////////////////////////////////////
+
+#ifndef ADPCMRIFF_H_
+#define ADPCMRIFF_H_
+
+#include "adpcm-lib.h"
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+    char formType [4];
+} RiffChunkHeader;
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+} ChunkHeader;
+
+#define ChunkHeaderFormat "4L"
+
+typedef struct {
+    uint16_t FormatTag, NumChannels;
+    uint32_t SampleRate, BytesPerSecond;
+    uint16_t BlockAlign, BitsPerSample;
+    uint16_t cbSize;
+    union {
+        uint16_t ValidBitsPerSample;
+        uint16_t SamplesPerBlock;
+        uint16_t Reserved;
+    } Samples;
+    int32_t ChannelMask;
+    uint16_t SubFormat;
+    char GUID [14];
+} WaveHeader;
+
+#define WaveHeaderFormat "SSLLSSSSLS"
+
+// This is stored as the "sampler specific data" of the smpl chunk and holds the exact decoder
+// state at the loop start so that a player can jump back there without decoding from the header
+// of the block containing it. The per-channel state has the same layout as an ADPCM block header
+// and follows this structure. The ID is only written once the state is known (which requires a
+// seekable output file); otherwise it is left zeroed and players must decode from the block start.
+
+typedef struct {
+    char ID [4];                            // "xqls"
+    uint32_t BlockOffset;                   // offset of block containing loop start in data chunk
+    uint16_t BlockSample;                   // index of loop start sample in that block
+    uint16_t Reserved;
+} LoopState;
+
+#define LoopStateFormat "4LSS"
+
+#define WAVE_FORMAT_PCM         0x1
+#define WAVE_FORMAT_IEEE_FLOAT  0x3
+#define WAVE_FORMAT_IMA_ADPCM   0x11
+#define WAVE_FORMAT_EXTENSIBLE  0xfffe
+
+#define ADPCM_RIFF_DATA         0       // header parsed, the audio data starts at data_offset
+#define ADPCM_RIFF_MORE         1       // call again with want bytes of the file from position
+#define ADPCM_RIFF_INVALID      (-1)    // not a (valid) RIFF/RF64/BW64 WAVE file
+#define ADPCM_RIFF_UNSUPPORTED  (-2)    // valid, but not PCM, float or IMA ADPCM that we can handle
+
+#define ADPCM_RIFF_MAX_WANT     128     // the most bytes that want can ask for
+
+// called for each chunk that's not one of the basic ones (fmt, fact, ds64, data), which includes
+// smpl; data holds the first available bytes of the chunk (which may be all, some, or none of it)
+
+typedef void (*RiffChunkFunc) (void *context, const ChunkHeader *header, uint64_t offset, const void *data, uint32_t available);
+
+typedef struct {
+    // what was found (valid once ADPCM_RIFF_DATA is returned)
+
+    WaveHeader wave;                        // the fmt chunk, native byte order
+    int wave_size, format, bits_per_sample; // fmt chunk size, format tag (the sub-format if extensible)
+    uint32_t fact_samples;                  // zero if no fact chunk
+    uint64_t ds64_data_size, ds64_samples;  // zero if no ds64 chunk
+    uint64_t data_offset, data_size;        // data_size is zero if unknown (streamed)
+    uint64_t num_samples;                   // zero if unknown
+    uint32_t loop_start, loop_end;          // first loop of the smpl chunk, if has_loop
+    int has_loop, has_loop_state;           // has_loop_state when it's followed by a LoopState
+    LoopState loop_state;
+    uint8_t loop_state_data [ADPCM_MAX_CHANNELS * 4];
+
+    // the parser: the next call needs (at least) want bytes of the file starting at position
+
+    uint64_t position;
+    uint32_t want;
+    int state;
+    ChunkHeader chunk;
+    RiffChunkFunc chunk_func;
+    void *context;
+} RiffParser;
+
+void adpcm_riff_init (RiffParser *parser, RiffChunkFunc chunk_func, void *context);
+int adpcm_riff_parse (RiffParser *parser, const void *data, size_t size);
+void adpcm_little_endian_to_native (void *data, const char *format);
+void adpcm_native_to_little_endian (void *data, const char *format);
+
+#endif /* ADPCMRIFF_H_ */
@@ -6,12 +6,42 @@
 //      Distributed under the BSD Software License (see license.txt)      //
 ////////////////////////////////////////////////////////////////////////////
 
+// files over 2GB on 32-bit hosts (RF64 output can be any size), which also needs the
+// positions in them to be 64-bit (int64_t here, see fseeko() below)
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <math.h>
+
+#if defined (_WIN32)
+#include <io.h>
+#include <fcntl.h>
+#endif
+
+#if defined (_MSC_VER)
+#define fseeko _fseeki64
+#define ftello _ftelli64
+#endif
+
+#if defined (__unix__) || defined (__APPLE__)
+#include <sys/stat.h>
+#include <unistd.h>
+#include <dirent.h>
+#define HAVE_DIRENT
+#if !defined (NO_MMAP)
+#include <sys/mman.h>
+#define HAVE_MMAP
+#endif
+#endif
+
+#ifdef ENABLE_THREADS
+#include <pthread.h>
+#endif
 
 #include "adpcm-lib.h"
+#include "adpcm-riff.h"
 
 static const char *sign_on = "\n"
 " ADPCM-XQ   Xtreme Quality IMA-ADPCM WAV Encoder / Decoder   Version 0.3\n"
@@ -20,29 +50,72 @@ static const char *sign_on = "\n"
 static const char *usage =
 " Usage:     ADPCM-XQ [-options] infile.wav outfile.wav\n\n"
 " Operation: conversion is performed based on the type of the infile\n"
-"          (either encode 16-bit PCM to 4-bit IMA-ADPCM or decode back)\n\n"
+"          (either encode PCM to IMA-ADPCM or decode back); PCM may be\n"
+"          16-bit, 24-bit, 32-bit or float (converted to 16-bit as read);\n"
+"          use - for stdin or stdout (input length may then be unknown)\n\n"
 " Options:  -[0-8] = encode lookahead samples (default = 3)\n"
+"           -a     = with -s, cut ranges at the exact samples (re-encoding the\n"
+"                    blocks that no longer line up) instead of at blocks\n"
 "           -bn    = override auto block size, 2^n bytes (n = 8-15)\n"
+"           -bauto[,s]= choose the block size by trial encoding parts of the\n"
+"                    infile at each size (best SNR for the bytes, or the\n"
+"                    smallest file that reaches s dB SNR)\n"
+"           -c     = encode the .wav files in infile (a directory or a text\n"
+"                    file listing them) into a C header of PROGMEM arrays\n"
 "           -d     = decode only (fail on WAV file already PCM)\n"
 "           -e     = encode only (fail on WAV file already ADPCM)\n"
 "           -f     = encode flat noise (no dynamic noise shaping)\n"
 "           -h     = display this help message\n"
+"           -n     = don't pass other RIFF chunks (LIST, cue, smpl, etc.) of the\n"
+"                    infile on to the outfile\n"
+"           -p     = encode the .wav files in infile (as with -c) into a pack\n"
+"                    file of raw clips with an index (C header with -c), which\n"
+"                    has the loop of each file's smpl chunk (if any)\n"
+"           -kdir  = with -c or -p, keep encoded files in cache directory dir and\n"
+"                    reuse them when the input and options are unchanged\n"
+"           -j[n]  = batch mode: convert the .wav files in infile (a directory\n"
+"                    or a text file listing them) to the outfile directory,\n"
+"                    n at a time (default = number of cores with threads)\n"
+"           -ls[,e]= store loop points (first & last sample) in smpl chunk\n"
 "           -q     = quiet mode (display errors only)\n"
 "           -r     = raw output (no WAV header written)\n"
+"           -s     = splice mode: join the ADPCM .wav files in infile (one file\n"
+"                    or a list, as with -c; name@s[,e] uses samples s to e)\n"
+"                    into outfile, copying the blocks without re-encoding\n"
+"           -t     = TPDF dither when converting 24-bit, 32-bit or float input\n"
+"                    to 16-bit (default is to round)\n"
 "           -v     = verbose (display lots of info)\n"
+"           -wn    = encode n bits per sample (n = 2-4, default = 4; 2 and 3\n"
+"                    are lower bitrate, ffmpeg-compatible modes)\n"
 "           -y     = overwrite outfile if it exists\n\n"
 " Web:       Visit www.github.com/dbry/adpcm-xq for latest version and info\n\n";
 
 #define ADPCM_FLAG_NOISE_SHAPING    0x1
 #define ADPCM_FLAG_RAW_OUTPUT       0x2
-
-static int adpcm_converter (char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead);
+#define ADPCM_FLAG_2BIT             0x4
+#define ADPCM_FLAG_3BIT             0x8
+#define ADPCM_FLAG_DITHER           0x10
+#define ADPCM_FLAG_PASS_CHUNKS      0x20
+
+#define ADPCM_FLAG_BITS(flags) (((flags) & ADPCM_FLAG_2BIT) ? 2 : ((flags) & ADPCM_FLAG_3BIT) ? 3 : 4)
+
+static int adpcm_converter (char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead, uint32_t *loop_points);
+static int batch_converter (char *source, char *outdir, int flags, int blocksize_pow2, int lookahead, int num_workers, int overwrite);
+static int header_generator (char *source, char *outfilename, int flags, int blocksize_pow2, int lookahead, char *cache_dir);
+static int pack_generator (char *source, char *outfilename, int flags, int blocksize_pow2, int lookahead, char *cache_dir, int header);
+static int splice_generator (char *source, char *outfilename, int flags, int lookahead, int accurate);
 static int verbosity = 0, decode_only = 0, encode_only = 0;
+static double auto_block_snr = 0.0;     // target SNR in dB for -bauto, 0 = best SNR for the bytes
+#ifdef ENABLE_THREADS
+static int channel_workers = 0;         // threads encoding the channels of a file, 0 = one per core
+#endif
 
 int main (argc, argv) int argc; char **argv;
 {
-    int lookahead = 3, flags = ADPCM_FLAG_NOISE_SHAPING, blocksize_pow2 = 0, overwrite = 0, asked_help = 0;
-    char *infilename = NULL, *outfilename = NULL;
+    int lookahead = 3, flags = ADPCM_FLAG_NOISE_SHAPING | ADPCM_FLAG_PASS_CHUNKS, blocksize_pow2 = 0, overwrite = 0, asked_help = 0, batch_workers = -1, header = 0, pack = 0;
+    int splice = 0, accurate = 0;
+    uint32_t loop_points [2], *loops = NULL;
+    char *infilename = NULL, *outfilename = NULL, *cache_dir = NULL;
     FILE *outfile;
 
     // if the name of the executable ends in "encoder" or "decoder", just do that function
@@ -66,7 +139,29 @@ int main (argc, argv) int argc; char **argv;
                         lookahead = **argv - '0';
                         break;
 
+                    case 'A': case 'a':
+                        accurate = 1;
+                        break;
+
                     case 'B': case 'b':
+                        if (!strncmp (*argv + 1, "auto", 4)) {
+                            blocksize_pow2 = -1;
+                            *argv += 4;
+
+                            if ((*argv) [1] == ',') {
+                                auto_block_snr = strtod (*argv + 2, argv);
+
+                                if (auto_block_snr <= 0.0 || auto_block_snr > 100.0) {
+                                    fprintf (stderr, "\ntarget SNR must be above 0 and up to 100 dB!\n");
+                                    return -1;
+                                }
+
+                                --*argv;
+                            }
+
+                            break;
+                        }
+
                         blocksize_pow2 = strtol (++*argv, argv, 10);
 
                         if (blocksize_pow2 < 8 || blocksize_pow2 > 15) {
@@ -77,6 +172,10 @@ int main (argc, argv) int argc; char **argv;
                         --*argv;
                         break;
 
+                    case 'C': case 'c':
+                        header = 1;
+                        break;
+
                     case 'D': case 'd':
                         decode_only = 1;
                         break;
@@ -93,6 +192,51 @@ int main (argc, argv) int argc; char **argv;
                         asked_help = 0;
                         break;
 
+                    case 'J': case 'j':
+                        batch_workers = strtol (++*argv, argv, 10);
+
+                        if (batch_workers < 0 || batch_workers > 256) {
+                            fprintf (stderr, "\nbatch workers must be 0 (auto) to 256!\n");
+                            return -1;
+                        }
+
+                        --*argv;
+                        break;
+
+                    case 'K': case 'k':
+                        if (!*++*argv) {
+                            fprintf (stderr, "\nno cache directory specified!\n");
+                            return -1;
+                        }
+
+                        cache_dir = *argv;
+                        *argv += strlen (*argv) - 1;
+                        break;
+
+                    case 'L': case 'l':
+                        loop_points [0] = strtoul (++*argv, argv, 10);
+                        loop_points [1] = (uint32_t) -1;
+
+                        if (**argv == ',')
+                            loop_points [1] = strtoul (++*argv, argv, 10);
+
+                        if (loop_points [1] < loop_points [0]) {
+                            fprintf (stderr, "\nloop end must not precede loop start!\n");
+                            return -1;
+                        }
+
+                        loops = loop_points;
+                        --*argv;
+                        break;
+
+                    case 'N': case 'n':
+                        flags &= ~ADPCM_FLAG_PASS_CHUNKS;
+                        break;
+
+                    case 'P': case 'p':
+                        pack = 1;
+                        break;
+
                     case 'Q': case 'q':
                         verbosity = -1;
                         break;
@@ -101,10 +245,32 @@ int main (argc, argv) int argc; char **argv;
                         flags |= ADPCM_FLAG_RAW_OUTPUT;
                         break;
 
+                    case 'S': case 's':
+                        splice = 1;
+                        break;
+
+                    case 'T': case 't':
+                        flags |= ADPCM_FLAG_DITHER;
+                        break;
+
                     case 'V': case 'v':
                         verbosity = 1;
                         break;
 
+                    case 'W': case 'w':
+                        switch (strtol (++*argv, argv, 10)) {
+                            case 2: flags = (flags & ~ADPCM_FLAG_3BIT) | ADPCM_FLAG_2BIT; break;
+                            case 3: flags = (flags & ~ADPCM_FLAG_2BIT) | ADPCM_FLAG_3BIT; break;
+                            case 4: flags &= ~(ADPCM_FLAG_2BIT | ADPCM_FLAG_3BIT); break;
+
+                            default:
+                                fprintf (stderr, "\nbits per sample must be 2 to 4!\n");
+                                return -1;
+                        }
+
+                        --*argv;
+                        break;
+
                     case 'Y': case 'y':
                         overwrite = 1;
                         break;
@@ -135,473 +301,2622 @@ int main (argc, argv) int argc; char **argv;
         return 0;
     }
 
-    if (!strcmp (infilename, outfilename)) {
+    if (splice) {
+        if (loops || batch_workers >= 0 || header || pack || cache_dir || decode_only) {
+            fprintf (stderr, "loop points, batch mode, decoding, -c, -p and -k can't be used with -s!\n");
+            return -1;
+        }
+
+        if (!overwrite && strcmp (outfilename, "-") && (outfile = fopen (outfilename, "r"))) {
+            fclose (outfile);
+            fprintf (stderr, "output file \"%s\" exists (use -y to overwrite)\n", outfilename);
+            return -1;
+        }
+
+        return splice_generator (infilename, outfilename, flags, lookahead, accurate);
+    }
+
+    if (accurate) {
+        fprintf (stderr, "sample-accurate cuts (-a) can only be used with -s!\n");
+        return -1;
+    }
+
+    if (header || pack) {
+        if (loops || batch_workers >= 0 || decode_only) {
+            fprintf (stderr, "loop points, batch mode and decoding can't be used with -c or -p!\n");
+            return -1;
+        }
+
+        if (!overwrite && strcmp (outfilename, "-") && (outfile = fopen (outfilename, "r"))) {
+            fclose (outfile);
+            fprintf (stderr, "output file \"%s\" exists (use -y to overwrite)\n", outfilename);
+            return -1;
+        }
+
+        // a pack only takes the audio from the encoded files, so the chunks are passed on there for
+        // the loop of a smpl chunk to reach the index (see check_passed_loop())
+
+        if (pack)
+            return pack_generator (infilename, outfilename, flags & ~ADPCM_FLAG_RAW_OUTPUT, blocksize_pow2, lookahead, cache_dir, header);
+
+        flags &= ~ADPCM_FLAG_PASS_CHUNKS;       // metadata would just take space in the arrays
+        return header_generator (infilename, outfilename, flags, blocksize_pow2, lookahead, cache_dir);
+    }
+
+    if (cache_dir) {
+        fprintf (stderr, "the encode cache can only be used with -c or -p!\n");
+        return -1;
+    }
+
+    if (batch_workers >= 0) {
+        if (loops) {
+            fprintf (stderr, "loop points can't be used in batch mode!\n");
+            return -1;
+        }
+
+        return batch_converter (infilename, outfilename, flags, blocksize_pow2, lookahead, batch_workers, overwrite);
+    }
+
+    if (!strcmp (infilename, outfilename) && strcmp (outfilename, "-")) {
         fprintf (stderr, "can't overwrite input file (specify different/new output file name)\n");
         return -1;
     }
 
-    if (!overwrite && (outfile = fopen (outfilename, "r"))) {
+    if (!overwrite && strcmp (outfilename, "-") && (outfile = fopen (outfilename, "r"))) {
         fclose (outfile);
         fprintf (stderr, "output file \"%s\" exists (use -y to overwrite)\n", outfilename);
         return -1;
     }
 
-    return adpcm_converter (infilename, outfilename, flags, blocksize_pow2, lookahead);
+    return adpcm_converter (infilename, outfilename, flags, blocksize_pow2, lookahead, loops);
 }
 
-typedef struct {
-    char ckID [4];
-    uint32_t ckSize;
-    char formType [4];
-} RiffChunkHeader;
-
-typedef struct {
-    char ckID [4];
-    uint32_t ckSize;
-} ChunkHeader;
-
-#define ChunkHeaderFormat "4L"
+// Batch mode converts many files in one process: the list is built up front (from a directory or
+// a text file with one input name per line) and then workers (threads, when available) take the
+// next file from it until it's done. Per-file output is suppressed (errors still show) and a failed
+// file does not stop the others; we print one line per file and a summary at the end.
 
 typedef struct {
-    uint16_t FormatTag, NumChannels;
-    uint32_t SampleRate, BytesPerSecond;
-    uint16_t BlockAlign, BitsPerSample;
-    uint16_t cbSize;
-    union {
-        uint16_t ValidBitsPerSample;
-        uint16_t SamplesPerBlock;
-        uint16_t Reserved;
-    } Samples;
-    int32_t ChannelMask;
-    uint16_t SubFormat;
-    char GUID [14];
-} WaveHeader;
-
-#define WaveHeaderFormat "SSLLSSSSLS"
+    char **infilenames, **outfilenames;
+    int num_files, next_file, num_failed, verbosity;
+    int flags, blocksize_pow2, lookahead, overwrite;
+#ifdef ENABLE_THREADS
+    pthread_mutex_t mutex;
+#endif
+} BatchJobs;
 
-typedef struct {
-    char ckID [4];
-    uint32_t ckSize;
-    uint32_t TotalSamples;
-} FactHeader;
+static int batch_convert_file (BatchJobs *jobs, int index)
+{
+    char *infilename = jobs->infilenames [index], *outfilename = jobs->outfilenames [index];
+    FILE *outfile;
 
-#define FactHeaderFormat "4LL"
+    if (!strcmp (infilename, outfilename)) {
+        fprintf (stderr, "can't overwrite input file \"%s\"\n", infilename);
+        return -1;
+    }
 
-#define WAVE_FORMAT_PCM         0x1
-#define WAVE_FORMAT_IMA_ADPCM   0x11
-#define WAVE_FORMAT_EXTENSIBLE  0xfffe
+    if (!jobs->overwrite && (outfile = fopen (outfilename, "r"))) {
+        fclose (outfile);
+        fprintf (stderr, "output file \"%s\" exists (use -y to overwrite)\n", outfilename);
+        return -1;
+    }
 
-static int write_pcm_wav_header (FILE *outfile, int num_channels, size_t num_samples, int sample_rate);
-static int write_adpcm_wav_header (FILE *outfile, int num_channels, size_t num_samples, int sample_rate, int samples_per_block);
-static int adpcm_decode_data (FILE *infile, FILE *outfile, int num_channels, size_t num_samples, int block_size);
-static int adpcm_encode_data (FILE *infile, FILE *outfile, int num_channels, size_t num_samples, int samples_per_block, int lookahead, int noise_shaping);
-static void little_endian_to_native (void *data, char *format);
-static void native_to_little_endian (void *data, char *format);
+    return adpcm_converter (infilename, outfilename, jobs->flags, jobs->blocksize_pow2, jobs->lookahead, NULL);
+}
 
-static int adpcm_converter (char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead)
+static void *batch_worker (void *arg)
 {
-    int format = 0, res = 0, bits_per_sample, sample_rate, num_channels;
-    uint32_t fact_samples = 0;
-    size_t num_samples = 0;
-    FILE *infile, *outfile;
-    RiffChunkHeader riff_chunk_header;
-    ChunkHeader chunk_header;
-    WaveHeader WaveHeader;
+    BatchJobs *jobs = (BatchJobs *) arg;
 
-    if (!(infile = fopen (infilename, "rb"))) {
-        fprintf (stderr, "can't open file \"%s\" for reading!\n", infilename);
-        return -1;
-    }
+    while (1) {
+        int index, res;
 
-    // read initial RIFF form header
+#ifdef ENABLE_THREADS
+        pthread_mutex_lock (&jobs->mutex);
+#endif
+        index = jobs->next_file < jobs->num_files ? jobs->next_file++ : -1;
+#ifdef ENABLE_THREADS
+        pthread_mutex_unlock (&jobs->mutex);
+#endif
 
-    if (!fread (&riff_chunk_header, sizeof (RiffChunkHeader), 1, infile) ||
-        strncmp (riff_chunk_header.ckID, "RIFF", 4) ||
-        strncmp (riff_chunk_header.formType, "WAVE", 4)) {
-            fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-            return -1;
-    }
+        if (index < 0)
+            break;
 
-    // loop through all elements of the RIFF wav header (until the data chuck)
+        res = batch_convert_file (jobs, index);
 
-    while (1) {
+#ifdef ENABLE_THREADS
+        pthread_mutex_lock (&jobs->mutex);
+#endif
+        if (res)
+            jobs->num_failed++;
 
-        if (!fread (&chunk_header, sizeof (ChunkHeader), 1, infile)) {
-            fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-            return -1;
-        }
+        if (jobs->verbosity >= 0 || res)
+            fprintf (stderr, "%s \"%s\"\n", res ? "FAILED" : "converted", jobs->infilenames [index]);
+#ifdef ENABLE_THREADS
+        pthread_mutex_unlock (&jobs->mutex);
+#endif
+    }
 
-        little_endian_to_native (&chunk_header, ChunkHeaderFormat);
+    return NULL;
+}
 
-        // if it's the format chunk, we want to get some info out of there and
-        // make sure it's a .wav file we can handle
+static char *basename_of (char *filename)
+{
+    char *basename = filename + strlen (filename);
 
-        if (!strncmp (chunk_header.ckID, "fmt ", 4)) {
-            int supported = 1;
+    while (basename > filename && basename [-1] != '/' && basename [-1] != '\\')
+        basename--;
 
-            if (chunk_header.ckSize < 16 || chunk_header.ckSize > sizeof (WaveHeader) ||
-                !fread (&WaveHeader, chunk_header.ckSize, 1, infile)) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return -1;
-            }
+    return basename;
+}
 
-            little_endian_to_native (&WaveHeader, WaveHeaderFormat);
+static int add_filename (BatchJobs *jobs, const char *filename)
+{
+    char **infilenames = realloc (jobs->infilenames, (jobs->num_files + 1) * sizeof (char *));
+
+    if (!infilenames || !(infilenames [jobs->num_files] = malloc (strlen (filename) + 1))) {
+        fprintf (stderr, "could not allocate memory for file list!\n");
+        return 0;
+    }
 
-            format = (WaveHeader.FormatTag == WAVE_FORMAT_EXTENSIBLE && chunk_header.ckSize == 40) ?
-                WaveHeader.SubFormat : WaveHeader.FormatTag;
+    strcpy ((jobs->infilenames = infilenames) [jobs->num_files++], filename);
+    return 1;
+}
 
-            bits_per_sample = (chunk_header.ckSize == 40 && WaveHeader.Samples.ValidBitsPerSample) ?
-                WaveHeader.Samples.ValidBitsPerSample : WaveHeader.BitsPerSample;
+static int compare_names (const void *a, const void *b)
+{
+    return strcmp (* (char * const *) a, * (char * const *) b);
+}
 
-            if (WaveHeader.NumChannels < 1 || WaveHeader.NumChannels > 2)
-                supported = 0;
-            else if (format == WAVE_FORMAT_PCM) {
-                if (decode_only) {
-                    fprintf (stderr, "\"%s\" is PCM .WAV file, invalid in decode-only mode!\n", infilename);
-                    return -1;
-                }
+// Build the list of input files from either a directory (all .wav files, sorted) or a text file
+// listing them one per line (blank lines and lines starting with # are skipped). If an output
+// directory is specified, the output names are the input basenames in that directory.
 
-                if (bits_per_sample < 9 || bits_per_sample > 16)
-                    supported = 0;
+static int list_files (BatchJobs *jobs, char *source, char *outdir)
+{
+    char line [4096];
+    FILE *list;
+    int i;
+#ifdef HAVE_DIRENT
+    struct stat st;
+
+    if (!stat (source, &st) && S_ISDIR (st.st_mode)) {
+        DIR *dir = opendir (source);
+        struct dirent *entry;
+
+        if (!dir) {
+            fprintf (stderr, "can't open directory \"%s\"!\n", source);
+            return 0;
+        }
 
-                if (WaveHeader.BlockAlign != WaveHeader.NumChannels * 2)
-                    supported = 0;
-            }
-            else if (format == WAVE_FORMAT_IMA_ADPCM) {
-                if (encode_only) {
-                    fprintf (stderr, "\"%s\" is ADPCM .WAV file, invalid in encode-only mode!\n", infilename);
-                    return -1;
-                }
+        while ((entry = readdir (dir))) {
+            size_t length = strlen (entry->d_name);
 
-                if (bits_per_sample != 4)
-                    supported = 0;
+            if (length > 4 && (!strcmp (entry->d_name + length - 4, ".wav") || !strcmp (entry->d_name + length - 4, ".WAV"))) {
+                snprintf (line, sizeof (line), "%s/%s", source, entry->d_name);
 
-                if (WaveHeader.Samples.SamplesPerBlock != (WaveHeader.BlockAlign - WaveHeader.NumChannels * 4) * (WaveHeader.NumChannels ^ 3) + 1) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return -1;
+                if (!add_filename (jobs, line)) {
+                    closedir (dir);
+                    return 0;
                 }
             }
-            else
-                supported = 0;
+        }
 
-            if (!supported) {
-                fprintf (stderr, "\"%s\" is an unsupported .WAV format!\n", infilename);
-                return -1;
-            }
+        closedir (dir);
+        qsort (jobs->infilenames, jobs->num_files, sizeof (char *), compare_names);
+    }
+    else
+#endif
+    if ((list = fopen (source, "r"))) {
+        while (fgets (line, sizeof (line), list)) {
+            size_t length = strlen (line);
 
-            if (verbosity > 0) {
-                fprintf (stderr, "format tag size = %d\n", chunk_header.ckSize);
-                fprintf (stderr, "FormatTag = 0x%x, NumChannels = %d, BitsPerSample = %d\n",
-                    WaveHeader.FormatTag, WaveHeader.NumChannels, WaveHeader.BitsPerSample);
-                fprintf (stderr, "BlockAlign = %d, SampleRate = %d, BytesPerSecond = %d\n",
-                    WaveHeader.BlockAlign, WaveHeader.SampleRate, WaveHeader.BytesPerSecond);
-
-                if (chunk_header.ckSize > 16) {
-                    if (format == WAVE_FORMAT_PCM)
-                        fprintf (stderr, "cbSize = %d, ValidBitsPerSample = %d\n", WaveHeader.cbSize,
-                            WaveHeader.Samples.ValidBitsPerSample);
-                    else if (format == WAVE_FORMAT_IMA_ADPCM)
-                        fprintf (stderr, "cbSize = %d, SamplesPerBlock = %d\n", WaveHeader.cbSize,
-                            WaveHeader.Samples.SamplesPerBlock);
-                }
+            while (length && (line [length - 1] == '\n' || line [length - 1] == '\r'))
+                line [--length] = 0;
 
-                if (chunk_header.ckSize > 20)
-                    fprintf (stderr, "ChannelMask = %x, SubFormat = %d\n",
-                        WaveHeader.ChannelMask, WaveHeader.SubFormat);
+            if (length && line [0] != '#' && !add_filename (jobs, line)) {
+                fclose (list);
+                return 0;
             }
         }
-        else if (!strncmp (chunk_header.ckID, "fact", 4)) {
 
-            if (chunk_header.ckSize < 4 || !fread (&fact_samples, sizeof (fact_samples), 1, infile)) {
-                fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                return -1;
-            }
+        fclose (list);
+    }
+    else {
+        fprintf (stderr, "can't open file list \"%s\" for reading!\n", source);
+        return 0;
+    }
 
-            if (chunk_header.ckSize > 4) {
-                int bytes_to_skip = chunk_header.ckSize - 4;
-                char dummy;
+    if (!jobs->num_files) {
+        fprintf (stderr, "no files to convert in \"%s\"!\n", source);
+        return 0;
+    }
 
-                while (bytes_to_skip--)
-                    if (!fread (&dummy, 1, 1, infile)) {
-                        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                        return -1;
-                    }
-            }
+    if (outdir) {
+        if (!(jobs->outfilenames = calloc (jobs->num_files, sizeof (char *)))) {
+            fprintf (stderr, "could not allocate memory for file list!\n");
+            return 0;
         }
-        else if (!strncmp (chunk_header.ckID, "data", 4)) {
 
-            // on the data chunk, get size and exit parsing loop
+        for (i = 0; i < jobs->num_files; ++i) {
+            char *basename = basename_of (jobs->infilenames [i]);
 
-            if (!WaveHeader.NumChannels) {      // make sure we saw a "fmt" chunk...
-                fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                return -1;
+            if (!(jobs->outfilenames [i] = malloc (strlen (outdir) + strlen (basename) + 2))) {
+                fprintf (stderr, "could not allocate memory for file list!\n");
+                return 0;
             }
 
-            if (!chunk_header.ckSize) {
-                fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
-                return -1;
-            }
+            sprintf (jobs->outfilenames [i], "%s/%s", outdir, basename);
+        }
+    }
 
-            if (format == WAVE_FORMAT_PCM) {
-                if (chunk_header.ckSize % WaveHeader.BlockAlign) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return -1;
-                }
+    return 1;
+}
 
-                num_samples = chunk_header.ckSize / WaveHeader.BlockAlign;
-            }
-            else {
-                int complete_blocks = chunk_header.ckSize / WaveHeader.BlockAlign;
-                int leftover_bytes = chunk_header.ckSize % WaveHeader.BlockAlign;
-                int samples_last_block;
-
-                num_samples = complete_blocks * WaveHeader.Samples.SamplesPerBlock;
-
-                if (leftover_bytes) {
-                    if (leftover_bytes % (WaveHeader.NumChannels * 4)) {
-                        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                        return -1;
-                    }
-                    if (verbosity > 0) fprintf (stderr, "data chunk has %d bytes left over for final ADPCM block\n", leftover_bytes);
-                    samples_last_block = (leftover_bytes - (WaveHeader.NumChannels * 4)) * (WaveHeader.NumChannels ^ 3) + 1;
-                    num_samples += samples_last_block;
-                }
-                else
-                    samples_last_block = WaveHeader.Samples.SamplesPerBlock;
-
-                if (fact_samples) {
-                    if (fact_samples < num_samples && fact_samples > num_samples - samples_last_block) {
-                        if (verbosity > 0) fprintf (stderr, "total samples reduced %lu by FACT chunk\n", (unsigned long) (num_samples - fact_samples));
-                        num_samples = fact_samples;
-                    }
-                    else if (WaveHeader.NumChannels == 2 && (fact_samples >>= 1) < num_samples && fact_samples > num_samples - samples_last_block) {
-                        if (verbosity > 0) fprintf (stderr, "num samples reduced %lu by [incorrect] FACT chunk\n", (unsigned long) (num_samples - fact_samples));
-                        num_samples = fact_samples;
-                    }
-                }
-            }
+static void free_files (BatchJobs *jobs)
+{
+    int i;
 
-            if (!num_samples) {
-                fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
-                return -1;
-            }
+    for (i = 0; i < jobs->num_files; ++i) {
+        free (jobs->infilenames [i]);
 
-            if (verbosity > 0)
-                fprintf (stderr, "num samples = %lu\n", (unsigned long) num_samples);
+        if (jobs->outfilenames)
+            free (jobs->outfilenames [i]);
+    }
 
-            num_channels = WaveHeader.NumChannels;
-            sample_rate = WaveHeader.SampleRate;
-            break;
-        }
-        else {          // just ignore unknown chunks
-            int bytes_to_eat = (chunk_header.ckSize + 1) & ~1L;
-            char dummy;
+    free (jobs->infilenames);
+    free (jobs->outfilenames);
+}
 
-            if (verbosity > 0)
-                fprintf (stderr, "extra unknown chunk \"%c%c%c%c\" of %d bytes\n",
-                    chunk_header.ckID [0], chunk_header.ckID [1], chunk_header.ckID [2],
-                    chunk_header.ckID [3], chunk_header.ckSize);
+static int batch_converter (char *source, char *outdir, int flags, int blocksize_pow2, int lookahead, int num_workers, int overwrite)
+{
+    BatchJobs jobs;
 
-            while (bytes_to_eat--)
-                if (!fread (&dummy, 1, 1, infile)) {
-                    fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
-                    return -1;
-                }
-        }
-    }
+    memset (&jobs, 0, sizeof (jobs));
+    jobs.flags = flags;
+    jobs.blocksize_pow2 = blocksize_pow2;
+    jobs.lookahead = lookahead;
+    jobs.overwrite = overwrite;
+    jobs.verbosity = verbosity;
 
-    if (!(outfile = fopen (outfilename, "wb"))) {
-        fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+    if (!list_files (&jobs, source, outdir)) {
+        free_files (&jobs);
         return -1;
     }
 
-    if (format == WAVE_FORMAT_PCM) {
-        int block_size, samples_per_block;
+    // the per-file messages (and progress) would be garbled by workers running at the same time
 
-        if (blocksize_pow2)
-            block_size = 1 << blocksize_pow2;
-        else
-            block_size = 256 * num_channels * (sample_rate < 11000 ? 1 : sample_rate / 11000);
+    verbosity = -1;
 
-        samples_per_block = (block_size - num_channels * 4) * (num_channels ^ 3) + 1;
+#ifdef ENABLE_THREADS
+    if (!num_workers) {
+#ifdef _SC_NPROCESSORS_ONLN
+        num_workers = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+        if (num_workers < 1)
+            num_workers = 1;
+    }
 
-        if (verbosity > 0)
-            fprintf (stderr, "each %d byte ADPCM block will contain %d samples * %d channels\n",
-                block_size, samples_per_block, num_channels);
+    if (num_workers > jobs.num_files)
+        num_workers = jobs.num_files;
 
-        if (!(flags & ADPCM_FLAG_RAW_OUTPUT) && !write_adpcm_wav_header (outfile, num_channels, num_samples, sample_rate, samples_per_block)) {
-            fprintf (stderr, "can't write header to file \"%s\" !\n", outfilename);
-            return -1;
-        }
+    if (jobs.verbosity > 0)
+        fprintf (stderr, "converting %d files with %d workers\n", jobs.num_files, num_workers);
 
-        if (verbosity >= 0) fprintf (stderr, "encoding PCM file \"%s\" to%sADPCM file \"%s\"...\n",
-            infilename, (flags & ADPCM_FLAG_RAW_OUTPUT) ? " raw " : " ", outfilename);
+    if (num_workers > 1) {
+        pthread_t *workers = malloc (num_workers * sizeof (pthread_t));
+        int started = 0, i;
 
-        res = adpcm_encode_data (infile, outfile, num_channels, num_samples, samples_per_block, lookahead,
-            (flags & ADPCM_FLAG_NOISE_SHAPING) ? (sample_rate > 64000 ? NOISE_SHAPING_STATIC : NOISE_SHAPING_DYNAMIC) : NOISE_SHAPING_OFF);
-    }
-    else if (format == WAVE_FORMAT_IMA_ADPCM) {
-        if (!(flags & ADPCM_FLAG_RAW_OUTPUT) && !write_pcm_wav_header (outfile, num_channels, num_samples, sample_rate)) {
-            fprintf (stderr, "can't write header to file \"%s\" !\n", outfilename);
-            return -1;
-        }
+        channel_workers = 1;            // the files are already in parallel
 
-        if (verbosity >= 0) fprintf (stderr, "decoding ADPCM file \"%s\" to%sPCM file \"%s\"...\n",
-            infilename, (flags & ADPCM_FLAG_RAW_OUTPUT) ? " raw " : " ", outfilename);
+        pthread_mutex_init (&jobs.mutex, NULL);
+
+        while (workers && started < num_workers && !pthread_create (workers + started, NULL, batch_worker, &jobs))
+            started++;
+
+        if (!started)                   // no threads, just do it here
+            batch_worker (&jobs);
+
+        for (i = 0; i < started; ++i)
+            pthread_join (workers [i], NULL);
 
-        res = adpcm_decode_data (infile, outfile, num_channels, num_samples, WaveHeader.BlockAlign);
+        pthread_mutex_destroy (&jobs.mutex);
+        free (workers);
     }
+    else {
+        pthread_mutex_init (&jobs.mutex, NULL);
+        batch_worker (&jobs);
+        pthread_mutex_destroy (&jobs.mutex);
+    }
+#else
+    (void) num_workers;                 // no threads, the files are done one at a time
+    batch_worker (&jobs);
+#endif
 
-    fclose (outfile);
-    fclose (infile);
-    return res;
+    if (jobs.verbosity >= 0)
+        fprintf (stderr, "%d of %d files converted successfully%s\n", jobs.num_files - jobs.num_failed, jobs.num_files,
+            jobs.num_failed ? ", see errors above" : "");
+
+    free_files (&jobs);
+    return jobs.num_failed ? 1 : 0;
 }
 
-static int write_pcm_wav_header (FILE *outfile, int num_channels, size_t num_samples, int sample_rate)
+// Header mode encodes every file in the list and writes the results as a C header for PROGMEM
+// (the format formerly generated by encoder.py): an enum of the sound names, one byte array per
+// sound holding a 32-bit size followed by the ADPCM .wav file, and a SNDEFFECTS[] table. Each file
+// is encoded to a temporary file and then streamed out as hex, so nothing is held in memory.
+
+static const char *header_prologue = "\n"
+"#ifndef __sndeffects_h__\n"
+"#define __sndeffects_h__\n"
+"#include <stdint.h>\n\n"
+"typedef struct adpcm_progm_s{\n"
+"  const uint32_t size;\n"
+"  const uint8_t content[0];\n"
+"}adpcm_progm_t;\n\n\n";
+
+static void sound_name (char *name, int size, char *filename)
 {
-    RiffChunkHeader riffhdr;
-    ChunkHeader datahdr, fmthdr;
-    WaveHeader wavhdr;
+    char *basename = basename_of (filename);
+    int i;
 
-    int wavhdrsize = 16;
-    int bytes_per_sample = 2;
-    size_t total_data_bytes = num_samples * bytes_per_sample * num_channels;
+    for (i = 0; i < size - 1 && basename [i] && basename [i] != '.'; ++i)
+        name [i] = basename [i];
 
-    memset (&wavhdr, 0, sizeof (wavhdr));
+    name [i] = 0;
+}
 
-    wavhdr.FormatTag = WAVE_FORMAT_PCM;
-    wavhdr.NumChannels = num_channels;
-    wavhdr.SampleRate = sample_rate;
-    wavhdr.BytesPerSecond = sample_rate * num_channels * bytes_per_sample;
-    wavhdr.BlockAlign = bytes_per_sample * num_channels;
-    wavhdr.BitsPerSample = 16;
+// write "size" bytes of "infile" (preceded by its 32-bit size) as comma-separated hex, 16 per line
 
-    strncpy (riffhdr.ckID, "RIFF", sizeof (riffhdr.ckID));
-    strncpy (riffhdr.formType, "WAVE", sizeof (riffhdr.formType));
-    riffhdr.ckSize = sizeof (riffhdr) + wavhdrsize + sizeof (datahdr) + total_data_bytes;
-    strncpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
-    fmthdr.ckSize = wavhdrsize;
+static int write_hex_array (FILE *outfile, FILE *infile, uint32_t size)
+{
+    static const char hex_digits [] = "0123456789abcdef";
+    uint8_t inbuf [4096], *inptr;
+    char outbuf [sizeof (inbuf) * 7], *outptr;
+    uint32_t index = 0, total = size + 4;
+    size_t count;
+
+    inbuf [0] = size;
+    inbuf [1] = size >> 8;
+    inbuf [2] = size >> 16;
+    inbuf [3] = size >> 24;
+    count = fread (inbuf + 4, 1, sizeof (inbuf) - 4, infile) + 4;
+
+    while (count) {
+        for (inptr = inbuf, outptr = outbuf; inptr < inbuf + count && index < total; ++inptr) {
+            *outptr++ = '0';
+            *outptr++ = 'x';
+            *outptr++ = hex_digits [*inptr >> 4];
+            *outptr++ = hex_digits [*inptr & 0xf];
+
+            if (++index < total) {
+                *outptr++ = ',';
+
+                if (!(index & 15)) {
+                    *outptr++ = '\n';
+                    *outptr++ = ' ';
+                }
+            }
+        }
 
-    strncpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
-    datahdr.ckSize = total_data_bytes;
+        if (fwrite (outbuf, 1, outptr - outbuf, outfile) != (size_t)(outptr - outbuf))
+            return 0;
 
-    // write the RIFF chunks up to just before the data starts
+        count = fread (inbuf, 1, sizeof (inbuf), infile);
+    }
 
-    native_to_little_endian (&riffhdr, ChunkHeaderFormat);
-    native_to_little_endian (&fmthdr, ChunkHeaderFormat);
-    native_to_little_endian (&wavhdr, WaveHeaderFormat);
-    native_to_little_endian (&datahdr, ChunkHeaderFormat);
+    return index == total;
+}
 
-    return fwrite (&riffhdr, sizeof (riffhdr), 1, outfile) &&
-        fwrite (&fmthdr, sizeof (fmthdr), 1, outfile) &&
-        fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
-        fwrite (&datahdr, sizeof (datahdr), 1, outfile);
+// The encode cache is content-addressed: files are named by a hash of the whole input file plus
+// every option that affects the encode (and a version that must change whenever the encoder
+// output does), so there's nothing to invalidate. A 64-bit FNV-1a hash plus the input length
+// is plenty to tell the assets of a project apart.
+
+static const char *cache_version = "adpcm-xq 0.3 cache 1";
+
+static uint64_t hash_bytes (uint64_t hash, const void *data, size_t count)
+{
+    const unsigned char *dptr = data;
+
+    while (count--)
+        hash = (hash ^ *dptr++) * 0x100000001b3ULL;
+
+    return hash;
 }
 
-static int write_adpcm_wav_header (FILE *outfile, int num_channels, size_t num_samples, int sample_rate, int samples_per_block)
+static int cache_filename (char *cachename, size_t size, char *cache_dir, char *infilename, int flags, int blocksize_pow2, int lookahead)
 {
-    RiffChunkHeader riffhdr;
-    ChunkHeader datahdr, fmthdr;
-    WaveHeader wavhdr;
-    FactHeader facthdr;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    unsigned char buffer [65536];
+    unsigned long length = 0;
+    size_t count;
+    char params [128];
+    FILE *infile;
+
+    if (!(infile = fopen (infilename, "rb")))
+        return 0;
 
-    int wavhdrsize = 20;
-    int block_size = (samples_per_block - 1) / (num_channels ^ 3) + (num_channels * 4);
-    size_t num_blocks = num_samples / samples_per_block;
-    int leftover_samples = num_samples % samples_per_block;
-    size_t total_data_bytes = num_blocks * block_size;
+    sprintf (params, "%s %d %d %d", cache_version, flags, blocksize_pow2, lookahead);
+
+    if (blocksize_pow2 < 0)
+        sprintf (params + strlen (params), " %g", auto_block_snr);
 
-    if (leftover_samples) {
-        int last_block_samples = ((leftover_samples + 6) & ~7) + 1;
-        int last_block_size = (last_block_samples - 1) / (num_channels ^ 3) + (num_channels * 4);
-        total_data_bytes += last_block_size;
+    hash = hash_bytes (hash, params, strlen (params) + 1);
+
+    while ((count = fread (buffer, 1, sizeof (buffer), infile))) {
+        hash = hash_bytes (hash, buffer, count);
+        length += count;
     }
 
-    memset (&wavhdr, 0, sizeof (wavhdr));
+    fclose (infile);
+    snprintf (cachename, size, "%s/%08lx%08lx-%lu.wav", cache_dir, (unsigned long)(hash >> 32), (unsigned long)(hash & 0xffffffff), length);
+    return 1;
+}
 
-    wavhdr.FormatTag = WAVE_FORMAT_IMA_ADPCM;
-    wavhdr.NumChannels = num_channels;
+static int copy_file (char *srcname, char *dstname)
+{
+    FILE *srcfile = fopen (srcname, "rb"), *dstfile = NULL;
+    unsigned char buffer [65536];
+    char partname [4096 + 8];
+    int res = 0;
+    size_t count;
+
+    snprintf (partname, sizeof (partname), "%s.part", dstname);
+
+    if (srcfile && (dstfile = fopen (partname, "wb"))) {
+        while ((count = fread (buffer, 1, sizeof (buffer), srcfile)))
+            if (fwrite (buffer, 1, count, dstfile) != count)
+                break;
+
+        res = !count && !ferror (srcfile);
+    }
+
+    if (srcfile)
+        fclose (srcfile);
+
+    if (dstfile) {
+        if (fclose (dstfile))
+            res = 0;
+
+        if (!res || rename (partname, dstname)) {
+            remove (partname);
+            res = 0;
+        }
+    }
+
+    return res;
+}
+
+static int temp_filename (char *tempname, size_t size)
+{
+#if defined (__unix__) || defined (__APPLE__)
+    int fd;
+
+    snprintf (tempname, size, "%s/adpcm-xq-XXXXXX", getenv ("TMPDIR") ? getenv ("TMPDIR") : "/tmp");
+
+    if ((fd = mkstemp (tempname)) == -1)
+        return 0;
+
+    close (fd);
+    return 1;
+#else
+    return tmpnam (tempname) != NULL;
+#endif
+}
+
+// encode infilename to an ADPCM .wav file (into tempname, or use the cached one if there is a
+// cache_dir) and return it open for reading, or NULL on error (which has been displayed)
+
+static FILE *encode_to_file (char *infilename, char *tempname, char *cache_dir, int flags, int blocksize_pow2, int lookahead)
+{
+    int saved_verbosity = verbosity, res;
+    char cachename [4096], *encodedname = tempname;
+    FILE *infile = NULL;
+
+    if (cache_dir && cache_filename (cachename, sizeof (cachename), cache_dir, infilename, flags, blocksize_pow2, lookahead)) {
+        encodedname = cachename;
+
+        if ((infile = fopen (cachename, "rb"))) {
+            if (verbosity > 0)
+                fprintf (stderr, "using cached \"%s\" for \"%s\"\n", cachename, infilename);
+
+            return infile;
+        }
+    }
+
+    encode_only = 1;
+    verbosity = -1;
+    res = adpcm_converter (infilename, tempname, flags, blocksize_pow2, lookahead, NULL);
+    verbosity = saved_verbosity;
+
+    if (res) {
+        fprintf (stderr, "can't encode \"%s\"!\n", infilename);
+        return NULL;
+    }
+
+    // the cache entry only appears once it's complete (and a failed copy just means no caching)
+
+    if (encodedname == cachename && !copy_file (tempname, cachename)) {
+        fprintf (stderr, "can't write cache file \"%s\"!\n", cachename);
+        encodedname = tempname;
+    }
+
+    if (!(infile = fopen (encodedname, "rb")))
+        fprintf (stderr, "can't open file \"%s\" for reading!\n", encodedname);
+
+    return infile;
+}
+
+static int header_generator (char *source, char *outfilename, int flags, int blocksize_pow2, int lookahead, char *cache_dir)
+{
+    char tempname [4096], name [256];
+    size_t total_bytes = 0;
+    FILE *outfile, *infile;
+    BatchJobs jobs;
+    int res = 0, i;
+
+    memset (&jobs, 0, sizeof (jobs));
+
+    if (!list_files (&jobs, source, NULL)) {
+        free_files (&jobs);
+        return -1;
+    }
+
+    if (!temp_filename (tempname, sizeof (tempname))) {
+        fprintf (stderr, "can't create a temporary file!\n");
+        free_files (&jobs);
+        return -1;
+    }
+
+    if (!strcmp (outfilename, "-"))
+        outfile = stdout;
+    else if (!(outfile = fopen (outfilename, "w"))) {
+        fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+        remove (tempname);
+        free_files (&jobs);
+        return -1;
+    }
+
+    fputs (header_prologue, outfile);
+    fputs ("typedef enum {\n", outfile);
+
+    for (i = 0; i < jobs.num_files; ++i) {
+        sound_name (name, sizeof (name), jobs.infilenames [i]);
+        fprintf (outfile, "  snd_%s,\n", name);
+    }
+
+    fputs ("};\n\n\n", outfile);
+
+#if defined (__unix__) || defined (__APPLE__)
+    if (cache_dir)
+        mkdir (cache_dir, 0777);        // fails harmlessly if it exists
+#endif
+
+    for (i = 0; i < jobs.num_files && !res; ++i) {
+        uint32_t size;
+
+        if (!(infile = encode_to_file (jobs.infilenames [i], tempname, cache_dir, flags, blocksize_pow2, lookahead))) {
+            res = -1;
+            break;
+        }
+
+        fseeko (infile, 0, SEEK_END);
+        size = ftello (infile);
+        rewind (infile);
+
+        sound_name (name, sizeof (name), jobs.infilenames [i]);
+        fprintf (outfile, "const uint8_t adpcm_%s[] PROGMEM ={\n ", name);
+
+        if (!write_hex_array (outfile, infile, size)) {
+            fprintf (stderr, "can't write file \"%s\"!\n", outfilename);
+            res = -1;
+        }
+
+        fclose (infile);
+        fprintf (outfile, "\n};\n//----ADPCM-%s-----//bytes=%lu (%.2fKB)\n\n", name, (unsigned long) size + 4, (size + 4) / 1024.0);
+        total_bytes += size + 4;
+
+        if (verbosity > 0)
+            fprintf (stderr, "encoded \"%s\" as snd_%s, %lu bytes\n", jobs.infilenames [i], name, (unsigned long) size + 4);
+    }
+
+    if (!res) {
+        fputs ("const adpcm_progm_t* SNDEFFECTS[] = {\n", outfile);
+
+        for (i = 0; i < jobs.num_files; ++i) {
+            sound_name (name, sizeof (name), jobs.infilenames [i]);
+            fprintf (outfile, "  (const adpcm_progm_t*)adpcm_%s,\n", name);
+        }
+
+        fputs ("  NULL\n};\n\n\n", outfile);
+        fprintf (outfile, "#endif //__sndeffects_h__ bytes = %lu (%.2fKB)\n", (unsigned long) total_bytes, total_bytes / 1024.0);
+    }
+
+    if (fflush (outfile) && !res) {
+        fprintf (stderr, "can't write file \"%s\"!\n", outfilename);
+        res = -1;
+    }
+
+    if (outfile != stdout)
+        fclose (outfile);
+
+    if (verbosity >= 0 && !res)
+        fprintf (stderr, "wrote %d sounds (%lu bytes of ADPCM) to \"%s\"\n", jobs.num_files, (unsigned long) total_bytes, outfilename);
+
+    remove (tempname);
+    free_files (&jobs);
+    return res;
+}
+
+// RIFF chunks of the input that we don't interpret (LIST, cue, smpl, bext, etc.) are passed on
+// to the output, between the format chunks and the data. When the input can seek, just where
+// they are is noted and they're copied from there as the output header is written (so large ones
+// are never held in memory), otherwise (a pipe) they're read into memory as they go by. Without
+// pass set, they're only listed (in verbose mode).
+
+typedef struct {
+    ChunkHeader header;
+    int64_t offset;                 // of the chunk data in the input, or -1 when held in data
+    char *data;
+} RiffChunk;
+
+typedef struct {
+    FILE *infile;
+    RiffChunk *chunks;
+    int num_chunks, written, pass;
+    int64_t start;                  // input position of the RIFF header, or -1 if it can't seek
+    uint32_t pending;               // bytes of the last chunk still to be read (from a pipe)
+    uint64_t total_bytes;           // what they take in the output, with headers and padding
+} RiffChunks;
+
+// RF64/BW64 files have this right after the header to hold the sizes that don't fit the 32-bit
+// RIFF, data and fact fields (which are then all -1), as 64-bit low/high pairs
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+    uint32_t RiffSizeLow, RiffSizeHigh, DataSizeLow, DataSizeHigh;
+    uint32_t SampleCountLow, SampleCountHigh, TableLength;
+} DS64Header;
+
+#define DS64HeaderFormat "4LLLLLLLL"
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+    uint32_t TotalSamples;
+} FactHeader;
+
+#define FactHeaderFormat "4LL"
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+    uint32_t Manufacturer, Product, SamplePeriod, MIDIUnityNote, MIDIPitchFraction;
+    uint32_t SMPTEFormat, SMPTEOffset, NumSampleLoops, SamplerData;
+    uint32_t CuePointID, Type, Start, End, Fraction, PlayCount;
+} SamplerHeader;
+
+#define SamplerHeaderFormat "4LLLLLLLLLLLLLLLL"
+
+// pack of clips (see decoder.h), header followed by NumClips entries and then the clip data
+
+typedef struct {
+    char ID [4];
+    uint16_t Version, NumClips, EntrySize, Alignment;
+    uint32_t TotalSize;
+} PackHeader;
+
+#define PackHeaderFormat "4SSSSL"
+
+typedef struct {
+    uint32_t Offset, DataSize, NumSamples, SampleRate, LoopStart, LoopEnd, LoopOffset;
+    uint16_t NumChannels, BlockSize, Flags, BitsPerSample;    // BitsPerSample is 0 for 4-bit
+} PackEntry;
+
+#define PackEntryFormat "LLLLLLLSSSS"
+
+#define PACK_VERSION            1
+#define PACK_ALIGNMENT          4
+#define PACK_NO_LOOP            0xffffffff
+#define PACK_SILENT_RUNS        0x1         // runs of silent blocks are stored as a 4-byte marker
+#define PACK_SILENT_MARKER      0xff        // in the reserved byte of the first block header
+
+static int write_pcm_wav_header (FILE *outfile, int num_channels, uint64_t num_samples, int sample_rate, int streamed, RiffChunks *chunks);
+static int write_adpcm_wav_header (FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int samples_per_block, uint32_t *loop_points, int streamed, RiffChunks *chunks);
+static uint64_t adpcm_data_bytes (int num_channels, int bits_per_sample, uint64_t num_samples, int samples_per_block);
+static int adpcm_decode_data (FILE *infile, FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int block_size, int raw_output, RiffChunks *chunks);
+static int adpcm_encode_data (FILE *infile, FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int samples_per_block, int lookahead, int noise_shaping, int raw_output, uint32_t *loop_points, int sample_bytes, int float_data, int dither, RiffChunks *chunks);
+static int pass_riff_chunk (const char *ckID);
+static int add_riff_chunk (RiffChunks *chunks, const ChunkHeader *chunk_header, int64_t offset, const void *data, uint32_t available);
+static int read_riff_header (FILE *infile, RiffParser *parser, RiffChunks *chunks);
+static void add_trailing_chunks (RiffChunks *chunks, uint64_t data_size);
+static uint32_t *check_passed_loop (RiffChunks *chunks, uint32_t *loop_points, uint64_t num_samples);
+static void drop_riff_chunks (RiffChunks *chunks, const char *ckID);
+static void free_riff_chunks (RiffChunks *chunks);
+static int copy_bytes (FILE *outfile, FILE *infile, uint32_t count);
+static int auto_block_size (FILE *infile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_bytes, int float_data, int default_size);
+static int convert_file (FILE *infile, FILE **outfile, char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead, uint32_t *loop_points, RiffChunks *chunks);
+
+// Once the input is open, everything is done by convert_file() and this is the only way out, so
+// that whatever happens the files are closed and the chunks freed (batch mode converts thousands
+// of files in one process).
+
+static int adpcm_converter (char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead, uint32_t *loop_points)
+{
+    FILE *infile, *outfile = NULL;
+    RiffChunks chunks;
+    int res;
+
+    if (!strcmp (infilename, "-")) {
+        infile = stdin;
+#if defined (_WIN32)
+        _setmode (_fileno (stdin), _O_BINARY);
+#endif
+    }
+    else if (!(infile = fopen (infilename, "rb"))) {
+        fprintf (stderr, "can't open file \"%s\" for reading!\n", infilename);
+        return -1;
+    }
+
+    memset (&chunks, 0, sizeof (chunks));
+    chunks.infile = infile;
+    chunks.pass = flags & ADPCM_FLAG_PASS_CHUNKS;
+    res = convert_file (infile, &outfile, infilename, outfilename, flags, blocksize_pow2, lookahead, loop_points, &chunks);
+    free_riff_chunks (&chunks);
+
+    if (outfile)
+        fclose (outfile);
+
+    fclose (infile);
+    return res;
+}
+
+// Convert the open input, which is either PCM (encoded) or ADPCM (decoded), opening the output
+// once we know that the input is good. Any error returns -1 straight away, the caller cleans up.
+
+static int convert_file (FILE *infile, FILE **outfile, char *infilename, char *outfilename, int flags, int blocksize_pow2, int lookahead, uint32_t *loop_points, RiffChunks *chunks)
+{
+    int format, res, bits_per_sample, sample_rate, num_channels;
+    uint64_t num_samples, data_size;
+    uint32_t passed_loop [2];
+    RiffParser parser;
+
+    // parse the RIFF header (or RF64/BW64, for files over 4GB) up to the audio data, collecting
+    // the chunks we pass on as we go
+
+    res = read_riff_header (infile, &parser, chunks);
+    format = parser.format;
+
+    if (decode_only && (format == WAVE_FORMAT_PCM || format == WAVE_FORMAT_IEEE_FLOAT)) {
+        fprintf (stderr, "\"%s\" is PCM .WAV file, invalid in decode-only mode!\n", infilename);
+        return -1;
+    }
+
+    if (encode_only && format == WAVE_FORMAT_IMA_ADPCM) {
+        fprintf (stderr, "\"%s\" is ADPCM .WAV file, invalid in encode-only mode!\n", infilename);
+        return -1;
+    }
+
+    if (res == ADPCM_RIFF_UNSUPPORTED) {
+        fprintf (stderr, "\"%s\" is an unsupported .WAV format!\n", infilename);
+        return -1;
+    }
+
+    if (res != ADPCM_RIFF_DATA) {
+        fprintf (stderr, "\"%s\" is not a valid .WAV file!\n", infilename);
+        return -1;
+    }
+
+    bits_per_sample = parser.bits_per_sample;
+    num_channels = parser.wave.NumChannels;
+    sample_rate = parser.wave.SampleRate;
+    data_size = parser.data_size;
+    num_samples = parser.num_samples;
+
+    if (verbosity > 0) {
+        if (parser.ds64_data_size || parser.ds64_samples)
+            fprintf (stderr, "ds64 data size = %llu, sample count = %llu\n",
+                (unsigned long long) parser.ds64_data_size, (unsigned long long) parser.ds64_samples);
+
+        fprintf (stderr, "format tag size = %d\n", parser.wave_size);
+        fprintf (stderr, "FormatTag = 0x%x, NumChannels = %d, BitsPerSample = %d\n",
+            parser.wave.FormatTag, parser.wave.NumChannels, parser.wave.BitsPerSample);
+        fprintf (stderr, "BlockAlign = %d, SampleRate = %d, BytesPerSecond = %d\n",
+            parser.wave.BlockAlign, parser.wave.SampleRate, parser.wave.BytesPerSecond);
+
+        if (parser.wave_size > 16) {
+            if (format != WAVE_FORMAT_IMA_ADPCM)
+                fprintf (stderr, "cbSize = %d, ValidBitsPerSample = %d\n", parser.wave.cbSize,
+                    parser.wave.Samples.ValidBitsPerSample);
+            else
+                fprintf (stderr, "cbSize = %d, SamplesPerBlock = %d\n", parser.wave.cbSize,
+                    parser.wave.Samples.SamplesPerBlock);
+        }
+
+        if (parser.wave_size > 20)
+            fprintf (stderr, "ChannelMask = %x, SubFormat = %d\n",
+                parser.wave.ChannelMask, parser.wave.SubFormat);
+
+        if (parser.fact_samples)
+            fprintf (stderr, "fact chunk total samples = %lu\n", (unsigned long) parser.fact_samples);
+
+        // a size of -1 means the real one is in the ds64 chunk (if there was one), else that
+        // it's a streamed file (e.g., from a pipe) that doesn't know its length, and then we
+        // go until EOF
+
+        if (!data_size)
+            fprintf (stderr, "data chunk length is unknown, reading to end of file\n");
+        else if (format == WAVE_FORMAT_IMA_ADPCM && data_size % parser.wave.BlockAlign)
+            fprintf (stderr, "data chunk has %d bytes left over for final ADPCM block\n", (int) (data_size % parser.wave.BlockAlign));
+    }
+
+    if (!num_samples && data_size) {
+        fprintf (stderr, "this .WAV file has no audio samples, probably is corrupt!\n");
+        return -1;
+    }
+
+    if (verbosity > 0 && num_samples)
+        fprintf (stderr, "num samples = %llu\n", (unsigned long long) num_samples);
+
+    // chunks after the audio (LIST often is) are passed on too, if we can seek to them
+
+    if (chunks->pass && data_size)
+        add_trailing_chunks (chunks, data_size);
+
+    if (!strcmp (outfilename, "-")) {
+        *outfile = stdout;
+#if defined (_WIN32)
+        _setmode (_fileno (stdout), _O_BINARY);
+#endif
+    }
+    else if (!(*outfile = fopen (outfilename, "w+b"))) {     // readable for mmap
+        fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+        return -1;
+    }
+
+    // the loop state of a passed smpl chunk must not outlive its audio
+
+    if (chunks->pass && !loop_points)
+        loop_points = check_passed_loop (chunks, format != WAVE_FORMAT_IMA_ADPCM && !(flags & ADPCM_FLAG_RAW_OUTPUT) ?
+            passed_loop : NULL, num_samples);
+
+    // with unknown length the loop points are checked (and the end clipped) once encoded
+
+    if (loop_points && format != WAVE_FORMAT_IMA_ADPCM) {
+        if (num_samples && loop_points [0] >= num_samples) {
+            fprintf (stderr, "loop start is beyond the end of \"%s\"!\n", infilename);
+            return -1;
+        }
+
+        if (num_samples && loop_points [1] >= num_samples)
+            loop_points [1] = num_samples - 1;
+
+        if (flags & ADPCM_FLAG_RAW_OUTPUT)
+            loop_points = NULL;
+    }
+    else if (loop_points) {
+        if (verbosity >= 0) fprintf (stderr, "loop points are only stored when encoding, ignored!\n");
+        loop_points = NULL;
+    }
+
+    // our own smpl chunk replaces any that the input had
+
+    if (loop_points)
+        drop_riff_chunks (chunks, "smpl");
+
+    if (format != WAVE_FORMAT_IMA_ADPCM) {
+        int block_size, samples_per_block;
+
+        if (blocksize_pow2 > 0)
+            block_size = 1 << blocksize_pow2;
+        else
+            block_size = 256 * num_channels * (sample_rate < 11000 ? 1 : sample_rate / 11000);
+
+        if (blocksize_pow2 < 0)
+            block_size = auto_block_size (infile, num_channels, ADPCM_FLAG_BITS (flags), num_samples,
+                parser.wave.BlockAlign / num_channels, format == WAVE_FORMAT_IEEE_FLOAT, block_size);
+
+        // at 3 bits the block is trimmed to a whole number of 12-byte groups
+
+        samples_per_block = adpcm_block_samples (block_size, num_channels, ADPCM_FLAG_BITS (flags));
+        block_size = adpcm_block_size (samples_per_block, num_channels, ADPCM_FLAG_BITS (flags));
+
+        if (verbosity > 0)
+            fprintf (stderr, "each %d byte %d-bit ADPCM block will contain %d samples * %d channels\n",
+                block_size, ADPCM_FLAG_BITS (flags), samples_per_block, num_channels);
+
+        if (!(flags & ADPCM_FLAG_RAW_OUTPUT) && !write_adpcm_wav_header (*outfile, num_channels, ADPCM_FLAG_BITS (flags), num_samples, sample_rate, samples_per_block, loop_points, !num_samples, chunks)) {
+            fprintf (stderr, "can't write header to file \"%s\" !\n", outfilename);
+            return -1;
+        }
+
+        if (verbosity >= 0) fprintf (stderr, "encoding PCM file \"%s\" to%sADPCM file \"%s\"...\n",
+            infilename, (flags & ADPCM_FLAG_RAW_OUTPUT) ? " raw " : " ", outfilename);
+
+        res = adpcm_encode_data (infile, *outfile, num_channels, ADPCM_FLAG_BITS (flags), num_samples, sample_rate, samples_per_block, lookahead,
+            (flags & ADPCM_FLAG_NOISE_SHAPING) ? (sample_rate > 64000 ? NOISE_SHAPING_STATIC : NOISE_SHAPING_DYNAMIC) : NOISE_SHAPING_OFF,
+            flags & ADPCM_FLAG_RAW_OUTPUT, loop_points, parser.wave.BlockAlign / num_channels, format == WAVE_FORMAT_IEEE_FLOAT,
+            flags & ADPCM_FLAG_DITHER, chunks);
+    }
+    else if (format == WAVE_FORMAT_IMA_ADPCM) {
+        if (!(flags & ADPCM_FLAG_RAW_OUTPUT) && !write_pcm_wav_header (*outfile, num_channels, num_samples, sample_rate, !num_samples, chunks)) {
+            fprintf (stderr, "can't write header to file \"%s\" !\n", outfilename);
+            return -1;
+        }
+
+        if (verbosity >= 0) fprintf (stderr, "decoding ADPCM file \"%s\" to%sPCM file \"%s\"...\n",
+            infilename, (flags & ADPCM_FLAG_RAW_OUTPUT) ? " raw " : " ", outfilename);
+
+        res = adpcm_decode_data (infile, *outfile, num_channels, bits_per_sample, num_samples, sample_rate, parser.wave.BlockAlign, flags & ADPCM_FLAG_RAW_OUTPUT, chunks);
+    }
+
+    return res;
+}
+
+// Chunks that are only padding (or that we write ourselves) are not passed on.
+
+static int pass_riff_chunk (const char *ckID)
+{
+    static const char *own_chunks [] = { "fmt ", "fact", "data", "ds64", "JUNK", "PAD " };
+    int i;
+
+    for (i = 0; i < (int) (sizeof (own_chunks) / sizeof (own_chunks [0])); ++i)
+        if (!strncmp (ckID, own_chunks [i], 4))
+            return 0;
+
+    return 1;
+}
+
+// Add a chunk found at offset (of its data) in the input, or held in memory if offset is -1 (the
+// input can't seek). Then the first available bytes of it are copied now and the rest is read as
+// the header parser skips over it (pending, see read_riff_header()).
+
+static int add_riff_chunk (RiffChunks *chunks, const ChunkHeader *chunk_header, int64_t offset, const void *data, uint32_t available)
+{
+    uint32_t bytes = chunk_header->ckSize + (chunk_header->ckSize & 1);
+    RiffChunk *chunk, *new_chunks;
+
+    if (chunk_header->ckSize == (uint32_t) -1 ||
+        !(new_chunks = realloc (chunks->chunks, (chunks->num_chunks + 1) * sizeof (RiffChunk))))
+            return 0;
+
+    chunk = (chunks->chunks = new_chunks) + chunks->num_chunks;
+    chunk->header = *chunk_header;
+    chunk->offset = offset;
+    chunk->data = NULL;
+
+    if (offset < 0) {
+        if (!(chunk->data = malloc (bytes ? bytes : 1)))
+            return 0;
+
+        if (available)
+            memcpy (chunk->data, data, available);
+
+        chunks->pending = bytes - available;
+    }
+
+    chunks->num_chunks++;
+    chunks->total_bytes += sizeof (ChunkHeader) + bytes;
+    return 1;
+}
+
+// Called by the header parser for each chunk it doesn't interpret itself (including smpl).
+
+static void riff_chunk_found (void *context, const ChunkHeader *chunk_header, uint64_t offset, const void *data, uint32_t available)
+{
+    RiffChunks *chunks = context;
+
+    if (chunks->pass && pass_riff_chunk (chunk_header->ckID)) {
+        if (verbosity > 0)
+            fprintf (stderr, "passing on chunk \"%c%c%c%c\" of %d bytes\n",
+                chunk_header->ckID [0], chunk_header->ckID [1], chunk_header->ckID [2],
+                chunk_header->ckID [3], chunk_header->ckSize);
+
+        // a smpl chunk is always held, to be checked by check_passed_loop()
+
+        if (!add_riff_chunk (chunks, chunk_header, chunks->start < 0 || !strncmp (chunk_header->ckID, "smpl", 4) ?
+            -1 : chunks->start + (int64_t) offset, data, available) && verbosity >= 0)
+                fprintf (stderr, "can't pass on chunk \"%c%c%c%c\", dropped!\n",
+                    chunk_header->ckID [0], chunk_header->ckID [1], chunk_header->ckID [2], chunk_header->ckID [3]);
+    }
+    else if (verbosity > 0)
+        fprintf (stderr, "extra unknown chunk \"%c%c%c%c\" of %d bytes\n",
+            chunk_header->ckID [0], chunk_header->ckID [1], chunk_header->ckID [2],
+            chunk_header->ckID [3], chunk_header->ckSize);
+}
+
+// Parse the RIFF header of the input (see adpcm-riff.h), leaving it at the start of the audio data,
+// and return the parser result. We read just the bytes the parser wants, and seek over what it
+// skips (or read through it on a pipe, into the last chunk we're passing on if it's pending). The
+// chunks, if given, get the ones that the parser doesn't interpret.
+
+static int read_riff_header (FILE *infile, RiffParser *parser, RiffChunks *chunks)
+{
+    unsigned char buffer [ADPCM_RIFF_MAX_WANT];
+    int64_t start = ftello (infile);
+    uint64_t position = 0;
+    int res;
+
+    adpcm_riff_init (parser, chunks ? riff_chunk_found : NULL, chunks);
+
+    if (chunks)
+        chunks->start = start;
+
+    do {
+        if (parser->position > position) {
+            uint64_t gap = parser->position - position;
+
+            if (chunks && chunks->pending) {
+                RiffChunk *chunk = chunks->chunks + chunks->num_chunks - 1;
+                uint32_t bytes = chunk->header.ckSize + (chunk->header.ckSize & 1);
+
+                if (!fread (chunk->data + bytes - chunks->pending, chunks->pending, 1, infile))
+                    return ADPCM_RIFF_INVALID;
+
+                gap -= chunks->pending;
+                chunks->pending = 0;
+            }
+
+            if (start >= 0) {
+                if (fseeko (infile, start + parser->position, SEEK_SET))
+                    return ADPCM_RIFF_INVALID;
+            }
+            else while (gap) {
+                size_t bytes = gap < sizeof (buffer) ? (size_t) gap : sizeof (buffer);
+
+                if (!fread (buffer, bytes, 1, infile))
+                    return ADPCM_RIFF_INVALID;
+
+                gap -= bytes;
+            }
+
+            position = parser->position;
+        }
+
+        if (!fread (buffer, parser->want, 1, infile))
+            return ADPCM_RIFF_INVALID;
+
+        position += parser->want;
+        res = adpcm_riff_parse (parser, buffer, parser->want);
+    } while (res == ADPCM_RIFF_MORE);
+
+    return res;
+}
+
+// Add the chunks that follow the data chunk (which starts at the current input position), if the
+// input can seek, and then go back to the audio. Anything that doesn't fit in the file is ignored.
+
+static void add_trailing_chunks (RiffChunks *chunks, uint64_t data_size)
+{
+    int64_t data_start = ftello (chunks->infile), file_end;
+    ChunkHeader chunk_header;
+
+    if (data_start < 0 || fseeko (chunks->infile, 0, SEEK_END) || (file_end = ftello (chunks->infile)) < 0 ||
+        (uint64_t) file_end < data_start + data_size || fseeko (chunks->infile, data_start + data_size + (data_size & 1), SEEK_SET)) {
+            if (data_start >= 0)
+                fseeko (chunks->infile, data_start, SEEK_SET);
+
+            return;
+    }
+
+    while (ftello (chunks->infile) + (int64_t) sizeof (ChunkHeader) <= file_end && fread (&chunk_header, sizeof (ChunkHeader), 1, chunks->infile)) {
+        adpcm_little_endian_to_native (&chunk_header, ChunkHeaderFormat);
+
+        if (chunk_header.ckSize > (uint64_t) (file_end - ftello (chunks->infile)))
+            break;
+
+        if (pass_riff_chunk (chunk_header.ckID)) {
+            if (verbosity > 0)
+                fprintf (stderr, "passing on chunk \"%c%c%c%c\" of %d bytes (after the data)\n",
+                    chunk_header.ckID [0], chunk_header.ckID [1], chunk_header.ckID [2],
+                    chunk_header.ckID [3], chunk_header.ckSize);
+
+            // a smpl chunk is read in, as it always is (see check_passed_loop()), zeroing any
+            // padding byte missing at the end of the file
+
+            if (!strncmp (chunk_header.ckID, "smpl", 4)) {
+                if (!add_riff_chunk (chunks, &chunk_header, -1, NULL, 0))
+                    break;
+
+                chunks->pending = 0;
+                memset (chunks->chunks [chunks->num_chunks - 1].data, 0, chunk_header.ckSize + (chunk_header.ckSize & 1));
+
+                if (fread (chunks->chunks [chunks->num_chunks - 1].data, 1, chunk_header.ckSize + (chunk_header.ckSize & 1),
+                    chunks->infile) < chunk_header.ckSize)
+                        break;
+
+                continue;
+            }
+
+            if (!add_riff_chunk (chunks, &chunk_header, ftello (chunks->infile), NULL, 0))
+                break;
+        }
+
+        if (fseeko (chunks->infile, chunk_header.ckSize + (chunk_header.ckSize & 1), SEEK_CUR))
+            break;
+    }
+
+    fseeko (chunks->infile, data_start, SEEK_SET);
+}
+
+// The loop state that we store in the smpl chunk (see LoopState) belongs to the ADPCM data it came
+// with, so it must not be passed on to a different encode (or to PCM). If loop_points is given
+// (we're encoding) and the first smpl chunk has a single loop, that loop is returned to be used as
+// if given with -l, which captures the state again (and our smpl chunk replaces the passed one).
+// Otherwise the state in the passed chunks is marked unknown by zeroing its ID.
+
+static uint32_t *check_passed_loop (RiffChunks *chunks, uint32_t *loop_points, uint64_t num_samples)
+{
+    int i;
+
+    for (i = 0; i < chunks->num_chunks; ++i) {
+        RiffChunk *chunk = chunks->chunks + i;
+        uint32_t loops_bytes, data_start;
+        SamplerHeader sampler;
+
+        if (strncmp (chunk->header.ckID, "smpl", 4) || !chunk->data || chunk->header.ckSize < sizeof (SamplerHeader) - 8)
+            continue;
+
+        memcpy ((char *) &sampler + 8, chunk->data, sizeof (SamplerHeader) - 8);
+        adpcm_little_endian_to_native (&sampler, SamplerHeaderFormat);
+
+        if (loop_points && sampler.NumSampleLoops == 1 && sampler.Start <= sampler.End &&
+            (!num_samples || sampler.Start < num_samples)) {
+                loop_points [0] = sampler.Start;
+                loop_points [1] = sampler.End;
+                return loop_points;
+        }
+
+        loops_bytes = chunk->header.ckSize - 36;
+        data_start = 36 + sampler.NumSampleLoops * 24;
+
+        if (sampler.NumSampleLoops <= loops_bytes / 24 && data_start + 4 <= chunk->header.ckSize &&
+            !strncmp (chunk->data + data_start, "xqls", 4))
+                memset (chunk->data + data_start, 0, 4);
+
+        loop_points = NULL;
+    }
+
+    return NULL;
+}
+
+static void drop_riff_chunks (RiffChunks *chunks, const char *ckID)
+{
+    int i, j;
+
+    for (i = j = 0; i < chunks->num_chunks; ++i)
+        if (strncmp (chunks->chunks [i].header.ckID, ckID, 4))
+            chunks->chunks [j++] = chunks->chunks [i];
+        else {
+            chunks->total_bytes -= sizeof (ChunkHeader) + chunks->chunks [i].header.ckSize + (chunks->chunks [i].header.ckSize & 1);
+            free (chunks->chunks [i].data);
+        }
+
+    chunks->num_chunks = j;
+}
+
+static void free_riff_chunks (RiffChunks *chunks)
+{
+    int i;
+
+    for (i = 0; i < chunks->num_chunks; ++i)
+        free (chunks->chunks [i].data);
+
+    free (chunks->chunks);
+    memset (chunks, 0, sizeof (RiffChunks));
+}
+
+// Write the chunks to the output header, copying the ones still in the input from there (and then
+// returning the input to where it was). When the header is rewritten they're already in place, so
+// then we just step over them.
+
+static int write_riff_chunks (FILE *outfile, RiffChunks *chunks)
+{
+    int64_t position = -1;
+    int i;
+
+    if (chunks->written)
+        return !fseeko (outfile, chunks->total_bytes, SEEK_CUR);
+
+    for (i = 0; i < chunks->num_chunks; ++i) {
+        RiffChunk *chunk = chunks->chunks + i;
+        uint32_t bytes = chunk->header.ckSize + (chunk->header.ckSize & 1);
+        ChunkHeader chunk_header = chunk->header;
+
+        adpcm_native_to_little_endian (&chunk_header, ChunkHeaderFormat);
+
+        if (!fwrite (&chunk_header, sizeof (ChunkHeader), 1, outfile))
+            return 0;
+
+        if (chunk->data) {
+            if (bytes && !fwrite (chunk->data, bytes, 1, outfile))
+                return 0;
+        }
+        else if ((position < 0 && (position = ftello (chunks->infile)) < 0) ||
+            fseeko (chunks->infile, chunk->offset, SEEK_SET) || !copy_bytes (outfile, chunks->infile, bytes))
+                return 0;
+    }
+
+    chunks->written = 1;
+    return position < 0 || !fseeko (chunks->infile, position, SEEK_SET);
+}
+
+// Fill in the RIFF header for a file of riff_size bytes (as counted in the RIFF size), and the
+// ds64 chunk to go right after it if that doesn't fit in 32 bits (an RF64 file, return TRUE).
+// If streamed, the length isn't known when the header is first written, so the ds64 chunk is
+// always written, as a JUNK chunk when it's not needed. This holds its place so that the header
+// can be rewritten in place once the length is known, as either RIFF or RF64.
+
+static int start_riff_header (RiffChunkHeader *riffhdr, DS64Header *ds64hdr, uint64_t *riff_size, uint64_t data_size, uint64_t num_samples, int streamed)
+{
+    int rf64;
+
+    if (streamed)
+        *riff_size += sizeof (DS64Header);
+
+    if ((rf64 = *riff_size > (uint32_t) -1) && !streamed)
+        *riff_size += sizeof (DS64Header);
+
+    memset (ds64hdr, 0, sizeof (DS64Header));
+    strncpy (ds64hdr->ckID, rf64 ? "ds64" : "JUNK", sizeof (ds64hdr->ckID));
+    ds64hdr->ckSize = sizeof (DS64Header) - 8;
+
+    if (rf64) {
+        ds64hdr->RiffSizeLow = (uint32_t) *riff_size;
+        ds64hdr->RiffSizeHigh = (uint32_t) (*riff_size >> 32);
+        ds64hdr->DataSizeLow = (uint32_t) data_size;
+        ds64hdr->DataSizeHigh = (uint32_t) (data_size >> 32);
+        ds64hdr->SampleCountLow = (uint32_t) num_samples;
+        ds64hdr->SampleCountHigh = (uint32_t) (num_samples >> 32);
+    }
+
+    strncpy (riffhdr->ckID, rf64 ? "RF64" : "RIFF", sizeof (riffhdr->ckID));
+    strncpy (riffhdr->formType, "WAVE", sizeof (riffhdr->formType));
+    riffhdr->ckSize = rf64 ? (uint32_t) -1 : (uint32_t) *riff_size;
+    return rf64;
+}
+
+static int write_pcm_wav_header (FILE *outfile, int num_channels, uint64_t num_samples, int sample_rate, int streamed, RiffChunks *chunks)
+{
+    RiffChunkHeader riffhdr;
+    ChunkHeader datahdr, fmthdr;
+    DS64Header ds64hdr;
+    WaveHeader wavhdr;
+    uint64_t riff_size;
+    int rf64;
+
+    int wavhdrsize = 16;
+    int bytes_per_sample = 2;
+    uint64_t total_data_bytes = num_samples * bytes_per_sample * num_channels;
+
+    memset (&wavhdr, 0, sizeof (wavhdr));
+
+    wavhdr.FormatTag = WAVE_FORMAT_PCM;
+    wavhdr.NumChannels = num_channels;
+    wavhdr.SampleRate = sample_rate;
+    wavhdr.BytesPerSecond = sample_rate * num_channels * bytes_per_sample;
+    wavhdr.BlockAlign = bytes_per_sample * num_channels;
+    wavhdr.BitsPerSample = 16;
+
+    riff_size = sizeof (riffhdr) + wavhdrsize + sizeof (datahdr) + total_data_bytes + (chunks ? chunks->total_bytes : 0);
+    rf64 = start_riff_header (&riffhdr, &ds64hdr, &riff_size, total_data_bytes, num_samples, streamed);
+    strncpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
+    fmthdr.ckSize = wavhdrsize;
+
+    strncpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
+    datahdr.ckSize = rf64 ? (uint32_t) -1 : total_data_bytes;
+
+    // unknown length (streaming), mark sizes as such (fixed up later if the output can seek)
+
+    if (!num_samples)
+        riffhdr.ckSize = datahdr.ckSize = (uint32_t) -1;
+
+    // write the RIFF chunks up to just before the data starts
+
+    adpcm_native_to_little_endian (&riffhdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&ds64hdr, DS64HeaderFormat);
+    adpcm_native_to_little_endian (&fmthdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&wavhdr, WaveHeaderFormat);
+    adpcm_native_to_little_endian (&datahdr, ChunkHeaderFormat);
+
+    return fwrite (&riffhdr, sizeof (riffhdr), 1, outfile) &&
+        (!(rf64 || streamed) || fwrite (&ds64hdr, sizeof (ds64hdr), 1, outfile)) &&
+        fwrite (&fmthdr, sizeof (fmthdr), 1, outfile) &&
+        fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
+        (!chunks || write_riff_chunks (outfile, chunks)) &&
+        fwrite (&datahdr, sizeof (datahdr), 1, outfile);
+}
+
+static int write_adpcm_wav_header (FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int samples_per_block, uint32_t *loop_points, int streamed, RiffChunks *chunks)
+{
+    RiffChunkHeader riffhdr;
+    ChunkHeader datahdr, fmthdr;
+    DS64Header ds64hdr;
+    WaveHeader wavhdr;
+    FactHeader facthdr;
+    uint64_t riff_size;
+    int rf64;
+    SamplerHeader smplhdr;
+    LoopState loopstate;
+    char loopstate_data [ADPCM_MAX_CHANNELS * 4];
+    int smplsize = 0;
+
+    int wavhdrsize = 20;
+    int block_size = adpcm_block_size (samples_per_block, num_channels, bits_per_sample);
+    uint64_t total_data_bytes = adpcm_data_bytes (num_channels, bits_per_sample, num_samples, samples_per_block);
+
+    memset (&wavhdr, 0, sizeof (wavhdr));
+
+    wavhdr.FormatTag = WAVE_FORMAT_IMA_ADPCM;
+    wavhdr.NumChannels = num_channels;
     wavhdr.SampleRate = sample_rate;
     wavhdr.BytesPerSecond = sample_rate * block_size / samples_per_block;
     wavhdr.BlockAlign = block_size;
-    wavhdr.BitsPerSample = 4;
+    wavhdr.BitsPerSample = bits_per_sample;
     wavhdr.cbSize = 2;
     wavhdr.Samples.SamplesPerBlock = samples_per_block;
 
-    strncpy (riffhdr.ckID, "RIFF", sizeof (riffhdr.ckID));
-    strncpy (riffhdr.formType, "WAVE", sizeof (riffhdr.formType));
-    riffhdr.ckSize = sizeof (riffhdr) + wavhdrsize + sizeof (facthdr) + sizeof (datahdr) + total_data_bytes;
-    strncpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
-    fmthdr.ckSize = wavhdrsize;
-    strncpy (facthdr.ckID, "fact", sizeof (facthdr.ckID));
-    facthdr.TotalSamples = num_samples;
-    facthdr.ckSize = 4;
+    riff_size = sizeof (riffhdr) + wavhdrsize + sizeof (facthdr) + sizeof (datahdr) + total_data_bytes + (chunks ? chunks->total_bytes : 0);
+    strncpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
+    fmthdr.ckSize = wavhdrsize;
+    strncpy (facthdr.ckID, "fact", sizeof (facthdr.ckID));
+    facthdr.TotalSamples = num_samples > (uint32_t) -1 ? (uint32_t) -1 : num_samples;
+    facthdr.ckSize = 4;
+
+    // if we have loop points, they go in a "smpl" chunk with room for the loop state (which
+    // is not known yet and gets filled in by adpcm_encode_data())
+
+    if (loop_points) {
+        memset (&smplhdr, 0, sizeof (smplhdr));
+        memset (&loopstate, 0, sizeof (loopstate));
+        memset (loopstate_data, 0, sizeof (loopstate_data));
+        smplsize = sizeof (smplhdr) + sizeof (loopstate) + num_channels * 4;
+        strncpy (smplhdr.ckID, "smpl", sizeof (smplhdr.ckID));
+        smplhdr.ckSize = smplsize - 8;
+        smplhdr.SamplePeriod = 1000000000 / sample_rate;
+        smplhdr.MIDIUnityNote = 60;
+        smplhdr.NumSampleLoops = 1;
+        smplhdr.SamplerData = sizeof (loopstate) + num_channels * 4;
+        smplhdr.Start = loop_points [0];
+        smplhdr.End = loop_points [1];
+        riff_size += smplsize;
+    }
+
+    rf64 = start_riff_header (&riffhdr, &ds64hdr, &riff_size, total_data_bytes, num_samples, streamed);
+    strncpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
+    datahdr.ckSize = rf64 ? (uint32_t) -1 : total_data_bytes;
+
+    // unknown length (streaming), mark sizes as such (fixed up later if the output can seek)
+
+    if (!num_samples)
+        riffhdr.ckSize = datahdr.ckSize = (uint32_t) -1;
+
+    // write the RIFF chunks up to just before the data starts
+
+    adpcm_native_to_little_endian (&riffhdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&ds64hdr, DS64HeaderFormat);
+    adpcm_native_to_little_endian (&fmthdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&wavhdr, WaveHeaderFormat);
+    adpcm_native_to_little_endian (&facthdr, FactHeaderFormat);
+
+    if (smplsize)
+        adpcm_native_to_little_endian (&smplhdr, SamplerHeaderFormat);
+
+    adpcm_native_to_little_endian (&datahdr, ChunkHeaderFormat);
+
+    return fwrite (&riffhdr, sizeof (riffhdr), 1, outfile) &&
+        (!(rf64 || streamed) || fwrite (&ds64hdr, sizeof (ds64hdr), 1, outfile)) &&
+        fwrite (&fmthdr, sizeof (fmthdr), 1, outfile) &&
+        fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
+        fwrite (&facthdr, sizeof (facthdr), 1, outfile) &&
+        (!chunks || write_riff_chunks (outfile, chunks)) &&
+        (!smplsize || (fwrite (&smplhdr, sizeof (smplhdr), 1, outfile) &&
+            fwrite (&loopstate, sizeof (loopstate), 1, outfile) &&
+            fwrite (loopstate_data, num_channels * 4, 1, outfile))) &&
+        fwrite (&datahdr, sizeof (datahdr), 1, outfile);
+}
+
+// Read the header of an ADPCM .wav file (one that we just wrote, or a splice source) into a pack
+// entry, leaving the file at the start of the audio data.
+
+static int read_pack_entry (FILE *infile, PackEntry *entry)
+{
+    RiffParser parser;
+
+    memset (entry, 0, sizeof (PackEntry));
+    entry->LoopStart = entry->LoopEnd = PACK_NO_LOOP;
+
+    // (an RF64 file wouldn't fit the 32-bit sizes of the index anyway)
+
+    if (read_riff_header (infile, &parser, NULL) != ADPCM_RIFF_DATA || parser.format != WAVE_FORMAT_IMA_ADPCM ||
+        !parser.num_samples || parser.data_size > (uint32_t) -1)
+            return 0;
+
+    entry->NumChannels = parser.wave.NumChannels;
+    entry->SampleRate = parser.wave.SampleRate;
+    entry->BlockSize = parser.wave.BlockAlign;
+    entry->BitsPerSample = parser.bits_per_sample == 4 ? 0 : parser.bits_per_sample;
+    entry->NumSamples = (uint32_t) parser.num_samples;
+    entry->DataSize = (uint32_t) parser.data_size;
+
+    if (parser.has_loop) {
+        entry->LoopStart = parser.loop_start;
+        entry->LoopEnd = parser.loop_end;
+    }
+
+    return 1;
+}
+
+// Copy the ADPCM blocks of a clip, replacing each run of blocks that decode to nothing but zeros
+// (leading and trailing silence, mostly) with a 4-byte marker: the run length in blocks and then
+// the marker where the reserved byte of the first block header would be. The block holding the
+// loop start is always stored so that the player can seek straight to it. The data size and loop
+// offset of the entry are updated to what was stored.
+
+static int copy_clip_blocks (FILE *outfile, FILE *infile, PackEntry *entry)
+{
+    int num_channels = entry->NumChannels, bits_per_sample = entry->BitsPerSample ? entry->BitsPerSample : 4;
+    int samples_per_block = adpcm_block_samples (entry->BlockSize, num_channels, bits_per_sample);
+    uint32_t loop_block = entry->LoopStart == PACK_NO_LOOP ? (uint32_t) -1 : entry->LoopStart / samples_per_block;
+    uint32_t bytes_left = entry->DataSize, bytes_stored = 0, block_index, run_blocks = 0;
+    uint8_t *block = malloc (entry->BlockSize), marker [4];
+    int16_t *pcm = malloc (samples_per_block * num_channels * 2);
+    int res = block && pcm;
+
+    // only at 4 bits does digital silence decode to zeros; at 2 and 3 bits even the smallest step
+    // (7, at index 0) gives +/-3 and +/-1, so blocks within that are taken as silent too (and so
+    // come out of the pack as zeros)
+
+    int silence = 7 >> (bits_per_sample - 1);
+
+    for (block_index = 0; res && (bytes_left || run_blocks); ++block_index) {
+        uint32_t block_size = bytes_left < entry->BlockSize ? bytes_left : entry->BlockSize;
+        int silent = 0, num_samples, i;
+
+        if (block_size) {
+            if (fread (block, 1, block_size, infile) != block_size) {
+                res = 0;
+                break;
+            }
+
+            num_samples = adpcm_decode_block_ex (pcm, block, block_size, num_channels, bits_per_sample) * num_channels;
+
+            for (silent = num_samples && block_index != loop_block, i = 0; silent && i < num_samples; ++i)
+                silent = pcm [i] >= -silence && pcm [i] <= silence;
+
+            bytes_left -= block_size;
+        }
+
+        if (silent && run_blocks < 65535) {
+            run_blocks++;
+            continue;
+        }
+
+        if (run_blocks) {
+            marker [0] = run_blocks;
+            marker [1] = run_blocks >> 8;
+            marker [2] = 0;
+            marker [3] = PACK_SILENT_MARKER;
+            res = fwrite (marker, 1, 4, outfile) == 4;
+            bytes_stored += 4;
+            run_blocks = silent;
+        }
+
+        if (block_size && !silent) {
+            if (block_index == loop_block)
+                entry->LoopOffset = bytes_stored;
+
+            res = res && fwrite (block, 1, block_size, outfile) == block_size;
+            bytes_stored += block_size;
+        }
+    }
+
+    entry->DataSize = bytes_stored;
+    entry->Flags |= PACK_SILENT_RUNS;
+    free (block);
+    free (pcm);
+    return res;
+}
+
+static int copy_bytes (FILE *outfile, FILE *infile, uint32_t count)
+{
+    unsigned char buffer [65536];
+
+    while (count) {
+        uint32_t bytes = count < sizeof (buffer) ? count : sizeof (buffer);
+
+        if (fread (buffer, 1, bytes, infile) != bytes || fwrite (buffer, 1, bytes, outfile) != bytes)
+            return 0;
+
+        count -= bytes;
+    }
+
+    return 1;
+}
+
+// Pack mode stores the raw ADPCM blocks of all the sounds in one file, preceded by a header and a
+// fixed-size index entry per clip (offset, sample count, rate, channels, block size and loop) so that
+// the decoder can find a clip without any parsing. The clip data is collected into a temporary file
+// first because the index (which precedes it) isn't known until all sounds are encoded. With -c the
+// pack is written as a single PROGMEM array instead (with the usual snd_ enum of clip numbers).
+
+static int pack_generator (char *source, char *outfilename, int flags, int blocksize_pow2, int lookahead, char *cache_dir, int header)
+{
+    char tempname [4096], dataname [4096], packname [4096], name [256];
+    FILE *outfile = NULL, *datafile = NULL, *packfile = NULL, *infile;
+    uint32_t data_bytes = 0, index_bytes;
+    PackEntry *entries = NULL;
+    PackHeader pack_header;
+    BatchJobs jobs;
+    int res = 0, i;
+
+    memset (&jobs, 0, sizeof (jobs));
+    tempname [0] = dataname [0] = packname [0] = 0;
+
+    if (!list_files (&jobs, source, NULL)) {
+        free_files (&jobs);
+        return -1;
+    }
+
+    if (jobs.num_files > 65535) {
+        fprintf (stderr, "too many files for a pack!\n");
+        free_files (&jobs);
+        return -1;
+    }
+
+    index_bytes = sizeof (PackHeader) + jobs.num_files * sizeof (PackEntry);
+
+    if (!(entries = calloc (jobs.num_files, sizeof (PackEntry)))) {
+        fprintf (stderr, "could not allocate memory for pack index!\n");
+        free_files (&jobs);
+        return -1;
+    }
+
+    if (!temp_filename (tempname, sizeof (tempname)) || !temp_filename (dataname, sizeof (dataname)) ||
+        (header && !temp_filename (packname, sizeof (packname))) || !(datafile = fopen (dataname, "w+b"))) {
+            fprintf (stderr, "can't create a temporary file!\n");
+            res = -1;
+    }
+
+#if defined (__unix__) || defined (__APPLE__)
+    if (cache_dir)
+        mkdir (cache_dir, 0777);        // fails harmlessly if it exists
+#endif
+
+    for (i = 0; i < jobs.num_files && !res; ++i) {
+        static const char padding [PACK_ALIGNMENT];
+        PackEntry *entry = entries + i;
+
+        if (!(infile = encode_to_file (jobs.infilenames [i], tempname, cache_dir, flags, blocksize_pow2, lookahead))) {
+            res = -1;
+            break;
+        }
+
+        if (!read_pack_entry (infile, entry)) {
+            fprintf (stderr, "can't read encoded \"%s\"!\n", jobs.infilenames [i]);
+            res = -1;
+        }
+        else {
+            entry->Offset = index_bytes + data_bytes;
+
+            if (!copy_clip_blocks (datafile, infile, entry) ||
+                fwrite (padding, 1, -entry->DataSize & (PACK_ALIGNMENT - 1), datafile) != (-entry->DataSize & (PACK_ALIGNMENT - 1))) {
+                    fprintf (stderr, "can't write temporary file \"%s\"!\n", dataname);
+                    res = -1;
+            }
+
+            data_bytes += (entry->DataSize + PACK_ALIGNMENT - 1) & ~(PACK_ALIGNMENT - 1);
+
+            if (verbosity > 0)
+                fprintf (stderr, "clip %d: \"%s\", %lu samples in %lu bytes\n", i, jobs.infilenames [i],
+                    (unsigned long) entry->NumSamples, (unsigned long) entry->DataSize);
+        }
+
+        fclose (infile);
+    }
+
+    if (!res) {
+        if (header) {
+            if (!(packfile = fopen (packname, "w+b"))) {
+                fprintf (stderr, "can't create a temporary file!\n");
+                res = -1;
+            }
+        }
+        else if (!strcmp (outfilename, "-")) {
+            packfile = stdout;
+#if defined (_WIN32)
+            _setmode (_fileno (stdout), _O_BINARY);
+#endif
+        }
+        else if (!(packfile = fopen (outfilename, "wb"))) {
+            fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+            res = -1;
+        }
+    }
+
+    if (!res) {
+        memcpy (pack_header.ID, "XQPK", 4);
+        pack_header.Version = PACK_VERSION;
+        pack_header.NumClips = jobs.num_files;
+        pack_header.EntrySize = sizeof (PackEntry);
+        pack_header.Alignment = PACK_ALIGNMENT;
+        pack_header.TotalSize = index_bytes + data_bytes;
+        adpcm_native_to_little_endian (&pack_header, PackHeaderFormat);
+
+        for (i = 0; i < jobs.num_files; ++i)
+            adpcm_native_to_little_endian (entries + i, PackEntryFormat);
+
+        rewind (datafile);
+
+        if (!fwrite (&pack_header, sizeof (PackHeader), 1, packfile) ||
+            fwrite (entries, sizeof (PackEntry), jobs.num_files, packfile) != (size_t) jobs.num_files ||
+            !copy_bytes (packfile, datafile, data_bytes) || fflush (packfile)) {
+                fprintf (stderr, "can't write file \"%s\"!\n", header ? packname : outfilename);
+                res = -1;
+        }
+    }
+
+    if (!res && header) {
+        if (!strcmp (outfilename, "-"))
+            outfile = stdout;
+        else if (!(outfile = fopen (outfilename, "w"))) {
+            fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+            res = -1;
+        }
+
+        if (outfile) {
+            fputs (header_prologue, outfile);
+            fputs ("typedef enum {\n", outfile);
+
+            for (i = 0; i < jobs.num_files; ++i) {
+                sound_name (name, sizeof (name), jobs.infilenames [i]);
+                fprintf (outfile, "  snd_%s,\n", name);
+            }
+
+            fputs ("};\n\n\n", outfile);
+            fputs ("const uint8_t adpcm_pack[] PROGMEM ={\n ", outfile);
+            rewind (packfile);
+
+            if (!write_hex_array (outfile, packfile, index_bytes + data_bytes) || fflush (outfile)) {
+                fprintf (stderr, "can't write file \"%s\"!\n", outfilename);
+                res = -1;
+            }
+
+            fprintf (outfile, "\n};\n//----ADPCM-PACK-----//bytes=%lu (%.2fKB)\n\n", (unsigned long) index_bytes + data_bytes + 4,
+                (index_bytes + data_bytes + 4) / 1024.0);
+            fprintf (outfile, "#endif //__sndeffects_h__ bytes = %lu (%.2fKB)\n", (unsigned long) index_bytes + data_bytes + 4,
+                (index_bytes + data_bytes + 4) / 1024.0);
+
+            if (outfile != stdout)
+                fclose (outfile);
+        }
+    }
+
+    if (verbosity >= 0 && !res)
+        fprintf (stderr, "wrote %d clips (%lu bytes, %lu of them index) to \"%s\"\n", jobs.num_files,
+            (unsigned long) index_bytes + data_bytes, (unsigned long) index_bytes, outfilename);
+
+    if (packfile && packfile != stdout)
+        fclose (packfile);
+
+    if (datafile)
+        fclose (datafile);
+
+    if (tempname [0])
+        remove (tempname);
+
+    if (dataname [0])
+        remove (dataname);
+
+    if (packname [0])
+        remove (packname);
+
+    free (entries);
+    free_files (&jobs);
+    return res;
+}
+
+// Splice mode joins ADPCM .wav files (or sample ranges of them) into one without re-encoding them:
+// the blocks are copied verbatim and only the header (with the fact sample count) is new. Infile is
+// one .wav file or a list of them (as with -c) and any name may end in @first[,last] to use just
+// those samples (inclusive, as with -l). Because every block but the last must be full, a range
+// normally starts at the block holding its first sample and (unless it's the final one) ends at the
+// end of the block holding its last sample, padded with silence if the file ends first. The end of
+// the final range is exact, which is lossless because its last block is just rebuilt shorter. With
+// -a every cut is exact, and the blocks that are then out of step with the blocks of their source
+// are re-encoded from the decoded audio (which is everything after a cut inside a block).
+
+typedef struct {
+    uint64_t first, last;               // samples of the source to use (inclusive)
+    int pad;                            // silent samples to add to fill the last block
+} SpliceRange;
+
+typedef struct {
+    FILE *outfile;
+    int num_channels, bits_per_sample, samples_per_block, lookahead, noise_shaping;
+    int16_t *pending;                   // decoded audio waiting for a full block to re-encode
+    int pending_samples;
+    uint8_t *block;
+    unsigned long copied, extracted, encoded;
+} SpliceWriter;
+
+// Take an optional @first[,last] range off the end of a filename (if what follows the @ is not a
+// valid range then it's just part of the name).
+
+static void parse_splice_range (char *filename, uint64_t *first, uint64_t *last)
+{
+    char *range = strrchr (filename, '@'), *end;
+    uint64_t value;
+
+    *first = 0;
+    *last = (uint64_t) -1;
+
+    if (!range || range [1] < '0' || range [1] > '9')
+        return;
+
+    value = strtoull (range + 1, &end, 10);
+
+    if (*end == ',' && end [1] >= '0' && end [1] <= '9')
+        *last = strtoull (end + 1, &end, 10);
+
+    if (*end) {
+        *last = (uint64_t) -1;
+        return;
+    }
+
+    *first = value;
+    *range = 0;
+}
+
+// Compute a decaying average (in reverse) of the sample deltas so that we can let the encoder know
+// what kind of initial deltas to expect (helps initializing index).
+
+static void compute_initial_deltas (const int16_t *pcm, int num_samples, int num_channels, int32_t *average_deltas)
+{
+    int i, ch;
+
+    memset (average_deltas, 0, num_channels * sizeof (int32_t));
+
+    for (i = num_samples * num_channels; i -= num_channels;)
+        for (ch = 0; ch < num_channels; ++ch) {
+            average_deltas [ch] -= average_deltas [ch] >> 3;
+            average_deltas [ch] += abs ((int32_t) pcm [i + ch] - pcm [i + ch - num_channels]);
+        }
+
+    for (ch = 0; ch < num_channels; ++ch)
+        average_deltas [ch] >>= 3;
+}
+
+// Re-encode the pending audio as one block (a full one, or the short final block) with a new
+// encoder context, which is fine because each block starts over from its header anyway.
+
+static int splice_encode_block (SpliceWriter *sw)
+{
+    int num_channels = sw->num_channels, num_samples = sw->pending_samples, adpcm_samples, i;
+    size_t block_size = adpcm_block_size (num_samples, num_channels, sw->bits_per_sample), num_bytes;
+    int32_t average_deltas [ADPCM_MAX_CHANNELS];
+    void *adpcm_cnxt;
+
+    // duplicate the last sample(s) of a short block so we don't create problems for the lookahead
+
+    adpcm_samples = adpcm_block_samples (block_size, num_channels, sw->bits_per_sample);
+
+    for (i = num_samples * num_channels; i < adpcm_samples * num_channels; ++i)
+        sw->pending [i] = sw->pending [i - num_channels];
+
+    compute_initial_deltas (sw->pending, adpcm_samples, num_channels, average_deltas);
+
+    if (!(adpcm_cnxt = adpcm_create_context (num_channels, sw->lookahead, sw->noise_shaping, average_deltas)))
+        return 0;
+
+    adpcm_encode_block_ex (adpcm_cnxt, sw->block, &num_bytes, sw->pending, adpcm_samples, sw->bits_per_sample);
+    adpcm_free_context (adpcm_cnxt);
+    sw->pending_samples = 0;
+    sw->encoded++;
+
+    return num_bytes == block_size && fwrite (sw->block, 1, block_size, sw->outfile) == block_size;
+}
+
+// Add decoded audio (or silence, if pcm is NULL) to be re-encoded, writing every block that fills.
+
+static int splice_write_pcm (SpliceWriter *sw, const int16_t *pcm, int num_samples)
+{
+    while (num_samples) {
+        int count = sw->samples_per_block - sw->pending_samples;
+        int16_t *dst = sw->pending + sw->pending_samples * sw->num_channels;
+
+        if (count > num_samples)
+            count = num_samples;
+
+        if (pcm) {
+            memcpy (dst, pcm, count * sw->num_channels * 2);
+            pcm += count * sw->num_channels;
+        }
+        else
+            memset (dst, 0, count * sw->num_channels * 2);
+
+        sw->pending_samples += count;
+        num_samples -= count;
+
+        if (sw->pending_samples == sw->samples_per_block && !splice_encode_block (sw))
+            return 0;
+    }
+
+    return 1;
+}
+
+// Write one range of a source, block by block: a whole block that lines up with the output is copied
+// verbatim, a partial block at the very end of the output is rebuilt with adpcm_extract_block_ex()
+// (also lossless) and anything else is decoded and queued for re-encoding.
+
+static int splice_copy_range (SpliceWriter *sw, FILE *infile, PackEntry *entry, SpliceRange *range, int final)
+{
+    int num_channels = sw->num_channels, bits_per_sample = sw->bits_per_sample, samples_per_block = sw->samples_per_block;
+    uint64_t position = range->first, data_start = ftello (infile), block_index = position / samples_per_block;
+    uint8_t *block = malloc (entry->BlockSize);
+    int16_t *pcm = malloc (samples_per_block * num_channels * 2);
+    int res = block && pcm;
+
+    if (res && block_index && fseeko (infile, data_start + block_index * entry->BlockSize, SEEK_SET))
+        res = 0;
+
+    for (; res && position <= range->last; ++block_index) {
+        uint64_t block_offset = block_index * entry->BlockSize, block_start = block_index * samples_per_block;
+        size_t block_size = entry->DataSize - block_offset < entry->BlockSize ? entry->DataSize - block_offset : entry->BlockSize;
+        int sample_index = (int) (position - block_start), block_samples, num_samples;
+
+        if (block_offset >= entry->DataSize || fread (block, 1, block_size, infile) != block_size) {
+            res = 0;
+            break;
+        }
+
+        block_samples = adpcm_block_samples (block_size, num_channels, bits_per_sample);
+
+        if ((uint64_t) block_samples > entry->NumSamples - block_start)
+            block_samples = (int) (entry->NumSamples - block_start);
+
+        num_samples = block_samples - sample_index;
+
+        if ((uint64_t) num_samples > range->last - position + 1)
+            num_samples = (int) (range->last - position + 1);
+
+        if (!sw->pending_samples && !sample_index && num_samples == samples_per_block) {
+            res = fwrite (block, 1, block_size, sw->outfile) == block_size;
+            sw->copied++;
+        }
+        else if (!sw->pending_samples && final && position + num_samples > range->last) {
+            res = adpcm_extract_block_ex (sw->block, &block_size, block, block_size, num_channels, bits_per_sample, sample_index, num_samples) &&
+                fwrite (sw->block, 1, block_size, sw->outfile) == block_size;
+            sw->extracted++;
+        }
+        else
+            res = adpcm_decode_block_range_ex (pcm, block, block_size, num_channels, bits_per_sample, 0, sample_index + num_samples, NULL) &&
+                splice_write_pcm (sw, pcm + sample_index * num_channels, num_samples);
+
+        position += num_samples;
+    }
+
+    res = res && splice_write_pcm (sw, NULL, range->pad);
+    free (block);
+    free (pcm);
+    return res;
+}
+
+static int splice_generator (char *source, char *outfilename, int flags, int lookahead, int accurate)
+{
+    int num_channels = 0, bits_per_sample = 0, samples_per_block = 0, res = 0, i;
+    uint64_t total_samples = 0, first, last;
+    char name [4096], id [4] = "";
+    SpliceRange *ranges = NULL;
+    PackEntry format, entry;
+    SpliceWriter writer;
+    FILE *infile;
+    BatchJobs jobs;
+
+    memset (&jobs, 0, sizeof (jobs));
+    memset (&writer, 0, sizeof (writer));
+    memset (&format, 0, sizeof (format));
+
+    // infile is either one ADPCM .wav file (maybe with a range) or a list of them
+
+    snprintf (name, sizeof (name), "%s", source);
+    parse_splice_range (name, &first, &last);
+
+    if ((infile = fopen (name, "rb"))) {
+        if (!fread (id, sizeof (id), 1, infile))
+            id [0] = 0;
+
+        fclose (infile);
+    }
+
+    if (!(strncmp (id, "RIFF", 4) ? list_files (&jobs, source, NULL) : add_filename (&jobs, source)) ||
+        !(ranges = calloc (jobs.num_files, sizeof (SpliceRange)))) {
+            free_files (&jobs);
+            return -1;
+    }
+
+    // first read all the headers to check the formats and work out the ranges (and total length)
+
+    for (i = 0; i < jobs.num_files && !res; ++i) {
+        SpliceRange *range = ranges + i;
+
+        snprintf (name, sizeof (name), "%s", jobs.infilenames [i]);
+        parse_splice_range (name, &range->first, &range->last);
+
+        if (!(infile = fopen (name, "rb"))) {
+            fprintf (stderr, "can't open file \"%s\"!\n", name);
+            res = -1;
+            break;
+        }
+
+        if (!read_pack_entry (infile, &entry) || entry.NumChannels > ADPCM_MAX_CHANNELS ||
+            adpcm_block_samples (entry.BlockSize, entry.NumChannels, entry.BitsPerSample ? entry.BitsPerSample : 4) <= 0) {
+                fprintf (stderr, "\"%s\" is not a valid IMA ADPCM .wav file!\n", name);
+                res = -1;
+        }
+        else if (!i)
+            format = entry;
+        else if (entry.NumChannels != format.NumChannels || entry.SampleRate != format.SampleRate ||
+            entry.BlockSize != format.BlockSize || entry.BitsPerSample != format.BitsPerSample) {
+                fprintf (stderr, "\"%s\" does not match the format of the first file!\n", name);
+                res = -1;
+        }
+
+        fclose (infile);
+
+        if (res)
+            break;
+
+        num_channels = format.NumChannels;
+        bits_per_sample = format.BitsPerSample ? format.BitsPerSample : 4;
+        samples_per_block = adpcm_block_samples (format.BlockSize, num_channels, bits_per_sample);
+
+        if (range->last >= entry.NumSamples)
+            range->last = entry.NumSamples - 1;
+
+        if (range->first > range->last) {
+            fprintf (stderr, "range is past the end of \"%s\" (%lu samples)!\n", name, (unsigned long) entry.NumSamples);
+            res = -1;
+            break;
+        }
+
+        // unless cuts are to be exact, round ranges out to whole blocks (except the very end)
+
+        if (!accurate) {
+            range->first -= range->first % samples_per_block;
+
+            if (i < jobs.num_files - 1) {
+                range->last += samples_per_block - 1 - range->last % samples_per_block;
+
+                if (range->last >= entry.NumSamples) {
+                    range->pad = (int) (range->last - entry.NumSamples + 1);
+                    range->last = entry.NumSamples - 1;
+                }
+            }
+        }
+
+        total_samples += range->last - range->first + 1 + range->pad;
+    }
+
+    if (!res) {
+        if (!strcmp (outfilename, "-")) {
+            writer.outfile = stdout;
+#if defined (_WIN32)
+            _setmode (_fileno (stdout), _O_BINARY);
+#endif
+        }
+        else if (!(writer.outfile = fopen (outfilename, "wb"))) {
+            fprintf (stderr, "can't open file \"%s\" for writing!\n", outfilename);
+            res = -1;
+        }
+    }
+
+    if (!res) {
+        writer.num_channels = num_channels;
+        writer.bits_per_sample = bits_per_sample;
+        writer.samples_per_block = samples_per_block;
+        writer.lookahead = lookahead;
+        writer.noise_shaping = (flags & ADPCM_FLAG_NOISE_SHAPING) ?
+            (format.SampleRate > 64000 ? NOISE_SHAPING_STATIC : NOISE_SHAPING_DYNAMIC) : NOISE_SHAPING_OFF;
+        writer.pending = malloc (samples_per_block * num_channels * 2);
+        writer.block = malloc (format.BlockSize);
+
+        if (!writer.pending || !writer.block) {
+            fprintf (stderr, "could not allocate memory for splicing!\n");
+            res = -1;
+        }
+        else if (!(flags & ADPCM_FLAG_RAW_OUTPUT) && !write_adpcm_wav_header (writer.outfile, num_channels, bits_per_sample,
+            total_samples, format.SampleRate, samples_per_block, NULL, 0, NULL)) {
+                fprintf (stderr, "can't write header to file \"%s\"!\n", outfilename);
+                res = -1;
+        }
+    }
+
+    for (i = 0; i < jobs.num_files && !res; ++i) {
+        SpliceRange *range = ranges + i;
+
+        snprintf (name, sizeof (name), "%s", jobs.infilenames [i]);
+        parse_splice_range (name, &first, &last);
+
+        if (!(infile = fopen (name, "rb")) || !read_pack_entry (infile, &entry) ||
+            !splice_copy_range (&writer, infile, &entry, range, i == jobs.num_files - 1)) {
+                fprintf (stderr, "can't splice \"%s\" to \"%s\"!\n", name, outfilename);
+                res = -1;
+        }
+        else if (verbosity > 0)
+            fprintf (stderr, "piece %d: \"%s\", samples %llu to %llu%s\n", i, name, (unsigned long long) range->first,
+                (unsigned long long) range->last, range->pad ? " (padded to block)" : "");
+
+        if (infile)
+            fclose (infile);
+    }
+
+    // the final range may leave a partial block to re-encode (-a only)
+
+    if (!res && writer.pending_samples && !splice_encode_block (&writer)) {
+        fprintf (stderr, "can't write file \"%s\"!\n", outfilename);
+        res = -1;
+    }
+
+    if (!res && fflush (writer.outfile)) {
+        fprintf (stderr, "can't write file \"%s\"!\n", outfilename);
+        res = -1;
+    }
+
+    if (verbosity >= 0 && !res)
+        fprintf (stderr, "spliced %d files (%llu samples) to \"%s\": %lu blocks copied, %lu trimmed, %lu re-encoded\n",
+            jobs.num_files, (unsigned long long) total_samples, outfilename, writer.copied, writer.extracted, writer.encoded);
+
+    if (writer.outfile && writer.outfile != stdout)
+        fclose (writer.outfile);
+
+    free (writer.pending);
+    free (writer.block);
+    free (ranges);
+    free_files (&jobs);
+    return res;
+}
+
+// Memory mapped I/O for regular files of known length: the input audio is used in place and the
+// output audio is written straight into the (preallocated) output file, which saves the copies and
+// the per-block calls of stdio. These return NULL whenever this is not possible (including when the
+// data would not be aligned for 16-bit samples) and the caller simply uses stdio instead.
+
+typedef struct {
+    void *base;
+    size_t size;
+} FileMap;
+
+static uint8_t *map_input (FILE *infile, uint64_t length, int align, FileMap *map)
+{
+#ifdef HAVE_MMAP
+    int64_t offset = ftello (infile);
+    struct stat st;
+
+    memset (map, 0, sizeof (*map));
+
+    // (the whole file must fit the address space, else we fall back to stdio)
+
+    if (!length || offset < 0 || offset % align || offset + length > (size_t) -1 || fstat (fileno (infile), &st) ||
+        !S_ISREG (st.st_mode) || (uint64_t) st.st_size < offset + length)
+            return NULL;
+
+    map->size = offset + length;
+    map->base = mmap (NULL, map->size, PROT_READ, MAP_PRIVATE, fileno (infile), 0);
+
+    if (map->base == MAP_FAILED) {
+        map->base = NULL;
+        return NULL;
+    }
+
+    madvise (map->base, map->size, MADV_SEQUENTIAL);
+    return (uint8_t *) map->base + offset;
+#else
+    (void) infile; (void) length; (void) align;
+    memset (map, 0, sizeof (*map));
+    return NULL;
+#endif
+}
+
+static uint8_t *map_output (FILE *outfile, uint64_t length, int align, FileMap *map)
+{
+#ifdef HAVE_MMAP
+    int64_t offset;
+    struct stat st;
+
+    memset (map, 0, sizeof (*map));
+
+    if (!length || fflush (outfile) || (offset = ftello (outfile)) < 0 || offset % align || offset + length > (size_t) -1 ||
+        fstat (fileno (outfile), &st) || !S_ISREG (st.st_mode) || ftruncate (fileno (outfile), offset + length))
+            return NULL;
+
+    map->size = offset + length;
+    map->base = mmap (NULL, map->size, PROT_READ | PROT_WRITE, MAP_SHARED, fileno (outfile), 0);
+
+    if (map->base == MAP_FAILED) {
+        map->base = NULL;
+        return NULL;
+    }
+
+    madvise (map->base, map->size, MADV_SEQUENTIAL);
+    return (uint8_t *) map->base + offset;
+#else
+    (void) outfile; (void) length; (void) align;
+    memset (map, 0, sizeof (*map));
+    return NULL;
+#endif
+}
+
+// unmap, and leave an output file (when given) positioned at its end for stdio
+
+static void unmap_file (FileMap *map, FILE *outfile)
+{
+#ifdef HAVE_MMAP
+    if (map->base) {
+        munmap (map->base, map->size);
+        map->base = NULL;
+
+        if (outfile)
+            fseeko (outfile, 0, SEEK_END);
+    }
+#else
+    (void) map; (void) outfile;
+#endif
+}
+
+#ifdef ENABLE_THREADS
+
+// With threads, file reading and writing run in their own threads (when not mapped) so that
+// I/O latency is hidden behind the encoding. Blocks are passed through bounded queues of a few
+// slots, filled and emptied in order; a slot holding 0 bytes marks the end of the stream.
+
+#define PIPELINE_SLOTS 4
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint8_t *buffers;
+    size_t slot_size, sizes [PIPELINE_SLOTS];
+    int head, tail, count;              // next slot to fill, next to empty, slots filled
+} BlockQueue;
+
+typedef struct {
+    BlockQueue queue;
+    pthread_t thread;
+    FILE *file;
+    uint64_t num_bytes;                 // reader only: bytes to read, or 0 for until EOF
+    int started, error;
+} PipelineStage;
+
+static uint8_t *queue_get_free (BlockQueue *queue)
+{
+    uint8_t *buffer;
+
+    pthread_mutex_lock (&queue->mutex);
+
+    while (queue->count == PIPELINE_SLOTS)
+        pthread_cond_wait (&queue->cond, &queue->mutex);
+
+    buffer = queue->buffers + queue->head * queue->slot_size;
+    pthread_mutex_unlock (&queue->mutex);
+    return buffer;
+}
+
+static void queue_put (BlockQueue *queue, size_t size)
+{
+    pthread_mutex_lock (&queue->mutex);
+    queue->sizes [queue->head] = size;
+    queue->head = (queue->head + 1) % PIPELINE_SLOTS;
+    queue->count++;
+    pthread_cond_broadcast (&queue->cond);
+    pthread_mutex_unlock (&queue->mutex);
+}
+
+static uint8_t *queue_get_filled (BlockQueue *queue, size_t *size)
+{
+    uint8_t *buffer;
+
+    pthread_mutex_lock (&queue->mutex);
+
+    while (!queue->count)
+        pthread_cond_wait (&queue->cond, &queue->mutex);
+
+    buffer = queue->buffers + queue->tail * queue->slot_size;
+    *size = queue->sizes [queue->tail];
+    pthread_mutex_unlock (&queue->mutex);
+    return buffer;
+}
+
+static void queue_release (BlockQueue *queue)
+{
+    pthread_mutex_lock (&queue->mutex);
+    queue->tail = (queue->tail + 1) % PIPELINE_SLOTS;
+    queue->count--;
+    pthread_cond_broadcast (&queue->cond);
+    pthread_mutex_unlock (&queue->mutex);
+}
+
+// read blocks of up to slot_size bytes until num_bytes (or EOF), then put the end marker
+
+static void *reader_thread (void *arg)
+{
+    PipelineStage *stage = (PipelineStage *) arg;
+    uint64_t bytes_left = stage->num_bytes;
+    size_t bytes_read;
+
+    do {
+        size_t bytes_wanted = stage->queue.slot_size;
+        uint8_t *buffer = queue_get_free (&stage->queue);
+
+        if (stage->num_bytes && bytes_wanted > bytes_left)
+            bytes_wanted = bytes_left;
+
+        bytes_read = bytes_wanted ? fread (buffer, 1, bytes_wanted, stage->file) : 0;
+        queue_put (&stage->queue, bytes_read);
+        bytes_left -= bytes_read;
+    } while (bytes_read);
+
+    return NULL;
+}
+
+// write blocks until the end marker, noting any error for when we're joined
+
+static void *writer_thread (void *arg)
+{
+    PipelineStage *stage = (PipelineStage *) arg;
+    size_t size;
+
+    while (1) {
+        uint8_t *buffer = queue_get_filled (&stage->queue, &size);
+
+        if (!size)
+            break;
+
+        if (!stage->error && !fwrite (buffer, size, 1, stage->file))
+            stage->error = 1;
+
+        queue_release (&stage->queue);
+    }
+
+    return NULL;
+}
+
+static int start_stage (PipelineStage *stage, FILE *file, size_t slot_size, uint64_t num_bytes, void *(*function) (void *))
+{
+    memset (stage, 0, sizeof (*stage));
+
+    if (!(stage->queue.buffers = malloc (slot_size * PIPELINE_SLOTS)))
+        return 0;
+
+    stage->queue.slot_size = slot_size;
+    stage->file = file;
+    stage->num_bytes = num_bytes;
+    pthread_mutex_init (&stage->queue.mutex, NULL);
+    pthread_cond_init (&stage->queue.cond, NULL);
+
+    if (pthread_create (&stage->thread, NULL, function, stage)) {
+        pthread_cond_destroy (&stage->queue.cond);
+        pthread_mutex_destroy (&stage->queue.mutex);
+        free (stage->queue.buffers);
+        return 0;
+    }
+
+    return stage->started = 1;
+}
+
+// wait for a stage to end (the writer is sent the end marker first), return its error flag
+
+static int finish_stage (PipelineStage *stage, int is_writer)
+{
+    if (!stage->started)
+        return 0;
+
+    if (is_writer) {
+        queue_get_free (&stage->queue);
+        queue_put (&stage->queue, 0);
+    }
+    else {
+        size_t size;
+
+        // drain the reader to its end marker, in case we stopped short of it
+
+        while (queue_get_filled (&stage->queue, &size) && size)
+            queue_release (&stage->queue);
+    }
+
+    pthread_join (stage->thread, NULL);
+    pthread_cond_destroy (&stage->queue.cond);
+    pthread_mutex_destroy (&stage->queue.mutex);
+    free (stage->queue.buffers);
+    stage->started = 0;
+    return stage->error;
+}
+
+// Also with threads, the channels of each block are encoded in parallel. Every channel gets its
+// own mono encoder context, which gives exactly what encoding them together would because the
+// encoder never looks across channels. The channels of a block are taken one at a time by the
+// workers and by the thread asking for the block, and scattered into the interleaved block.
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t *threads;
+    void **contexts;                    // one mono context per channel
+    int16_t *pcm;                       // samples of each channel, samples_per_block apart
+    uint8_t *adpcm;                     // mono block of each channel, block_size apart
+    size_t block_size, num_bytes;
+    int num_channels, bits_per_sample, samples_per_block, num_threads, started, quit;
+    const int16_t *source;              // block being encoded: interleaved input and output
+    uint8_t *dest;
+    int num_samples, next_channel, channels_left;
+} ChannelPool;
+
+static void encode_channel (ChannelPool *pool, int ch)
+{
+    int num_channels = pool->num_channels, group_bytes = pool->bits_per_sample == 3 ? 12 : 4, i;
+    int16_t *pcm = pool->pcm + ch * pool->samples_per_block;
+    uint8_t *adpcm = pool->adpcm + ch * pool->block_size;
+    size_t num_bytes, offset;
+
+    for (i = 0; i < pool->num_samples; ++i)
+        pcm [i] = pool->source [i * num_channels + ch];
+
+    adpcm_encode_block_ex (pool->contexts [ch], adpcm, &num_bytes, pcm, pool->num_samples, pool->bits_per_sample);
+    memcpy (pool->dest + ch * 4, adpcm, 4);
+
+    for (offset = 4; offset < num_bytes; offset += group_bytes)
+        memcpy (pool->dest + num_channels * 4 + (offset - 4) * num_channels + ch * group_bytes, adpcm + offset, group_bytes);
+
+    if (!ch)
+        pool->num_bytes = num_channels * 4 + (num_bytes - 4) * num_channels;
+}
+
+// take and encode channels of the current block until there are none left (with the mutex held)
+
+static void take_channels (ChannelPool *pool)
+{
+    while (pool->next_channel < pool->num_channels) {
+        int ch = pool->next_channel++;
+
+        pthread_mutex_unlock (&pool->mutex);
+        encode_channel (pool, ch);
+        pthread_mutex_lock (&pool->mutex);
+
+        if (!--pool->channels_left)
+            pthread_cond_broadcast (&pool->cond);
+    }
+}
+
+static void *channel_thread (void *arg)
+{
+    ChannelPool *pool = (ChannelPool *) arg;
+
+    pthread_mutex_lock (&pool->mutex);
+
+    while (1) {
+        while (!pool->quit && pool->next_channel == pool->num_channels)
+            pthread_cond_wait (&pool->cond, &pool->mutex);
+
+        if (pool->quit)
+            break;
+
+        take_channels (pool);
+    }
+
+    pthread_mutex_unlock (&pool->mutex);
+    return NULL;
+}
+
+// start the workers (only worthwhile with more than one channel and core), return 1 if started
+
+static int start_channel_pool (ChannelPool *pool, int num_channels, int bits_per_sample, int samples_per_block,
+    int lookahead, int noise_shaping, int32_t *initial_deltas)
+{
+    int num_threads = channel_workers, ch;
+
+    memset (pool, 0, sizeof (*pool));
+
+    if (!num_threads) {
+#ifdef _SC_NPROCESSORS_ONLN
+        num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+    }
+
+    if (num_threads > num_channels)
+        num_threads = num_channels;
+
+    if (--num_threads < 1)              // the calling thread is a worker too
+        return 0;
+
+    pool->num_channels = num_channels;
+    pool->bits_per_sample = bits_per_sample;
+    pool->samples_per_block = samples_per_block;
+    pool->block_size = adpcm_block_size (samples_per_block, 1, bits_per_sample);
+    pool->next_channel = num_channels;
+    pool->threads = malloc (num_threads * sizeof (pthread_t));
+    pool->contexts = calloc (num_channels, sizeof (void *));
+    pool->pcm = malloc (num_channels * samples_per_block * sizeof (int16_t));
+    pool->adpcm = malloc (num_channels * pool->block_size);
+
+    if (!pool->threads || !pool->contexts || !pool->pcm || !pool->adpcm) {
+        free (pool->threads); free (pool->contexts); free (pool->pcm); free (pool->adpcm);
+        return 0;
+    }
+
+    for (ch = 0; ch < num_channels; ++ch)
+        pool->contexts [ch] = adpcm_create_context (1, lookahead, noise_shaping, initial_deltas + ch);
+
+    pthread_mutex_init (&pool->mutex, NULL);
+    pthread_cond_init (&pool->cond, NULL);
+
+    for (pool->num_threads = 0; pool->num_threads < num_threads; pool->num_threads++)
+        if (pthread_create (pool->threads + pool->num_threads, NULL, channel_thread, pool))
+            break;
+
+    return pool->started = 1;
+}
 
-    strncpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
-    datahdr.ckSize = total_data_bytes;
+// encode a block of num_samples composite samples with the pool, return the bytes written to dest
 
-    // write the RIFF chunks up to just before the data starts
+static size_t encode_channels (ChannelPool *pool, uint8_t *dest, const int16_t *source, int num_samples)
+{
+    pthread_mutex_lock (&pool->mutex);
+    pool->source = source;
+    pool->dest = dest;
+    pool->num_samples = num_samples;
+    pool->next_channel = 0;
+    pool->channels_left = pool->num_channels;
+    pthread_cond_broadcast (&pool->cond);
 
-    native_to_little_endian (&riffhdr, ChunkHeaderFormat);
-    native_to_little_endian (&fmthdr, ChunkHeaderFormat);
-    native_to_little_endian (&wavhdr, WaveHeaderFormat);
-    native_to_little_endian (&facthdr, FactHeaderFormat);
-    native_to_little_endian (&datahdr, ChunkHeaderFormat);
+    take_channels (pool);
 
-    return fwrite (&riffhdr, sizeof (riffhdr), 1, outfile) &&
-        fwrite (&fmthdr, sizeof (fmthdr), 1, outfile) &&
-        fwrite (&wavhdr, wavhdrsize, 1, outfile) &&
-        fwrite (&facthdr, sizeof (facthdr), 1, outfile) &&
-        fwrite (&datahdr, sizeof (datahdr), 1, outfile);
+    while (pool->channels_left)
+        pthread_cond_wait (&pool->cond, &pool->mutex);
+
+    pthread_mutex_unlock (&pool->mutex);
+    return pool->num_bytes;
+}
+
+static void finish_channel_pool (ChannelPool *pool)
+{
+    int i;
+
+    if (!pool->started)
+        return;
+
+    pthread_mutex_lock (&pool->mutex);
+    pool->quit = 1;
+    pthread_cond_broadcast (&pool->cond);
+    pthread_mutex_unlock (&pool->mutex);
+
+    for (i = 0; i < pool->num_threads; ++i)
+        pthread_join (pool->threads [i], NULL);
+
+    for (i = 0; i < pool->num_channels; ++i)
+        adpcm_free_context (pool->contexts [i]);
+
+    pthread_cond_destroy (&pool->cond);
+    pthread_mutex_destroy (&pool->mutex);
+    free (pool->threads); free (pool->contexts); free (pool->pcm); free (pool->adpcm);
+    pool->started = 0;
+}
+
+#endif
+
+// bytes of ADPCM data holding num_samples, the last block being shorter
+
+static uint64_t adpcm_data_bytes (int num_channels, int bits_per_sample, uint64_t num_samples, int samples_per_block)
+{
+    int leftover_samples = num_samples % samples_per_block;
+    uint64_t total_data_bytes = num_samples / samples_per_block * adpcm_block_size (samples_per_block, num_channels, bits_per_sample);
+
+    if (leftover_samples)
+        total_data_bytes += adpcm_block_size (leftover_samples, num_channels, bits_per_sample);
+
+    return total_data_bytes;
 }
 
-static int adpcm_decode_data (FILE *infile, FILE *outfile, int num_channels, size_t num_samples, int block_size)
+static int adpcm_decode_data (FILE *infile, FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int block_size, int raw_output, RiffChunks *chunks)
 {
-    int samples_per_block = (block_size - num_channels * 4) * (num_channels ^ 3) + 1, percent;
-    void *pcm_block = malloc (samples_per_block * num_channels * 2);
-    void *adpcm_block = malloc (block_size);
-    size_t progress_divider = 0;
+    int samples_per_block = adpcm_block_samples (block_size, num_channels, bits_per_sample), percent, res = 0;
+    int16_t *pcm_block = malloc (samples_per_block * num_channels * 2);
+    uint8_t *adpcm_block = malloc (block_size), *in_map, *out_map;
+    uint64_t progress_divider = 0, samples_left = num_samples, samples_done = 0;
+    FileMap in_filemap, out_filemap;
 
     if (!pcm_block || !adpcm_block) {
         fprintf (stderr, "could not allocate memory for buffers!\n");
+        free (adpcm_block);
+        free (pcm_block);
         return -1;
     }
 
+    in_map = map_input (infile, num_samples ? adpcm_data_bytes (num_channels, bits_per_sample, num_samples, samples_per_block) : 0, 1, &in_filemap);
+    out_map = map_output (outfile, num_samples * num_channels * 2, 2, &out_filemap);
+
+    if (verbosity > 0 && (in_map || out_map))
+        fprintf (stderr, "using memory mapped I/O for%s%s\n", in_map ? " input" : "", out_map ? " output" : "");
+
     if (verbosity >= 0 && num_samples > 1000) {
         progress_divider = (num_samples + 50) / 100;
         fprintf (stderr, "\rprogress: %d%% ", percent = 0);
         fflush (stderr);
     }
 
-    while (num_samples) {
+    // a num_samples of zero means the length is unknown (streaming) and we go until EOF
+
+    while (!num_samples || samples_left) {
         int this_block_adpcm_samples = samples_per_block;
         int this_block_pcm_samples = samples_per_block;
+        const uint8_t *adpcm_source = adpcm_block;
+        int16_t *pcm_dest = pcm_block;
 
-        if (this_block_adpcm_samples > num_samples) {
-            this_block_adpcm_samples = ((num_samples + 6) & ~7) + 1;
-            block_size = (this_block_adpcm_samples - 1) / (num_channels ^ 3) + (num_channels * 4);
-            this_block_pcm_samples = num_samples;
+        if (num_samples && (uint64_t) this_block_adpcm_samples > samples_left) {
+            block_size = adpcm_block_size (samples_left, num_channels, bits_per_sample);
+            this_block_adpcm_samples = adpcm_block_samples (block_size, num_channels, bits_per_sample);
+            this_block_pcm_samples = samples_left;
         }
 
-        if (!fread (adpcm_block, block_size, 1, infile)) {
+        // decode straight into the output map, except a short last block that we have to trim
+
+        if (out_map && this_block_pcm_samples == this_block_adpcm_samples)
+            pcm_dest = (int16_t *) out_map + samples_done * num_channels;
+
+        // blocks before this one were all full size, so we know where this one is in the input map
+
+        if (in_map)
+            adpcm_source = in_map + samples_done / samples_per_block * adpcm_block_size (samples_per_block, num_channels, bits_per_sample);
+        else if (!num_samples) {
+            size_t bytes_read = fread (adpcm_block, 1, block_size, infile);
+
+            if (!bytes_read)
+                break;
+
+            // only the last block can be short, and it must still hold whole groups
+
+            if (bytes_read < (size_t) block_size) {
+                if (bytes_read < (size_t) num_channels * 4 || adpcm_block_size (adpcm_block_samples (bytes_read,
+                    num_channels, bits_per_sample), num_channels, bits_per_sample) != bytes_read) {
+                        fprintf (stderr, "\rincomplete ADPCM block at end of input file!\n");
+                        res = -1;
+                        break;
+                }
+
+                block_size = bytes_read;
+                this_block_adpcm_samples = this_block_pcm_samples = adpcm_block_samples (block_size, num_channels, bits_per_sample);
+            }
+        }
+        else if (!fread (adpcm_block, block_size, 1, infile)) {
             fprintf (stderr, "could not read all audio data from input file!\n");
-            return -1;
+            res = -1;
+            break;
         }
 
-        if (adpcm_decode_block (pcm_block, adpcm_block, block_size, num_channels) != this_block_adpcm_samples) {
-            fprintf (stderr, "adpcm_decode_block() did not return expected value!\n");
-            return -1;
+        if (adpcm_decode_block_ex (pcm_dest, adpcm_source, block_size, num_channels, bits_per_sample) != this_block_adpcm_samples) {
+            fprintf (stderr, "adpcm_decode_block_ex() did not return expected value!\n");
+            res = -1;
+            break;
         }
 
-        if (!fwrite (pcm_block, this_block_pcm_samples * num_channels * 2, 1, outfile)) {
+        if (out_map) {
+            if (pcm_dest == pcm_block)
+                memcpy (out_map + samples_done * num_channels * 2, pcm_block, this_block_pcm_samples * num_channels * 2);
+        }
+        else if (!fwrite (pcm_block, this_block_pcm_samples * num_channels * 2, 1, outfile)) {
             fprintf (stderr, "could not write all audio data to output file!\n");
-            return -1;
+            res = -1;
+            break;
         }
 
-        num_samples -= this_block_pcm_samples;
+        samples_done += this_block_pcm_samples;
+
+        if (num_samples)
+            samples_left -= this_block_pcm_samples;
 
         if (progress_divider) {
-            int new_percent = 100 - num_samples / progress_divider;
+            int new_percent = 100 - samples_left / progress_divider;
 
             if (new_percent != percent) {
                 fprintf (stderr, "\rprogress: %d%% ", percent = new_percent);
@@ -610,101 +2925,519 @@ static int adpcm_decode_data (FILE *infile, FILE *outfile, int num_channels, siz
         }
     }
 
-    if (verbosity >= 0)
+    unmap_file (&in_filemap, NULL);
+    unmap_file (&out_filemap, outfile);
+
+    // if the length was unknown, go back and write the header for what we got (if we can)
+
+    if (!res && !num_samples && !raw_output && (fseeko (outfile, 0, SEEK_SET) ||
+        !write_pcm_wav_header (outfile, num_channels, samples_done, sample_rate, 1, chunks) || fseeko (outfile, 0, SEEK_END))) {
+            if (verbosity >= 0)
+                fprintf (stderr, "\rcould not update header (output not seekable), length left unknown\n");
+    }
+
+    if (!res && verbosity >= 0)
         fprintf (stderr, "\r...completed successfully\n");
 
     free (adpcm_block);
     free (pcm_block);
-    return 0;
+    return res;
+}
+
+// Convert count samples of 24-bit or 32-bit integer or 32-bit float PCM (as stored in the file,
+// so little-endian) to 16-bit. This is rounded, or has TPDF dither of +/- 1 LSB added when dither
+// is not NULL (from the same LCG as the library's output conversion). The encoder does this to
+// each block as it is read, so high-resolution masters don't need a separate conversion pass.
+
+static void convert_to_16bit (int16_t *dst, const uint8_t *src, int count, int sample_bytes, int float_data, uint32_t *dither)
+{
+    while (count--) {
+        int64_t value;      // scaled to 32 bits
+
+        if (float_data) {
+            union { uint32_t bits; float value; } sample;
+            double scaled;
+
+            sample.bits = src [0] + ((uint32_t) src [1] << 8) + ((uint32_t) src [2] << 16) + ((uint32_t) src [3] << 24);
+            scaled = sample.value * 2147483648.0;
+
+            if (!(scaled > -2147483648.0))      // (also catches NaN)
+                scaled = -2147483648.0;
+            else if (scaled > 2147483647.0)
+                scaled = 2147483647.0;
+
+            value = (int64_t) scaled;
+        }
+        else if (sample_bytes == 3)
+            value = (int32_t) (((uint32_t) src [0] << 8) + ((uint32_t) src [1] << 16) + ((uint32_t) src [2] << 24));
+        else
+            value = (int32_t) (src [0] + ((uint32_t) src [1] << 8) + ((uint32_t) src [2] << 16) + ((uint32_t) src [3] << 24));
+
+        if (dither) {
+            int32_t r1, r2;
+
+            *dither = *dither * 1664525 + 1013904223;
+            r1 = *dither >> 16;
+            *dither = *dither * 1664525 + 1013904223;
+            r2 = *dither >> 16;
+            value += r1 - r2;
+        }
+
+        value = (value + 0x8000) >> 16;
+        *dst++ = value > 32767 ? 32767 : value < -32768 ? -32768 : (int16_t) value;
+        src += sample_bytes;
+    }
+}
+
+// With -bauto the block size is picked for each file by trial encoding representative segments of
+// it at every power-of-two size (in parallel, with threads). Smaller blocks re-seed the step index
+// more often, which helps on transients, but every block costs a header, so the best size depends
+// on the content. The trials use fresh contexts with a short lookahead and no noise shaping (so the
+// SNR is the plain one), and the rate is that of the whole file at each size. Bits spent on the
+// samples are worth about 6 dB each, so by default the size with the best SNR less 6.02 dB per bit
+// per sample wins; with a target SNR, the smallest file that reaches it does (else the best SNR).
+
+#define AUTO_BLOCK_MIN_POW2     8
+#define AUTO_BLOCK_MAX_POW2     15
+#define AUTO_BLOCK_SEGMENTS     8           // spread evenly over the file (else all of it)
+#define AUTO_BLOCK_SEGMENT      65536       // composite samples in each
+#define AUTO_BLOCK_LOOKAHEAD    1
+
+typedef struct {
+    const int16_t *pcm;                     // the segments, back to back
+    int num_channels, bits_per_sample, num_segments, segment_samples;
+    int block_size, samples_per_block;
+    double signal, error;                   // energies over all the segments
+    double snr, bits;                       // in dB, and bits per sample of the whole file
+} BlockTrial;
+
+static void trial_encode (BlockTrial *trial)
+{
+    int num_channels = trial->num_channels, bits_per_sample = trial->bits_per_sample, segment;
+    int16_t *padded = malloc (trial->samples_per_block * num_channels * 2);
+    int16_t *decoded = malloc (trial->samples_per_block * num_channels * 2);
+    uint8_t *adpcm_block = malloc (trial->block_size);
+    const int16_t *pcm = trial->pcm;
+
+    trial->signal = trial->error = 0.0;
+
+    for (segment = 0; padded && decoded && adpcm_block && segment < trial->num_segments; ++segment) {
+        int samples_left = trial->segment_samples;
+        void *adpcm_cnxt = NULL;
+
+        while (samples_left) {
+            int this_block_pcm_samples = samples_left < trial->samples_per_block ? samples_left : trial->samples_per_block;
+            int this_block_adpcm_samples = trial->samples_per_block, i;
+            const int16_t *source = pcm;
+            size_t num_bytes;
+
+            // a short last block is padded with its last sample(s), as when encoding for real
+
+            if (this_block_pcm_samples < trial->samples_per_block) {
+                this_block_adpcm_samples = adpcm_block_samples (adpcm_block_size (this_block_pcm_samples,
+                    num_channels, bits_per_sample), num_channels, bits_per_sample);
+
+                memcpy (padded, pcm, this_block_pcm_samples * num_channels * 2);
+
+                for (i = this_block_pcm_samples * num_channels; i < this_block_adpcm_samples * num_channels; ++i)
+                    padded [i] = padded [i - num_channels];
+
+                source = padded;
+            }
+
+            if (!adpcm_cnxt) {
+                int32_t average_deltas [ADPCM_MAX_CHANNELS];
+
+                compute_initial_deltas (source, this_block_adpcm_samples, num_channels, average_deltas);
+                adpcm_cnxt = adpcm_create_context (num_channels, AUTO_BLOCK_LOOKAHEAD, NOISE_SHAPING_OFF, average_deltas);
+            }
+
+            adpcm_encode_block_ex (adpcm_cnxt, adpcm_block, &num_bytes, source, this_block_adpcm_samples, bits_per_sample);
+            adpcm_decode_block_ex (decoded, adpcm_block, num_bytes, num_channels, bits_per_sample);
+
+            for (i = 0; i < this_block_pcm_samples * num_channels; ++i) {
+                double error = (double) decoded [i] - pcm [i];
+
+                trial->signal += (double) pcm [i] * pcm [i];
+                trial->error += error * error;
+            }
+
+            pcm += this_block_pcm_samples * num_channels;
+            samples_left -= this_block_pcm_samples;
+        }
+
+        if (adpcm_cnxt)
+            adpcm_free_context (adpcm_cnxt);
+    }
+
+    free (adpcm_block);
+    free (decoded);
+    free (padded);
+}
+
+#ifdef ENABLE_THREADS
+
+static void *trial_thread (void *arg)
+{
+    trial_encode ((BlockTrial *) arg);
+    return NULL;
+}
+
+#endif
+
+// Return the block size for -bauto (as described above), or default_size if the input can't be
+// sampled (it can't seek or the length is unknown). The input is left at the audio data.
+
+static int auto_block_size (FILE *infile, int num_channels, int bits_per_sample, uint64_t num_samples,
+    int sample_bytes, int float_data, int default_size)
+{
+    BlockTrial trials [AUTO_BLOCK_MAX_POW2 - AUTO_BLOCK_MIN_POW2 + 1];
+    int frame_bytes = num_channels * sample_bytes, convert = sample_bytes != 2 || float_data;
+    int num_segments = AUTO_BLOCK_SEGMENTS, segment_samples = AUTO_BLOCK_SEGMENT, num_trials = 0, best = -1, i;
+    int64_t data_start = ftello (infile);
+    double best_score = 0.0;
+    int16_t *pcm, *pcm_ptr;
+    uint8_t *raw = NULL;
+
+    if (!num_samples || data_start < 0) {
+        if (verbosity > 0) fprintf (stderr, "can't sample the input to choose the block size, using %d bytes\n", default_size);
+        return default_size;
+    }
+
+    if (num_samples <= (uint64_t) num_segments * segment_samples) {
+        num_segments = 1;
+        segment_samples = (int) num_samples;
+    }
+
+    pcm = malloc ((size_t) num_segments * segment_samples * num_channels * 2);
+
+    if (!pcm || (convert && !(raw = malloc ((size_t) segment_samples * frame_bytes)))) {
+        free (pcm);
+        return default_size;
+    }
+
+    for (pcm_ptr = pcm, i = 0; i < num_segments; ++i, pcm_ptr += segment_samples * num_channels) {
+        uint64_t segment_start = num_segments > 1 ? (num_samples - segment_samples) * i / (num_segments - 1) : 0;
+
+        if (fseeko (infile, data_start + segment_start * frame_bytes, SEEK_SET) ||
+            !fread (convert ? raw : (uint8_t *) pcm_ptr, (size_t) segment_samples * frame_bytes, 1, infile))
+                break;
+
+        if (convert)
+            convert_to_16bit (pcm_ptr, raw, segment_samples * num_channels, sample_bytes, float_data, NULL);
+    }
+
+    free (raw);
+    fseeko (infile, data_start, SEEK_SET);
+
+    if (i < num_segments) {
+        free (pcm);
+        return default_size;
+    }
+
+    // the candidates, as the converter would make them (e.g., whole 12-byte groups at 3 bits)
+
+    for (i = AUTO_BLOCK_MIN_POW2; i <= AUTO_BLOCK_MAX_POW2; ++i) {
+        int samples_per_block = adpcm_block_samples (1 << i, num_channels, bits_per_sample);
+        BlockTrial *trial = trials + num_trials;
+
+        if (samples_per_block < 2 || samples_per_block > 0xffff)
+            continue;
+
+        memset (trial, 0, sizeof (BlockTrial));
+        trial->pcm = pcm;
+        trial->num_channels = num_channels;
+        trial->bits_per_sample = bits_per_sample;
+        trial->num_segments = num_segments;
+        trial->segment_samples = segment_samples;
+        trial->samples_per_block = samples_per_block;
+        trial->block_size = (int) adpcm_block_size (samples_per_block, num_channels, bits_per_sample);
+
+        num_trials++;
+    }
+
+#ifdef ENABLE_THREADS
+    {
+        int num_threads = channel_workers, started [AUTO_BLOCK_MAX_POW2 - AUTO_BLOCK_MIN_POW2 + 1];
+        pthread_t threads [AUTO_BLOCK_MAX_POW2 - AUTO_BLOCK_MIN_POW2 + 1];
+
+        if (!num_threads) {
+#ifdef _SC_NPROCESSORS_ONLN
+            num_threads = sysconf (_SC_NPROCESSORS_ONLN);
+#endif
+        }
+
+        // the calling thread does the first trial, and any that there are no threads for
+
+        for (i = 0; i < num_trials; ++i)
+            started [i] = i && i < num_threads && !pthread_create (threads + i, NULL, trial_thread, trials + i);
+
+        for (i = 0; i < num_trials; ++i)
+            if (!started [i])
+                trial_encode (trials + i);
+
+        for (i = 0; i < num_trials; ++i)
+            if (started [i])
+                pthread_join (threads [i], NULL);
+    }
+#else
+    for (i = 0; i < num_trials; ++i)
+        trial_encode (trials + i);
+#endif
+
+    free (pcm);
+
+    for (i = 0; i < num_trials; ++i) {
+        BlockTrial *trial = trials + i;
+
+        trial->bits = adpcm_data_bytes (num_channels, bits_per_sample, num_samples, trial->samples_per_block) * 8.0 /
+            ((double) num_samples * num_channels);
+        trial->snr = 10.0 * log10 ((trial->signal + 1.0) / (trial->error + 1.0));
+
+        if (verbosity > 0)
+            fprintf (stderr, "%5d byte blocks: SNR = %.2f dB at %.4f bits per sample\n", trial->block_size, trial->snr, trial->bits);
+    }
+
+    // with a target, the smallest file that reaches it, else the best SNR for the bytes (or just
+    // the best SNR, when the target is out of reach)
+
+    if (auto_block_snr > 0.0)
+        for (i = 0; i < num_trials; ++i)
+            if (trials [i].snr >= auto_block_snr && (best < 0 || trials [i].bits < trials [best].bits))
+                best = i;
+
+    if (best < 0)
+        for (i = 0; i < num_trials; ++i) {
+            double score = auto_block_snr > 0.0 ? trials [i].snr : trials [i].snr - 6.02 * trials [i].bits;
+
+            if (best < 0 || score > best_score) {
+                best_score = score;
+                best = i;
+            }
+        }
+
+    return trials [best].block_size;
 }
 
-static int adpcm_encode_data (FILE *infile, FILE *outfile, int num_channels, size_t num_samples, int samples_per_block, int lookahead, int noise_shaping)
+static int adpcm_encode_data (FILE *infile, FILE *outfile, int num_channels, int bits_per_sample, uint64_t num_samples, int sample_rate, int samples_per_block, int lookahead, int noise_shaping, int raw_output, uint32_t *loop_points, int sample_bytes, int float_data, int dither, RiffChunks *chunks)
 {
-    int block_size = (samples_per_block - 1) / (num_channels ^ 3) + (num_channels * 4), percent;
+    int block_size = adpcm_block_size (samples_per_block, num_channels, bits_per_sample), block_align = block_size, percent, res = 0;
+    int frame_bytes = num_channels * sample_bytes, convert = sample_bytes != 2 || float_data;
     int16_t *pcm_block = malloc (samples_per_block * num_channels * 2);
-    void *adpcm_block = malloc (block_size);
-    size_t progress_divider = 0;
+    uint8_t *raw_block = convert ? malloc (samples_per_block * frame_bytes) : (uint8_t *) pcm_block;
+    uint8_t *adpcm_block = malloc (block_size), *in_map, *out_map;
+    uint64_t progress_divider = 0, block_start = 0, samples_left = num_samples;
+    uint32_t dither_state = 0x2545f491;
+    int64_t data_start = ftello (outfile);
+    FileMap in_filemap, out_filemap;
+    uint8_t loopstate_data [ADPCM_MAX_CHANNELS * 4];
     void *adpcm_cnxt = NULL;
+    LoopState loopstate;
+#ifdef ENABLE_THREADS
+    PipelineStage reader, writer;
+    ChannelPool channels;
+#endif
 
-    if (!pcm_block || !adpcm_block) {
+    if (!pcm_block || !raw_block || !adpcm_block) {
         fprintf (stderr, "could not allocate memory for buffers!\n");
+
+        if (convert)
+            free (raw_block);
+
+        free (adpcm_block);
+        free (pcm_block);
         return -1;
     }
 
+    if (verbosity > 0 && convert)
+        fprintf (stderr, "converting %d-bit %s input to 16-bit %s\n", sample_bytes * 8, float_data ? "float" : "integer",
+            dither ? "with TPDF dither" : "by rounding");
+
+    in_map = map_input (infile, num_samples * frame_bytes, convert ? 1 : 2, &in_filemap);
+    out_map = map_output (outfile, num_samples ? adpcm_data_bytes (num_channels, bits_per_sample, num_samples, samples_per_block) : 0, 1, &out_filemap);
+
+    if (verbosity > 0 && (in_map || out_map))
+        fprintf (stderr, "using memory mapped I/O for%s%s\n", in_map ? " input" : "", out_map ? " output" : "");
+
+#ifdef ENABLE_THREADS
+    memset (&reader, 0, sizeof (reader));
+    memset (&writer, 0, sizeof (writer));
+    memset (&channels, 0, sizeof (channels));
+
+    if (!in_map)
+        start_stage (&reader, infile, samples_per_block * frame_bytes, num_samples * frame_bytes, reader_thread);
+
+    if (!out_map)
+        start_stage (&writer, outfile, block_size, 0, writer_thread);
+
+    if (verbosity > 0 && (reader.started || writer.started))
+        fprintf (stderr, "using threads for%s%s\n", reader.started ? " reading" : "", writer.started ? " writing" : "");
+#endif
+
     if (verbosity >= 0 && num_samples > 1000) {
         progress_divider = (num_samples + 50) / 100;
         fprintf (stderr, "\rprogress: %d%% ", percent = 0);
         fflush (stderr);
     }
 
-    while (num_samples) {
+    // a num_samples of zero means the length is unknown (streaming) and we go until EOF
+
+    while (!num_samples || samples_left) {
         int this_block_adpcm_samples = samples_per_block;
         int this_block_pcm_samples = samples_per_block;
+        const int16_t *pcm_source = pcm_block;
+        const uint8_t *raw_source = raw_block;
+        int16_t *pcm_buffer = pcm_block;
+        uint8_t *adpcm_dest = adpcm_block;
         size_t num_bytes;
 
-        if (this_block_pcm_samples > num_samples) {
-            this_block_adpcm_samples = ((num_samples + 6) & ~7) + 1;
-            block_size = (this_block_adpcm_samples - 1) / (num_channels ^ 3) + (num_channels * 4);
-            this_block_pcm_samples = num_samples;
+        if (num_samples && (uint64_t) this_block_pcm_samples > samples_left)
+            this_block_pcm_samples = samples_left;
+
+        // encode straight from the input map, except a short last block that we have to pad
+
+        if (in_map) {
+            raw_source = in_map + block_start * frame_bytes;
+
+            if (!convert && this_block_pcm_samples < samples_per_block)
+                memcpy (pcm_block, raw_source, this_block_pcm_samples * frame_bytes);
+            else if (!convert)
+                pcm_source = (const int16_t *) raw_source;
+        }
+#ifdef ENABLE_THREADS
+        else if (reader.started) {
+            size_t bytes_read;
+
+            raw_source = queue_get_filled (&reader.queue, &bytes_read);
+
+            if (!convert)
+                pcm_source = pcm_buffer = (int16_t *) raw_source;
+
+            if (!num_samples) {
+                if (!(this_block_pcm_samples = bytes_read / frame_bytes))
+                    break;
+            }
+            else if (bytes_read != (size_t) this_block_pcm_samples * frame_bytes) {
+                fprintf (stderr, "\rcould not read all audio data from input file!\n");
+                res = -1;
+                break;
+            }
         }
+#endif
+        else if (!num_samples) {
+            this_block_pcm_samples = fread (raw_block, frame_bytes, samples_per_block, infile);
 
-        if (!fread (pcm_block, this_block_pcm_samples * num_channels * 2, 1, infile)) {
+            if (!this_block_pcm_samples)
+                break;
+        }
+        else if (!fread (raw_block, this_block_pcm_samples * frame_bytes, 1, infile)) {
             fprintf (stderr, "\rcould not read all audio data from input file!\n");
-            return -1;
+            res = -1;
+            break;
+        }
+
+        // anything but 16-bit input is converted here, wherever it came from
+
+        if (convert)
+            convert_to_16bit (pcm_block, raw_source, this_block_pcm_samples * num_channels, sample_bytes, float_data,
+                dither ? &dither_state : NULL);
+
+        if (this_block_pcm_samples < samples_per_block) {
+            block_size = adpcm_block_size (this_block_pcm_samples, num_channels, bits_per_sample);
+            this_block_adpcm_samples = adpcm_block_samples (block_size, num_channels, bits_per_sample);
         }
 
         // if this is the last block and it's not full, duplicate the last sample(s) so we don't
         // create problems for the lookahead
 
         if (this_block_adpcm_samples > this_block_pcm_samples) {
-            int16_t *dst = pcm_block + this_block_pcm_samples * num_channels, *src = dst - num_channels;
+            int16_t *dst = pcm_buffer + this_block_pcm_samples * num_channels, *src = dst - num_channels;
             int dups = (this_block_adpcm_samples - this_block_pcm_samples) * num_channels;
 
             while (dups--)
                 *dst++ = *src++;
         }
 
-        // if this is the first block, compute a decaying average (in reverse) so that we can let the
-        // encoder know what kind of initial deltas to expect (helps initializing index)
+        // if this is the first block, estimate the initial deltas from it (helps initializing index)
 
         if (!adpcm_cnxt) {
-            int32_t average_deltas [2];
-            int i;
+            int32_t average_deltas [ADPCM_MAX_CHANNELS];
 
-            average_deltas [0] = average_deltas [1] = 0;
+            compute_initial_deltas (pcm_source, this_block_adpcm_samples, num_channels, average_deltas);
+            adpcm_cnxt = adpcm_create_context (num_channels, lookahead, noise_shaping, average_deltas);
 
-            for (i = this_block_adpcm_samples * num_channels; i -= num_channels;) {
-                average_deltas [0] -= average_deltas [0] >> 3;
-                average_deltas [0] += abs ((int32_t) pcm_block [i] - pcm_block [i - num_channels]);
+#ifdef ENABLE_THREADS
+            if (start_channel_pool (&channels, num_channels, bits_per_sample, samples_per_block, lookahead, noise_shaping, average_deltas) && verbosity > 0)
+                fprintf (stderr, "\rusing %d threads for encoding the channels\n", channels.num_threads + 1);
+#endif
+        }
 
-                if (num_channels == 2) {
-                    average_deltas [1] -= average_deltas [1] >> 3;
-                    average_deltas [1] += abs ((int32_t) pcm_block [i-1] - pcm_block [i+1]);
-                }
-            }
+        if (out_map)
+            adpcm_dest = out_map + block_start / samples_per_block * block_align;
+#ifdef ENABLE_THREADS
+        else if (writer.started)
+            adpcm_dest = queue_get_free (&writer.queue);
+#endif
 
-            average_deltas [0] >>= 3;
-            average_deltas [1] >>= 3;
+#ifdef ENABLE_THREADS
+        if (channels.started)
+            num_bytes = encode_channels (&channels, adpcm_dest, pcm_source, this_block_adpcm_samples);
+        else
+#endif
+        adpcm_encode_block_ex (adpcm_cnxt, adpcm_dest, &num_bytes, pcm_source, this_block_adpcm_samples, bits_per_sample);
 
-            adpcm_cnxt = adpcm_create_context (num_channels, lookahead, noise_shaping, average_deltas);
+        if (num_bytes != (size_t) block_size) {
+            fprintf (stderr, "\radpcm_encode_block_ex() did not return expected value (expected %d, got %d)!\n", block_size, (int) num_bytes);
+            res = -1;
+            break;
         }
 
-        adpcm_encode_block (adpcm_cnxt, adpcm_block, &num_bytes, pcm_block, this_block_adpcm_samples);
+#ifdef ENABLE_THREADS
+        if (reader.started)
+            queue_release (&reader.queue);
 
-        if (num_bytes != block_size) {
-            fprintf (stderr, "\radpcm_encode_block() did not return expected value (expected %d, got %d)!\n", block_size, (int) num_bytes);
-            return -1;
+        if (writer.started) {
+            if (writer.error) {
+                fprintf (stderr, "\rcould not write all audio data to output file!\n");
+                res = -1;
+                break;
+            }
         }
-
-        if (!fwrite (adpcm_block, block_size, 1, outfile)) {
+        else
+#endif
+        if (!out_map && !fwrite (adpcm_block, block_size, 1, outfile)) {
             fprintf (stderr, "\rcould not write all audio data to output file!\n");
-            return -1;
+            res = -1;
+            break;
+        }
+
+        // if the loop start is in this block, capture the decoder state there (i.e., after the
+        // previous sample) so that a player does not have to decode up to it from the header
+
+        if (loop_points && loop_points [0] >= block_start && loop_points [0] < block_start + this_block_pcm_samples) {
+            int block_sample = loop_points [0] - block_start;
+
+            memset (&loopstate, 0, sizeof (loopstate));
+            memcpy (loopstate.ID, "xqls", sizeof (loopstate.ID));
+            loopstate.BlockOffset = block_start / samples_per_block * block_align;
+            loopstate.BlockSample = block_sample;
+
+            adpcm_decode_block_range_ex (NULL, adpcm_dest, block_size, num_channels, bits_per_sample, 0, block_sample, loopstate_data);
+            adpcm_native_to_little_endian (&loopstate, LoopStateFormat);
         }
 
-        num_samples -= this_block_pcm_samples;
+#ifdef ENABLE_THREADS
+        if (writer.started)
+            queue_put (&writer.queue, block_size);
+#endif
+
+        block_start += this_block_pcm_samples;
+
+        if (num_samples)
+            samples_left -= this_block_pcm_samples;
 
         if (progress_divider) {
-            int new_percent = 100 - num_samples / progress_divider;
+            int new_percent = 100 - samples_left / progress_divider;
 
             if (new_percent != percent) {
                 fprintf (stderr, "\rprogress: %d%% ", percent = new_percent);
@@ -713,76 +3446,70 @@ static int adpcm_encode_data (FILE *infile, FILE *outfile, int num_channels, siz
         }
     }
 
-    if (verbosity >= 0)
-        fprintf (stderr, "\r...completed successfully\n");
-
-    if (adpcm_cnxt)
-        adpcm_free_context (adpcm_cnxt);
-
-    free (adpcm_block);
-    free (pcm_block);
-    return 0;
-}
+    unmap_file (&in_filemap, NULL);
+    unmap_file (&out_filemap, outfile);
 
-static void little_endian_to_native (void *data, char *format)
-{
-    unsigned char *cp = (unsigned char *) data;
-    int32_t temp;
+#ifdef ENABLE_THREADS
+    // (also when we stopped early, so that the threads are always joined)
 
-    while (*format) {
-        switch (*format) {
-            case 'L':
-                temp = cp [0] + ((int32_t) cp [1] << 8) + ((int32_t) cp [2] << 16) + ((int32_t) cp [3] << 24);
-                * (int32_t *) cp = temp;
-                cp += 4;
-                break;
+    finish_channel_pool (&channels);
+    finish_stage (&reader, 0);
 
-            case 'S':
-                temp = cp [0] + (cp [1] << 8);
-                * (short *) cp = (short) temp;
-                cp += 2;
-                break;
+    if (finish_stage (&writer, 1) && !res) {
+        fprintf (stderr, "\rcould not write all audio data to output file!\n");
+        res = -1;
+    }
+#endif
 
-            default:
-                if (isdigit ((unsigned char) *format))
-                    cp += *format - '0';
+    // if the length was unknown, go back and write the header for what we got (if we can), which
+    // is also when we find out if the loop points are inside the audio
 
-                break;
+    if (!res && !num_samples && !raw_output) {
+        if (loop_points && loop_points [0] >= block_start) {
+            fprintf (stderr, "\rloop start is beyond the end of the input!\n");
+            res = -1;
+        }
+        else {
+            if (loop_points && loop_points [1] >= block_start)
+                loop_points [1] = block_start - 1;
+
+            if (data_start < 0 || fseeko (outfile, 0, SEEK_SET) ||
+                !write_adpcm_wav_header (outfile, num_channels, bits_per_sample, block_start, sample_rate, samples_per_block, loop_points, 1, chunks) ||
+                fseeko (outfile, 0, SEEK_END)) {
+                    if (verbosity >= 0)
+                        fprintf (stderr, "\rcould not update header (output not seekable), length left unknown\n");
+            }
         }
-
-        format++;
     }
-}
 
-static void native_to_little_endian (void *data, char *format)
-{
-    unsigned char *cp = (unsigned char *) data;
-    int32_t temp;
+    // go back and fill in the loop state in the smpl chunk (which immediately precedes the data
+    // chunk header), if we can
 
-    while (*format) {
-        switch (*format) {
-            case 'L':
-                temp = * (int32_t *) cp;
-                *cp++ = (unsigned char) temp;
-                *cp++ = (unsigned char) (temp >> 8);
-                *cp++ = (unsigned char) (temp >> 16);
-                *cp++ = (unsigned char) (temp >> 24);
-                break;
+    if (!res && loop_points) {
+        int64_t loopstate_pos = data_start - (int64_t) (sizeof (ChunkHeader) + sizeof (loopstate) + num_channels * 4);
 
-            case 'S':
-                temp = * (short *) cp;
-                *cp++ = (unsigned char) temp;
-                *cp++ = (unsigned char) (temp >> 8);
-                break;
+        if (data_start < 0 || fseeko (outfile, loopstate_pos, SEEK_SET) ||
+            !fwrite (&loopstate, sizeof (loopstate), 1, outfile) ||
+            !fwrite (loopstate_data, num_channels * 4, 1, outfile) ||
+            fseeko (outfile, 0, SEEK_END)) {
+                if (verbosity >= 0)
+                    fprintf (stderr, "\rcould not store loop state (output not seekable), players must decode from block start\n");
+        }
+        else if (verbosity > 0)
+            fprintf (stderr, "\rloop state stored for sample %u (block offset %u)\n", loop_points [0],
+                (unsigned int) (loop_points [0] / samples_per_block * block_align));
+    }
 
-            default:
-                if (isdigit ((unsigned char) *format))
-                    cp += *format - '0';
+    if (!res && verbosity >= 0)
+        fprintf (stderr, "\r...completed successfully\n");
 
-                break;
-        }
+    if (adpcm_cnxt)
+        adpcm_free_context (adpcm_cnxt);
 
-        format++;
-    }
-}
+    if (convert)
+        free (raw_block);
 
+    free (adpcm_block);
+    free (pcm_block);
+    return res;
+}
@@ -1,47 +1,45 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
-#include <ctype.h>
+#include <math.h>
 
 #include "adpcm-lib.h"
+#include "adpcm-riff.h"
 #include "decoder.h"
 
+#ifndef __STDC_NO_ATOMICS__
+#include <stdatomic.h>
+#endif
+
+#ifdef __DECODER_ASYNC__
+#include <pthread.h>
+#include <semaphore.h>
+#endif
+
 #define ADPCM_FLAG_NOISE_SHAPING    0x1
 #define ADPCM_FLAG_RAW_OUTPUT       0x2
 
+// pack of clips (see decoder.h), header followed by NumClips entries of EntrySize bytes
 typedef struct {
-    char ckID [4];
-    uint32_t ckSize;
-    char formType [4];
-} RiffChunkHeader;
+    char ID [4];
+    uint16_t Version, NumClips, EntrySize, Alignment;
+    uint32_t TotalSize;
+} PackHeader;
+
+#define PackHeaderFormat "4SSSSL"
 
 typedef struct {
-    char ckID [4];
-    uint32_t ckSize;
-} ChunkHeader;
+    uint32_t Offset, DataSize, NumSamples, SampleRate, LoopStart, LoopEnd, LoopOffset;
+    uint16_t NumChannels, BlockSize, Flags, BitsPerSample;
+} PackEntry;
 
-#define ChunkHeaderFormat "4L"
+#define PackEntryFormat "LLLLLLLSSSS"
 
+// what decoder_open() needs to know of the audio, from whatever header
 typedef struct {
-    uint16_t FormatTag, NumChannels;
-    uint32_t SampleRate, BytesPerSecond;
-    uint16_t BlockAlign, BitsPerSample;
-    uint16_t cbSize;
-    union {
-        uint16_t ValidBitsPerSample;
-        uint16_t SamplesPerBlock;
-        uint16_t Reserved;
-    } Samples;
-    int32_t ChannelMask;
-    uint16_t SubFormat;
-    char GUID [14];
-} WaveHeader;
-
-#define WaveHeaderFormat "SSLLSSSSLS"
-
-#define WAVE_FORMAT_PCM         0x1
-#define WAVE_FORMAT_IMA_ADPCM   0x11
-#define WAVE_FORMAT_EXTENSIBLE  0xfffe
+    int num_channels, bits_per_sample, sample_rate, block_size;
+    uint64_t num_samples;
+} stream_info_t;
 
 #ifdef __DBG_MALLOC__
 static void *malloc_p(size_t sz){
@@ -62,43 +60,131 @@ static void free_p(void *p){
 #endif
 
 typedef struct adpcm_decoder_s{
-    size_t num_samples, sample_cousume;
-    int num_channels, block_size, samples_per_block, sample_rate;
-    uint32_t source_cosume;
+    uint64_t num_samples, sample_cousume;
+    int num_channels, bits_per_sample, block_size, samples_per_block, sample_rate;
+    uint64_t source_cosume, data_offset;
     uint8_t *adpcm_block;
+    const uint8_t *block_data;  // block just read, adpcm_block or a view into reader buffer
     int16_t *pcm_block;
+    int pcm_samples;
     adpcm_reader_t *reader;
+    // loop points from "smpl" chunk, loop_state is valid when has_loop_state
+    size_t loop_start, loop_end;
+    int has_loop, has_loop_state, looping;
+    // pack clip with silent runs (ADPCM_PACK_SILENT_RUNS), the block holding loop start is at loop_offset
+    int silent_runs, silent_blocks, block_silent;
+    size_t loop_offset;
+    uint8_t loop_state[ADPCM_MAX_CHANNELS * 4];
+    // sample rate conversion while decoding (decoder_set_output_rate)
+    struct resampler_s *resampler;
+    // output format conversion while decoding (decoder_set_output_format)
+    int format, convert, use_dither;
+    int32_t gain;
+    uint32_t dither;
+    // worker thread state when decoding ahead (decoder_start_async)
+    struct decoder_async_s *async;
+    // rest of last block not yet fit in ring (decoder_fill_ring)
+    int16_t *ring_pending;
+    int ring_pending_samples, ring_finished;
 }adpcm_decoder_t;
 
-static void little_endian_to_native (void *data, char *format) {
-    unsigned char *cp = (unsigned char *) data;
-    int32_t temp;
-
-    while (*format) {
-        switch (*format) {
-            case 'L':
-                temp = cp [0] + ((int32_t) cp [1] << 8) + ((int32_t) cp [2] << 16) + ((int32_t) cp [3] << 24);
-                * (int32_t *) cp = temp;
-                cp += 4;
-                break;
-
-            case 'S':
-                temp = cp [0] + (cp [1] << 8);
-                * (short *) cp = (short) temp;
-                cp += 2;
-                break;
-
-            default:
-                if (isdigit ((unsigned char) *format))
-                    cp += *format - '0';
-
-                break;
-        }
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+#define RESAMPLE_PHASES 32
+#define RESAMPLE_MAX_TAPS 8
+
+/*
+  output sample k is at input position k * in_rate / out_rate, kept exact as a fraction (frac / out_rate)
+  past the input sample in history[taps / 2 - 1]. history hold the last taps input samples per channel.
+*/
+typedef struct resampler_s{
+    int in_rate, out_rate, taps;
+    uint32_t frac;
+    uint64_t pushed, in_samples;
+    int16_t history[ADPCM_MAX_CHANNELS][RESAMPLE_MAX_TAPS];
+    int16_t coefs[RESAMPLE_PHASES + 1][RESAMPLE_MAX_TAPS];
+}resampler_t;
 
-        format++;
+#define MIXER_CHUNK_SAMPLES 256
+
+typedef struct mixer_voice_s{
+    adpcm_decoder_t decoder;
+    int32_t gains[ADPCM_MAX_CHANNELS * 2];
+    uint8_t state[ADPCM_MAX_CHANNELS * 4];
+    int active, has_block, block_pos, block_stop, block_size;
+    uint64_t block_end;
+}mixer_voice_t;
+
+struct adpcm_mixer_s{
+    int max_voices, num_channels;
+    mixer_voice_t *voices;
+    int32_t mix[MIXER_CHUNK_SAMPLES * 2];
+};
+
+#ifndef __STDC_NO_ATOMICS__
+#define PCM_RING_CACHE_LINE 64
+
+/*
+  single producer, single consumer ring of interleaved pcm. positions only ever increase (and wrap),
+  each is written by one side only and kept on its own cache line, apart from the read-only part.
+*/
+struct pcm_ring_s{
+    int16_t *samples;
+    uint32_t mask;
+    int num_channels, low_watermark, high_watermark;
+    char pad0[PCM_RING_CACHE_LINE];
+    atomic_uint write_pos;
+    char pad1[PCM_RING_CACHE_LINE - sizeof(atomic_uint)];
+    atomic_uint read_pos;
+    char pad2[PCM_RING_CACHE_LINE - sizeof(atomic_uint)];
+};
+#endif
+
+#ifdef __DECODER_ASYNC__
+/*
+  the worker fills slots in order, the consumer takes them in the same order and hand them back
+  on its next call. only the worker ever waits (on space), the consumer just check filled.
+*/
+typedef struct decoder_async_s{
+    pthread_t worker;
+    sem_t space;
+    atomic_int filled, stop;
+    int num_slots, head, tail, holding, finished;
+    int16_t *pcm;
+    pcm_block_t *blocks;
+    int *results;
+}decoder_async_t;
+#endif
+
+// read/skip source and keep track of position (for seek)
+static int source_read(adpcm_decoder_t *decoder, void *buffer, size_t buff_sz){
+    adpcm_reader_t *reader = decoder->reader;
+    int ret = reader->read(reader->reader, buffer, buff_sz);
+    if(ret > 0)
+        decoder->source_cosume += ret;
+    return ret;
+}
+
+// view the next buff_sz bytes in place when the reader can, else read them into buffer
+static const uint8_t *source_view(adpcm_decoder_t *decoder, uint8_t *buffer, size_t buff_sz){
+    adpcm_reader_t *reader = decoder->reader;
+    const void *data;
+    if(reader->view && reader->view(reader->reader, &data, buff_sz) == (int)buff_sz){
+        decoder->source_cosume += buff_sz;
+        return data;
     }
+    return source_read(decoder, buffer, buff_sz) > 0 ? buffer : NULL;
 }
 
+static int source_skip(adpcm_decoder_t *decoder, size_t buff_sz){
+    adpcm_reader_t *reader = decoder->reader;
+    int ret = reader->skip(reader->reader, buff_sz);
+    if(ret >= 0)
+        decoder->source_cosume += buff_sz;
+    return ret;
+}
 
 /*
     PUBLIC API IMPL
@@ -106,202 +192,892 @@ static void little_endian_to_native (void *data, char *format) {
 
 adpcm_decoder_t *decoder_create(){
     adpcm_decoder_t *decoder = malloc_p(sizeof(adpcm_decoder_t));
+    if(decoder)
+        memset(decoder, 0, sizeof(adpcm_decoder_t));
     return decoder;
 }
 
-// return ADPCM_ERR_XXX
-int decoder_init(adpcm_decoder_t *decoder, adpcm_reader_t *reader){
-    int format = 0, bits_per_sample, sample_rate, num_channels, samples_per_block;
-    uint32_t fact_samples = 0;
-    size_t num_samples = 0;
-    RiffChunkHeader riff_chunk_header;
-    ChunkHeader chunk_header;
-    WaveHeader wave_header;
+// parse RIFF header up to the audio data, return ADPCM_ERR_XXX
+static int riff_parse(adpcm_decoder_t *decoder, stream_info_t *info){
+    uint8_t buffer[ADPCM_RIFF_MAX_WANT];
+    int samples_per_block, ret;
+    const uint8_t *data;
+    RiffParser parser;
+
+    // feed the parser the bytes it asks for, skipping the chunks it doesn't need
+    adpcm_riff_init(&parser, NULL, NULL);
+    do {
+        if(parser.position > decoder->source_cosume && source_skip(decoder, parser.position - decoder->source_cosume) < 0)
+            return ADPCM_ERR_INVALID_FILE;
+        if(!(data = source_view(decoder, buffer, parser.want)))
+            return ADPCM_ERR_INVALID_FILE;
+        ret = adpcm_riff_parse(&parser, data, parser.want);
+    } while(ret == ADPCM_RIFF_MORE);
+
+    if(ret != ADPCM_RIFF_DATA || parser.format != WAVE_FORMAT_IMA_ADPCM)
+        return ADPCM_ERR_INVALID_FILE;
+    if(!parser.num_samples)
+        return ADPCM_ERR_NO_SAMPLES;
+
+    samples_per_block = adpcm_block_samples(parser.wave.BlockAlign, parser.wave.NumChannels, parser.bits_per_sample);
+
+    // the state is dropped when it doesn't belong to the loop start, the loop block is then decoded
+    // from the header instead
+    decoder->has_loop = parser.has_loop;
+    decoder->loop_start = parser.loop_start;
+    decoder->loop_end = parser.loop_end;
+    decoder->has_loop_state = parser.has_loop && parser.has_loop_state &&
+        parser.loop_state.BlockSample == decoder->loop_start % samples_per_block &&
+        parser.loop_state.BlockOffset == decoder->loop_start / samples_per_block * parser.wave.BlockAlign;
+    memcpy(decoder->loop_state, parser.loop_state_data, sizeof(decoder->loop_state));
+
+    info->num_channels = parser.wave.NumChannels;
+    info->bits_per_sample = parser.bits_per_sample;
+    info->sample_rate = parser.wave.SampleRate;
+    info->block_size = parser.wave.BlockAlign;
+    info->num_samples = parser.num_samples;
+    return ADPCM_ERR_OK;
+}
+
+// locate clip in the index of a pack (the reader is at the pack start), return ADPCM_ERR_XXX
+static int pack_parse(adpcm_decoder_t *decoder, int clip, stream_info_t *info){
+    PackHeader pack_header;
+    PackEntry entry;
+
+    memset(&entry, 0, sizeof(entry));
+    if(source_read(decoder, &pack_header, sizeof(PackHeader)) <= 0 || strncmp(pack_header.ID, "XQPK", 4))
+        return ADPCM_ERR_INVALID_FILE;
+    adpcm_little_endian_to_native (&pack_header, PackHeaderFormat);
+    if(pack_header.Version != ADPCM_PACK_VERSION || pack_header.EntrySize < sizeof(PackEntry))
+        return ADPCM_ERR_NOT_SUPPORTED;
+    if(clip >= pack_header.NumClips)
+        return ADPCM_ERR_ARGS;
+
+    if((clip && source_skip(decoder, (size_t) clip * pack_header.EntrySize) < 0) ||
+        source_read(decoder, &entry, sizeof(PackEntry)) <= 0)
+        return ADPCM_ERR_INVALID_FILE;
+    adpcm_little_endian_to_native (&entry, PackEntryFormat);
+
+    if(!entry.BitsPerSample)
+        entry.BitsPerSample = 4;
+    if(entry.BitsPerSample < 2 || entry.BitsPerSample > 4)
+        return ADPCM_ERR_NOT_SUPPORTED;
+    if(entry.NumChannels < 1 || entry.NumChannels > ADPCM_MAX_CHANNELS || entry.BlockSize < entry.NumChannels * 4 + 4 || entry.Offset < decoder->source_cosume ||
+        adpcm_block_size(adpcm_block_samples(entry.BlockSize, entry.NumChannels, entry.BitsPerSample), entry.NumChannels, entry.BitsPerSample) != entry.BlockSize)
+        return ADPCM_ERR_INVALID_FILE;
+    if(!entry.NumSamples)
+        return ADPCM_ERR_NO_SAMPLES;
+    if(entry.Offset > decoder->source_cosume && source_skip(decoder, entry.Offset - decoder->source_cosume) < 0)
+        return ADPCM_ERR_INVALID_FILE;
+
+    if(entry.LoopStart != ADPCM_PACK_NO_LOOP && entry.LoopStart <= entry.LoopEnd){
+        decoder->has_loop = 1;
+        decoder->loop_start = entry.LoopStart;
+        decoder->loop_end = entry.LoopEnd;
+        decoder->loop_offset = entry.LoopOffset;
+    }
+    decoder->silent_runs = entry.Flags & ADPCM_PACK_SILENT_RUNS;
+
+    info->num_channels = entry.NumChannels;
+    info->bits_per_sample = entry.BitsPerSample;
+    info->sample_rate = entry.SampleRate;
+    info->block_size = entry.BlockSize;
+    info->num_samples = entry.NumSamples;
+    return ADPCM_ERR_OK;
+}
+
+// parse header of a RIFF file (clip < 0) or of clip of a pack up to the audio data, and allocate
+// buffers (pcm one only when with_pcm), return ADPCM_ERR_XXX
+static int decoder_open(adpcm_decoder_t *decoder, adpcm_reader_t *reader, int clip, int with_pcm){
+    int samples_per_block, ret;
+    stream_info_t info;
 
     if(!decoder || !reader) return ADPCM_ERR_ARGS;
     memset(decoder, 0, sizeof(adpcm_decoder_t));
     decoder->reader = reader;
 
-    // PARSE HEADER
-    if(reader->read(reader->reader, &riff_chunk_header, sizeof(RiffChunkHeader)) <= 0){
-        return ADPCM_ERR_INVALID_FILE;
+    ret = clip < 0 ? riff_parse(decoder, &info) : pack_parse(decoder, clip, &info);
+    if(ret != ADPCM_ERR_OK)
+        return ret;
+
+    samples_per_block = adpcm_block_samples(info.block_size, info.num_channels, info.bits_per_sample);
+
+    // make sure loop fit the audio
+    if (decoder->has_loop) {
+        if (decoder->loop_start >= info.num_samples)
+            decoder->has_loop = decoder->has_loop_state = 0;
+        else if (decoder->loop_end >= info.num_samples)
+            decoder->loop_end = info.num_samples - 1;
     }
-    if(strncmp(riff_chunk_header.ckID, "RIFF", 4) || strncmp(riff_chunk_header.formType, "WAVE", 4))
-        return ADPCM_ERR_INVALID_FILE;
 
-    // read initial RIFF form header
-    // loop through all elements of the RIFF wav header (until the data chuck)
-    while (1) {
-        if(reader->read(reader->reader, &chunk_header, sizeof(ChunkHeader)) <= 0){
-            return ADPCM_ERR_INVALID_FILE;
-        }
-        little_endian_to_native (&chunk_header, ChunkHeaderFormat);
-        // if it's the format chunk, we want to get some info out of there and
-        // make sure it's a .wav file we can handle
-        if (!strncmp (chunk_header.ckID, "fmt ", 4)) {
-            int supported = 1;
-
-            if (chunk_header.ckSize < 16 || chunk_header.ckSize > sizeof (WaveHeader) ||
-                reader->read(reader->reader, &wave_header, chunk_header.ckSize) <= 0) {
-                return ADPCM_ERR_INVALID_FILE;
-            }
-            little_endian_to_native (&wave_header, WaveHeaderFormat);
+    void *pcm_block = NULL;
+    if(with_pcm && !(pcm_block = malloc_p(samples_per_block * info.num_channels * 2)))
+        return ADPCM_ERR_ALLOC_MEMORY;
+    void *adpcm_block = malloc_p(info.block_size);
+    if(!adpcm_block){
+        if(pcm_block)
+            free(pcm_block);
+        return ADPCM_ERR_ALLOC_MEMORY;
+    }
 
-            format = (wave_header.FormatTag == WAVE_FORMAT_EXTENSIBLE && chunk_header.ckSize == 40) ? wave_header.SubFormat : wave_header.FormatTag;
+    decoder->samples_per_block = samples_per_block;
+    decoder->num_channels = info.num_channels;
+    decoder->bits_per_sample = info.bits_per_sample;
+    decoder->num_samples = info.num_samples;
+    decoder->sample_rate = info.sample_rate;
+    decoder->block_size = info.block_size;
+    decoder->data_offset = decoder->source_cosume;
+    decoder->pcm_block = pcm_block;
+    decoder->pcm_samples = samples_per_block;
+    decoder->gain = ADPCM_MIX_UNITY;
+    decoder->adpcm_block = adpcm_block;
+    return ADPCM_ERR_OK;
+}
 
-            bits_per_sample = (chunk_header.ckSize == 40 && wave_header.Samples.ValidBitsPerSample) ? wave_header.Samples.ValidBitsPerSample : wave_header.BitsPerSample;
+// return ADPCM_ERR_XXX
+int decoder_init(adpcm_decoder_t *decoder, adpcm_reader_t *reader){
+    return decoder_open(decoder, reader, -1, 1);
+}
 
-            if (wave_header.NumChannels < 1 || wave_header.NumChannels > 2)
-                supported = 0;
-            else if (format == WAVE_FORMAT_PCM) {
-                supported = 0;
-            }
-            else if (format == WAVE_FORMAT_IMA_ADPCM) {
-                if (bits_per_sample != 4)
-                    supported = 0;
-                if (wave_header.Samples.SamplesPerBlock != (wave_header.BlockAlign - wave_header.NumChannels * 4) * (wave_header.NumChannels ^ 3) + 1) {
-                    return ADPCM_ERR_INVALID_FILE;
-                }
-            }
-            else
-                supported = 0;
+// return ADPCM_ERR_XXX
+int decoder_init_clip(adpcm_decoder_t *decoder, adpcm_reader_t *reader, int clip){
+    if(clip < 0) return ADPCM_ERR_ARGS;
+    return decoder_open(decoder, reader, clip, 1);
+}
+
+
+// read next block of a clip with silent runs, first its header to see if it start a run. a silent block
+// is a zeroed one with block_silent set, and it's never decoded: a zeroed block only decodes to zeros at
+// 4 bits (at 2 and 3 bits it ramps away), the callers output zeros for it instead.
+static int read_silent_run(adpcm_decoder_t *decoder, int block_size){
+    const uint8_t *head;
 
-            if (!supported) {
+    if(!decoder->silent_blocks){
+        if(!(head = source_view(decoder, decoder->adpcm_block, 4)))
+            return ADPCM_ERR_INVALID_FILE;
+        if(head[3] != ADPCM_PACK_SILENT_MARKER){
+            if(head != decoder->adpcm_block)
+                memcpy(decoder->adpcm_block, head, 4);
+            if(source_read(decoder, decoder->adpcm_block + 4, block_size - 4) <= 0)
                 return ADPCM_ERR_INVALID_FILE;
-            }
+            decoder->block_data = decoder->adpcm_block;
+            decoder->block_silent = 0;
+            return ADPCM_ERR_CONTINUE;
         }
-        else if (!strncmp (chunk_header.ckID, "fact", 4)) {
+        if(!(decoder->silent_blocks = head[0] | (head[1] << 8)))
+            return ADPCM_ERR_INVALID_FILE;
+    }
 
-            if (chunk_header.ckSize < 4 || reader->read(reader->reader, &fact_samples, sizeof (fact_samples)) <= 0) {
-                return ADPCM_ERR_INVALID_FILE;
-            }
+    decoder->silent_blocks--;
+    memset(decoder->adpcm_block, 0, block_size);
+    decoder->block_data = decoder->adpcm_block;
+    decoder->block_silent = 1;
+    return ADPCM_ERR_CONTINUE;
+}
 
-            if (chunk_header.ckSize > 4) {
-                int bytes_to_skip = chunk_header.ckSize - 4;
-                reader->skip(reader->reader, bytes_to_skip);
-            }
+// read block holding next sample into block_data, with its size and number of samples in it. we use
+// samples [block_sample, block_end - block_start) of it. return ADPCM_ERR_CONTINUE, or ADPCM_ERR_OK at end.
+static int read_next_block(adpcm_decoder_t *decoder, int *block_sample, uint64_t *block_end, int *block_size, int *block_samples){
+    int samples_per_block = decoder->samples_per_block;
+    uint64_t block_start, num_samples;
+
+    num_samples = decoder->num_samples - decoder->sample_cousume;
+    if(!num_samples)
+        return ADPCM_ERR_OK;
+
+    // normally we are at a block start, but after jumping to loop start we might be in the middle
+    *block_sample = decoder->sample_cousume % samples_per_block;
+    block_start = decoder->sample_cousume - *block_sample;
+    num_samples += *block_sample;
+    *block_size = decoder->block_size;
+    *block_samples = samples_per_block;
+    *block_end = block_start + samples_per_block;
+
+    if ((uint64_t) samples_per_block > num_samples) {
+        *block_size = adpcm_block_size(num_samples, decoder->num_channels, decoder->bits_per_sample);
+        *block_samples = adpcm_block_samples(*block_size, decoder->num_channels, decoder->bits_per_sample);
+        *block_end = block_start + num_samples;
+    }
+
+    if (decoder->looping && decoder->sample_cousume <= decoder->loop_end && decoder->loop_end < *block_end)
+        *block_end = decoder->loop_end + 1;
+
+    if(decoder->silent_runs)
+        return read_silent_run(decoder, *block_size);
+
+    if(!(decoder->block_data = source_view(decoder, decoder->adpcm_block, *block_size))){
+        return ADPCM_ERR_INVALID_FILE;
+    }
+    return ADPCM_ERR_CONTINUE;
+}
+
+// done with samples up to block_end, jump back to loop start if that was loop end
+static int finish_block(adpcm_decoder_t *decoder, uint64_t block_end){
+    decoder->sample_cousume = block_end;
+
+    if (decoder->looping && decoder->sample_cousume == decoder->loop_end + 1) {
+        uint64_t loop_block = decoder->loop_start / decoder->samples_per_block;
+        uint64_t position = decoder->data_offset + (decoder->silent_runs ? decoder->loop_offset : loop_block * decoder->block_size);
+        adpcm_reader_t *reader = decoder->reader;
+        if (position > (size_t) -1 || reader->seek(reader->reader, (size_t) position)) {
+            return ADPCM_ERR_INVALID_FILE;
         }
-        else if (!strncmp (chunk_header.ckID, "data", 4)) {
+        decoder->source_cosume = position;
+        decoder->sample_cousume = decoder->loop_start;
+        decoder->silent_blocks = 0;
+    }
+    if(decoder->num_samples > decoder->sample_cousume)
+        return ADPCM_ERR_CONTINUE;
+    return ADPCM_ERR_OK;
+}
 
-            // on the data chunk, get size and exit parsing loop
+// decoder state at block_sample of the block just read, from the loop state when we are at loop start
+static int block_state(adpcm_decoder_t *decoder, int block_sample, int block_size, uint8_t *state){
+    if (block_sample && decoder->has_loop_state && decoder->sample_cousume == decoder->loop_start) {
+        memcpy(state, decoder->loop_state, decoder->num_channels * 4);
+        return ADPCM_ERR_OK;
+    }
+    if (adpcm_decode_block_range_ex (NULL, decoder->block_data, block_size, decoder->num_channels, decoder->bits_per_sample, 0, block_sample, state) != block_sample)
+        return ADPCM_ERR_DECODE_BLOCK;
+    return ADPCM_ERR_OK;
+}
 
-            if (!wave_header.NumChannels) {      // make sure we saw a "fmt" chunk...
-                return ADPCM_ERR_INVALID_FILE;
-            }
+// push one input sample (all channels) into resampler, write the output samples it completes to out
+static void *resample_push(adpcm_decoder_t *decoder, const int16_t *sample, void *out){
+    resampler_t *resampler = decoder->resampler;
+    int taps = resampler->taps, num_channels = decoder->num_channels, ch, k;
+    uint32_t frac;
 
-            if (!chunk_header.ckSize) {
-                return ADPCM_ERR_NO_SAMPLES;
-            }
+    for(ch = 0; ch < num_channels; ch++){
+        memmove(resampler->history[ch], resampler->history[ch] + 1, (taps - 1) * sizeof(int16_t));
+        resampler->history[ch][taps - 1] = sample[ch];
+    }
+    resampler->pushed++;
 
-            if (format == WAVE_FORMAT_PCM) {
-                return ADPCM_ERR_INVALID_FILE;
-            } else {
-                int complete_blocks = chunk_header.ckSize / wave_header.BlockAlign;
-                int leftover_bytes = chunk_header.ckSize % wave_header.BlockAlign;
-                int samples_last_block;
-
-                num_samples = complete_blocks * wave_header.Samples.SamplesPerBlock;
-
-                if (leftover_bytes) {
-                    if (leftover_bytes % (wave_header.NumChannels * 4)) {
-                        return ADPCM_ERR_INVALID_FILE;
-                    }
-                    samples_last_block = (leftover_bytes - (wave_header.NumChannels * 4)) * (wave_header.NumChannels ^ 3) + 1;
-                    num_samples += samples_last_block;
-                }
-                else
-                    samples_last_block = wave_header.Samples.SamplesPerBlock;
-
-                if (fact_samples) {
-                    if (fact_samples < num_samples && fact_samples > num_samples - samples_last_block) {
-                        num_samples = fact_samples;
-                    }
-                    else if (wave_header.NumChannels == 2 && (fact_samples >>= 1) < num_samples && fact_samples > num_samples - samples_last_block) {
-                        num_samples = fact_samples;
-                    }
-                }
-            }
+    // when flushing at the end, no output past the last real input sample
+    if(resampler->pushed > resampler->in_samples + taps / 2)
+        return out;
 
-            if (!num_samples) {
-                return ADPCM_ERR_NO_SAMPLES;
+    for(frac = resampler->frac; frac < (uint32_t)resampler->out_rate; frac += resampler->in_rate){
+        for(ch = 0; ch < num_channels; ch++){
+            int16_t *history = resampler->history[ch];
+            int32_t value;
+            if(taps == 2){
+                value = history[0] + (int32_t)(((int64_t)(history[1] - history[0]) * frac) / resampler->out_rate);
+            }else{
+                const int16_t *coefs = resampler->coefs[((uint64_t)frac * RESAMPLE_PHASES + resampler->out_rate / 2) / resampler->out_rate];
+                for(value = 8192, k = 0; k < taps; k++)
+                    value += history[k] * coefs[k];
+                value >>= 14;
             }
+            out = adpcm_convert_sample(out, decoder->format, value, decoder->gain, decoder->use_dither ? &decoder->dither : NULL);
+        }
+    }
+    resampler->frac = frac - resampler->out_rate;
+    return out;
+}
 
-            num_channels = wave_header.NumChannels;
-            sample_rate = wave_header.SampleRate;
-            break;
+// decode block just read in groups of up to 8 samples and pass them through the resampler as they come
+static int resample_block(adpcm_decoder_t *decoder, pcm_block_t *block, int16_t *pcm, int block_sample, uint64_t block_end, int block_size){
+    resampler_t *resampler = decoder->resampler;
+    int count = block_end - decoder->sample_cousume, num_channels = decoder->num_channels, group, i;
+    int16_t samples[8 * ADPCM_MAX_CHANNELS], *last = samples;
+    void *out = pcm;
+    uint8_t state[ADPCM_MAX_CHANNELS * 4];
+    int ret;
+
+    if(!decoder->block_silent && block_sample && (ret = block_state(decoder, block_sample, block_size, state)) != ADPCM_ERR_OK)
+        return ret;
+    if(decoder->block_silent)
+        memset(samples, 0, sizeof(samples));
+    resampler->in_samples += count;
+    while(count){
+        group = count > 8 ? 8 : count;
+        // a silent block pushes zeros, without decoding
+        if(!decoder->block_silent &&
+            adpcm_decode_block_range_ex(samples, decoder->block_data, block_size, num_channels, decoder->bits_per_sample, block_sample, group, state) != group)
+            return ADPCM_ERR_DECODE_BLOCK;
+        for(i = 0; i < group; i++)
+            out = resample_push(decoder, samples + i * num_channels, out);
+        last = samples + (group - 1) * num_channels;
+        block_sample += group;
+        count -= group;
+    }
+    ret = finish_block(decoder, block_end);
+    if(ret == ADPCM_ERR_OK){
+        // end of source, flush the samples still in history by holding the last one
+        for(i = 0; i < resampler->taps / 2; i++)
+            out = resample_push(decoder, last, out);
+    }
+    block->samples = decoder->format == ADPCM_FORMAT_S16 ? pcm : NULL;
+    block->data = pcm;
+    block->format = decoder->format;
+    block->num_channels = num_channels;
+    block->num_samples = ((uint8_t *)out - (uint8_t *)pcm) / (num_channels * (decoder->format == ADPCM_FORMAT_U8 ? 1 : 2));
+    block->sample_rate = resampler->out_rate;
+    return ret;
+}
+
+// read and decode next block into pcm, block->samples point into pcm
+static int decode_next_block(adpcm_decoder_t *decoder, pcm_block_t *block, int16_t *pcm){
+    int block_sample, block_size, block_samples, ret;
+    uint64_t block_end;
+    int16_t *samples;
+
+    ret = read_next_block(decoder, &block_sample, &block_end, &block_size, &block_samples);
+    if(ret != ADPCM_ERR_CONTINUE)
+        return ret;
+    if(decoder->resampler)
+        return resample_block(decoder, block, pcm, block_sample, block_end, block_size);
+
+    if (decoder->block_silent) {
+        // silent block of a pack, zeros in the output format without decoding anything
+        int count = (block_end - decoder->sample_cousume) * decoder->num_channels, i;
+        if (decoder->convert) {
+            void *out = pcm;
+            for (i = 0; i < count; i++)
+                out = adpcm_convert_sample(out, decoder->format, 0, decoder->gain, decoder->use_dither ? &decoder->dither : NULL);
+        }
+        else
+            memset(pcm, 0, count * sizeof(int16_t));
+        samples = pcm;
+    }
+    else if (decoder->convert) {
+        // decode straight to output format, from the block header or the state where we start
+        uint8_t state[ADPCM_MAX_CHANNELS * 4];
+        if(block_sample && (ret = block_state(decoder, block_sample, block_size, state)) != ADPCM_ERR_OK)
+            return ret;
+        if (adpcm_decode_block_convert_ex (pcm, decoder->format, decoder->gain, decoder->use_dither ? &decoder->dither : NULL,
+            decoder->block_data, block_size, decoder->num_channels, decoder->bits_per_sample, block_sample, block_end - decoder->sample_cousume, state) != (int)(block_end - decoder->sample_cousume)) {
+            return ADPCM_ERR_DECODE_BLOCK;
         }
-        else {          // just ignore unknown chunks
-            int bytes_to_eat = (chunk_header.ckSize + 1) & ~1L;
-            reader->skip(reader->reader, bytes_to_eat);
+        samples = pcm;
+    }
+    else if (block_sample && decoder->has_loop_state && decoder->sample_cousume == decoder->loop_start) {
+        // resume with stored state, only the samples we need are decoded
+        uint8_t state[ADPCM_MAX_CHANNELS * 4];
+        memcpy(state, decoder->loop_state, sizeof(state));
+        if (adpcm_decode_block_range_ex (pcm, decoder->block_data, block_size, decoder->num_channels, decoder->bits_per_sample,
+            block_sample, block_end - decoder->sample_cousume, state) != (int)(block_end - decoder->sample_cousume)) {
+            return ADPCM_ERR_DECODE_BLOCK;
+        }
+        samples = pcm;
+    }
+    else {
+        if (adpcm_decode_block_ex (pcm, decoder->block_data, block_size, decoder->num_channels, decoder->bits_per_sample) != block_samples) {
+            return ADPCM_ERR_DECODE_BLOCK;
         }
+        samples = pcm + block_sample * decoder->num_channels;
     }
 
-    if(format != WAVE_FORMAT_IMA_ADPCM)
-        return ADPCM_ERR_INVALID_FILE;
+    block->samples = decoder->format == ADPCM_FORMAT_S16 ? samples : NULL;
+    block->data = samples;
+    block->format = decoder->format;
+    block->num_channels = decoder->num_channels;
+    block->num_samples = block_end - decoder->sample_cousume;
+    block->sample_rate = decoder->sample_rate;
+    return finish_block(decoder, block_end);
+}
+
+#ifdef __DECODER_ASYNC__
+static void *decoder_async_worker(void *arg){
+    adpcm_decoder_t *decoder = (adpcm_decoder_t *)arg;
+    decoder_async_t *async = decoder->async;
+    int ret;
+
+    do {
+        sem_wait(&async->space);
+        if(atomic_load_explicit(&async->stop, memory_order_acquire))
+            break;
+        ret = decode_next_block(decoder, async->blocks + async->head,
+            async->pcm + (size_t)async->head * decoder->pcm_samples * decoder->num_channels);
+        async->results[async->head] = ret;
+        async->head = (async->head + 1) % async->num_slots;
+        atomic_fetch_add_explicit(&async->filled, 1, memory_order_release);
+    } while(ret == ADPCM_ERR_CONTINUE);
+
+    return NULL;
+}
+
+static int decoder_async_next_block(adpcm_decoder_t *decoder, pcm_block_t *block){
+    decoder_async_t *async = decoder->async;
+    int ret;
+
+    // previous block is done with, give its slot back to the worker
+    if(async->holding){
+        async->holding = 0;
+        async->tail = (async->tail + 1) % async->num_slots;
+        atomic_fetch_sub_explicit(&async->filled, 1, memory_order_release);
+        sem_post(&async->space);
+    }
+    if(async->finished)
+        return async->finished < 0 ? async->finished : ADPCM_ERR_OK;
+    if(!atomic_load_explicit(&async->filled, memory_order_acquire))
+        return ADPCM_ERR_PENDING;
+
+    *block = async->blocks[async->tail];
+    ret = async->results[async->tail];
+    async->holding = 1;
+    if(ret != ADPCM_ERR_CONTINUE)
+        async->finished = ret < 0 ? ret : 1;
+    return ret;
+}
+
+static void decoder_async_stop(adpcm_decoder_t *decoder){
+    decoder_async_t *async = decoder->async;
 
+    atomic_store_explicit(&async->stop, 1, memory_order_release);
+    sem_post(&async->space);
+    pthread_join(async->worker, NULL);
+    sem_destroy(&async->space);
+    free_p(async->pcm);
+    free_p(async->blocks);
+    free_p(async->results);
+    free_p(async);
+    decoder->async = NULL;
+}
+#endif // __DECODER_ASYNC__
+
+int decoder_next_block(adpcm_decoder_t *decoder, pcm_block_t *block){
+    if(!decoder || !block)
+        return ADPCM_ERR_ARGS;
+#ifdef __DECODER_ASYNC__
+    if(decoder->async)
+        return decoder_async_next_block(decoder, block);
+#endif
+    return decode_next_block(decoder, block, decoder->pcm_block);
+}
 
-    samples_per_block = (wave_header.BlockAlign - num_channels * 4) * (num_channels ^ 3) + 1;
-    void *pcm_block = malloc_p(samples_per_block * num_channels * 2);
-    if(!pcm_block)
+int decoder_start_async(adpcm_decoder_t *decoder, int num_blocks){
+#ifdef __DECODER_ASYNC__
+    decoder_async_t *async;
+    if(!decoder || !decoder->pcm_block || decoder->async || num_blocks < 2)
+        return ADPCM_ERR_ARGS;
+    async = malloc_p(sizeof(decoder_async_t));
+    if(!async)
         return ADPCM_ERR_ALLOC_MEMORY;
-    void *adpcm_block = malloc_p(wave_header.BlockAlign);
-    if(!adpcm_block){
-        if(pcm_block)
-            free(pcm_block);
+    memset(async, 0, sizeof(decoder_async_t));
+    async->num_slots = num_blocks;
+    async->pcm = malloc_p((size_t)num_blocks * decoder->pcm_samples * decoder->num_channels * 2);
+    async->blocks = malloc_p(num_blocks * sizeof(pcm_block_t));
+    async->results = malloc_p(num_blocks * sizeof(int));
+    if(!async->pcm || !async->blocks || !async->results){
+        free_p(async->pcm);
+        free_p(async->blocks);
+        free_p(async->results);
+        free_p(async);
         return ADPCM_ERR_ALLOC_MEMORY;
     }
+    atomic_init(&async->filled, 0);
+    atomic_init(&async->stop, 0);
+    sem_init(&async->space, 0, num_blocks);
+    decoder->async = async;
+    if(pthread_create(&async->worker, NULL, decoder_async_worker, decoder)){
+        sem_destroy(&async->space);
+        free_p(async->pcm);
+        free_p(async->blocks);
+        free_p(async->results);
+        free_p(async);
+        decoder->async = NULL;
+        return ADPCM_ERR_UNKNOWN;
+    }
+    return ADPCM_ERR_OK;
+#else
+    (void)decoder;
+    (void)num_blocks;
+    return ADPCM_ERR_NOT_SUPPORTED;
+#endif
+}
 
-    decoder->samples_per_block = samples_per_block;
-    decoder->num_channels = num_channels;
-    decoder->num_samples = num_samples;
-    decoder->sample_rate = sample_rate;
-    decoder->block_size = wave_header.BlockAlign;
-    decoder->pcm_block = pcm_block;
-    decoder->adpcm_block = adpcm_block;
+#ifndef __STDC_NO_ATOMICS__
+pcm_ring_t *pcm_ring_create(int capacity, int num_channels){
+    pcm_ring_t *ring;
+    uint32_t size = 1;
+    if(capacity < 1 || capacity > (1 << 30) || num_channels < 1)
+        return NULL;
+    while(size < (uint32_t)capacity)
+        size <<= 1;
+    ring = malloc_p(sizeof(pcm_ring_t));
+    if(!ring)
+        return NULL;
+    memset(ring, 0, sizeof(pcm_ring_t));
+    ring->samples = malloc_p((size_t)size * num_channels * 2);
+    if(!ring->samples){
+        free_p(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    ring->num_channels = num_channels;
+    ring->low_watermark = size / 4;
+    ring->high_watermark = size;
+    atomic_init(&ring->write_pos, 0);
+    atomic_init(&ring->read_pos, 0);
+    return ring;
+}
+
+int pcm_ring_set_watermarks(pcm_ring_t *ring, int low, int high){
+    if(!ring || low < 0 || high < low || high > (int)ring->mask + 1)
+        return ADPCM_ERR_ARGS;
+    ring->low_watermark = low;
+    ring->high_watermark = high;
     return ADPCM_ERR_OK;
 }
 
+int pcm_ring_available(pcm_ring_t *ring){
+    return atomic_load_explicit(&ring->write_pos, memory_order_acquire) - atomic_load_explicit(&ring->read_pos, memory_order_acquire);
+}
 
-int decoder_next_block(adpcm_decoder_t *decoder, pcm_block_t *block){
-    int samples_per_block, num_samples;
-    adpcm_reader_t *reader;
-    if(!decoder || !block)
+int pcm_ring_needs_refill(pcm_ring_t *ring){
+    return pcm_ring_available(ring) < ring->low_watermark;
+}
+
+// copy num_samples pcm frames between ring at position and buffer, handling wrap
+static void pcm_ring_copy(pcm_ring_t *ring, uint32_t position, int16_t *buffer, int num_samples, int to_ring){
+    uint32_t offset = position & ring->mask, first = ring->mask + 1 - offset;
+    int16_t *hold = ring->samples + (size_t)offset * ring->num_channels;
+    if(first > (uint32_t)num_samples)
+        first = num_samples;
+    if(to_ring){
+        memcpy(hold, buffer, (size_t)first * ring->num_channels * 2);
+        memcpy(ring->samples, buffer + first * ring->num_channels, (size_t)(num_samples - first) * ring->num_channels * 2);
+    }else{
+        memcpy(buffer, hold, (size_t)first * ring->num_channels * 2);
+        memcpy(buffer + first * ring->num_channels, ring->samples, (size_t)(num_samples - first) * ring->num_channels * 2);
+    }
+}
+
+int pcm_ring_write(pcm_ring_t *ring, const int16_t *samples, int num_samples){
+    uint32_t write_pos = atomic_load_explicit(&ring->write_pos, memory_order_relaxed);
+    uint32_t space = ring->mask + 1 - (write_pos - atomic_load_explicit(&ring->read_pos, memory_order_acquire));
+    if((uint32_t)num_samples > space)
+        num_samples = space;
+    if(num_samples > 0){
+        pcm_ring_copy(ring, write_pos, (int16_t *)samples, num_samples, 1);
+        atomic_store_explicit(&ring->write_pos, write_pos + num_samples, memory_order_release);
+    }
+    return num_samples;
+}
+
+int pcm_ring_read(pcm_ring_t *ring, int16_t *samples, int num_samples){
+    uint32_t read_pos = atomic_load_explicit(&ring->read_pos, memory_order_relaxed);
+    uint32_t available = atomic_load_explicit(&ring->write_pos, memory_order_acquire) - read_pos;
+    if((uint32_t)num_samples > available)
+        num_samples = available;
+    if(num_samples > 0){
+        pcm_ring_copy(ring, read_pos, samples, num_samples, 0);
+        atomic_store_explicit(&ring->read_pos, read_pos + num_samples, memory_order_release);
+    }
+    return num_samples;
+}
+
+int pcm_ring_destroy(pcm_ring_t *ring){
+    if(!ring) return ADPCM_ERR_ARGS;
+    free_p(ring->samples);
+    free_p(ring);
+    return ADPCM_ERR_OK;
+}
+
+int decoder_fill_ring(adpcm_decoder_t *decoder, pcm_ring_t *ring){
+    pcm_block_t block;
+    int ret, written;
+    if(!decoder || !ring || ring->num_channels != decoder->num_channels || decoder->format != ADPCM_FORMAT_S16)
         return ADPCM_ERR_ARGS;
-    reader = decoder->reader;
-    samples_per_block = decoder->samples_per_block;
-    num_samples = decoder->num_samples - decoder->sample_cousume;
 
-    if(num_samples) {
-        int this_block_adpcm_samples = samples_per_block;
-        int this_block_pcm_samples = samples_per_block;
+    while(1){
+        if(decoder->ring_pending_samples){
+            written = pcm_ring_write(ring, decoder->ring_pending, decoder->ring_pending_samples);
+            decoder->ring_pending += written * decoder->num_channels;
+            decoder->ring_pending_samples -= written;
+            if(decoder->ring_pending_samples)
+                return ADPCM_ERR_CONTINUE;
+        }
+        if(decoder->ring_finished)
+            return ADPCM_ERR_OK;
+        if(pcm_ring_available(ring) >= ring->high_watermark)
+            return ADPCM_ERR_CONTINUE;
+        ret = decoder_next_block(decoder, &block);
+        if(ret < ADPCM_ERR_OK || ret == ADPCM_ERR_PENDING)
+            return ret;
+        decoder->ring_pending = block.samples;
+        decoder->ring_pending_samples = block.num_samples;
+        decoder->ring_finished = ret == ADPCM_ERR_OK;
+    }
+}
+#else
+pcm_ring_t *pcm_ring_create(int capacity, int num_channels){
+    (void)capacity;
+    (void)num_channels;
+    return NULL;
+}
+
+// never called without a ring, only here so that callers link
+int pcm_ring_set_watermarks(pcm_ring_t *ring, int low, int high){ (void)ring; (void)low; (void)high; return ADPCM_ERR_NOT_SUPPORTED; }
+int pcm_ring_available(pcm_ring_t *ring){ (void)ring; return 0; }
+int pcm_ring_needs_refill(pcm_ring_t *ring){ (void)ring; return 0; }
+int pcm_ring_write(pcm_ring_t *ring, const int16_t *samples, int num_samples){ (void)ring; (void)samples; (void)num_samples; return 0; }
+int pcm_ring_read(pcm_ring_t *ring, int16_t *samples, int num_samples){ (void)ring; (void)samples; (void)num_samples; return 0; }
+int pcm_ring_destroy(pcm_ring_t *ring){ (void)ring; return ADPCM_ERR_NOT_SUPPORTED; }
+
+int decoder_fill_ring(adpcm_decoder_t *decoder, pcm_ring_t *ring){
+    (void)decoder;
+    (void)ring;
+    return ADPCM_ERR_NOT_SUPPORTED;
+}
+#endif // __STDC_NO_ATOMICS__
+
+adpcm_mixer_t *mixer_create(int max_voices, int num_channels){
+    adpcm_mixer_t *mixer;
+    if(max_voices < 1 || num_channels < 1 || num_channels > 2)
+        return NULL;
+    mixer = malloc_p(sizeof(adpcm_mixer_t));
+    if(!mixer)
+        return NULL;
+    memset(mixer, 0, sizeof(adpcm_mixer_t));
+    mixer->voices = malloc_p(max_voices * sizeof(mixer_voice_t));
+    if(!mixer->voices){
+        free_p(mixer);
+        return NULL;
+    }
+    memset(mixer->voices, 0, max_voices * sizeof(mixer_voice_t));
+    mixer->max_voices = max_voices;
+    mixer->num_channels = num_channels;
+    return mixer;
+}
+
+static void mixer_release_voice(mixer_voice_t *voice){
+    if(voice->decoder.adpcm_block)
+        free_p(voice->decoder.adpcm_block);
+    memset(voice, 0, sizeof(mixer_voice_t));
+}
 
-        if (this_block_adpcm_samples > num_samples) {
-            this_block_adpcm_samples = ((num_samples + 6) & ~7) + 1;
-            decoder->block_size = (this_block_adpcm_samples - 1) / (decoder->num_channels ^ 3) + (decoder->num_channels * 4);
-            this_block_pcm_samples = num_samples;
+int mixer_set_voice(adpcm_mixer_t *mixer, int voice, int gain, int pan){
+    mixer_voice_t *v;
+    int left, right, pairs, ch;
+    if(!mixer || voice < 0 || voice >= mixer->max_voices || !mixer->voices[voice].active)
+        return ADPCM_ERR_ARGS;
+    if(pan < -ADPCM_MIXER_UNITY) pan = -ADPCM_MIXER_UNITY;
+    if(pan > ADPCM_MIXER_UNITY) pan = ADPCM_MIXER_UNITY;
+    v = mixer->voices + voice;
+    // linear pan, center is full gain on both sides
+    left = pan > 0 ? gain * (ADPCM_MIXER_UNITY - pan) / ADPCM_MIXER_UNITY : gain;
+    right = pan < 0 ? gain * (ADPCM_MIXER_UNITY + pan) / ADPCM_MIXER_UNITY : gain;
+    memset(v->gains, 0, sizeof(v->gains));
+    if(mixer->num_channels == 1){
+        for(ch = 0; ch < v->decoder.num_channels; ch++)
+            v->gains[ch] = gain / v->decoder.num_channels;
+    }else if(v->decoder.num_channels == 1){
+        v->gains[0] = left;
+        v->gains[1] = right;
+    }else{
+        // channels are taken as left/right pairs (front, back, ...), an odd one left over goes to both
+        pairs = v->decoder.num_channels / 2;
+        for(ch = 0; ch < pairs * 2; ch++)
+            v->gains[ch * 2 + (ch & 1)] = (ch & 1 ? right : left) / pairs;
+        if(v->decoder.num_channels & 1){
+            v->gains[ch * 2] = left / (pairs + 1);
+            v->gains[ch * 2 + 1] = right / (pairs + 1);
         }
+    }
+    return ADPCM_ERR_OK;
+}
 
-        if(reader->read(reader->reader, decoder->adpcm_block, decoder->block_size) <= 0){
-            return ADPCM_ERR_INVALID_FILE;
+static int mixer_start(adpcm_mixer_t *mixer, adpcm_reader_t *reader, int clip, int gain, int pan, int loop){
+    mixer_voice_t *v;
+    int voice, ret;
+    if(!mixer || !reader)
+        return ADPCM_ERR_ARGS;
+    for(voice = 0; voice < mixer->max_voices && mixer->voices[voice].active; voice++);
+    if(voice == mixer->max_voices)
+        return ADPCM_ERR_ARGS;
+    v = mixer->voices + voice;
+    ret = decoder_open(&v->decoder, reader, clip, 0);
+    if(ret == ADPCM_ERR_OK && loop)
+        ret = decoder_set_loop(&v->decoder, 1);
+    if(ret != ADPCM_ERR_OK){
+        mixer_release_voice(v);
+        return ret;
+    }
+    v->active = 1;
+    mixer_set_voice(mixer, voice, gain, pan);
+    return voice;
+}
+
+int mixer_play(adpcm_mixer_t *mixer, adpcm_reader_t *reader, int gain, int pan, int loop){
+    return mixer_start(mixer, reader, -1, gain, pan, loop);
+}
+
+int mixer_play_clip(adpcm_mixer_t *mixer, adpcm_reader_t *reader, int clip, int gain, int pan, int loop){
+    if(clip < 0) return ADPCM_ERR_ARGS;
+    return mixer_start(mixer, reader, clip, gain, pan, loop);
+}
+
+int mixer_stop(adpcm_mixer_t *mixer, int voice){
+    if(!mixer || voice < 0 || voice >= mixer->max_voices)
+        return ADPCM_ERR_ARGS;
+    mixer_release_voice(mixer->voices + voice);
+    return ADPCM_ERR_OK;
+}
+
+int mixer_voice_active(adpcm_mixer_t *mixer, int voice){
+    if(!mixer || voice < 0 || voice >= mixer->max_voices)
+        return 0;
+    return mixer->voices[voice].active;
+}
+
+// add up to num_samples of voice into mix, return ADPCM_ERR_CONTINUE, ADPCM_ERR_OK at end, or error
+static int mixer_mix_voice(adpcm_mixer_t *mixer, mixer_voice_t *v, int num_samples){
+    adpcm_decoder_t *decoder = &v->decoder;
+    int32_t *mix = mixer->mix;
+    int block_sample, block_samples, count, ret;
+
+    while(num_samples){
+        if(!v->has_block){
+            ret = read_next_block(decoder, &block_sample, &v->block_end, &v->block_size, &block_samples);
+            if(ret != ADPCM_ERR_CONTINUE)
+                return ret;
+            if(block_sample && (ret = block_state(decoder, block_sample, v->block_size, v->state)) != ADPCM_ERR_OK)
+                return ret;
+            v->block_pos = block_sample;
+            v->block_stop = block_sample + (v->block_end - decoder->sample_cousume);
+            v->has_block = 1;
         }
-        if (adpcm_decode_block (decoder->pcm_block, decoder->adpcm_block, decoder->block_size, decoder-> num_channels) != this_block_adpcm_samples) {
+        count = v->block_stop - v->block_pos;
+        if(count > num_samples)
+            count = num_samples;
+        if(!decoder->block_silent && adpcm_mix_block_range_ex(mix, mixer->num_channels, v->gains, decoder->block_data,
+            v->block_size, decoder->num_channels, decoder->bits_per_sample, v->block_pos, count, v->state) != count)
             return ADPCM_ERR_DECODE_BLOCK;
+        v->block_pos += count;
+        mix += count * mixer->num_channels;
+        num_samples -= count;
+        if(v->block_pos == v->block_stop){
+            v->has_block = 0;
+            ret = finish_block(decoder, v->block_end);
+            if(ret != ADPCM_ERR_CONTINUE)
+                return ret;
         }
-        decoder->sample_cousume += this_block_pcm_samples;
+    }
+    return ADPCM_ERR_CONTINUE;
+}
 
-        block->samples = decoder->pcm_block;
-        block->num_channels = decoder->num_channels;
-        block->num_samples = this_block_pcm_samples;
-        block->sample_rate = decoder->sample_rate;
-        if(decoder->num_samples > decoder->sample_cousume)
-            return ADPCM_ERR_CONTINUE;
+int mixer_render(adpcm_mixer_t *mixer, int16_t *samples, int num_samples){
+    int voice, active = 0, count, i;
+    if(!mixer || !samples || num_samples < 0)
+        return ADPCM_ERR_ARGS;
+
+    while(num_samples){
+        count = num_samples > MIXER_CHUNK_SAMPLES ? MIXER_CHUNK_SAMPLES : num_samples;
+        memset(mixer->mix, 0, count * mixer->num_channels * sizeof(int32_t));
+        for(voice = 0; voice < mixer->max_voices; voice++){
+            mixer_voice_t *v = mixer->voices + voice;
+            if(v->active && mixer_mix_voice(mixer, v, count) != ADPCM_ERR_CONTINUE)
+                mixer_release_voice(v);
+        }
+        // clip once, after all voices are in
+        for(i = 0; i < count * mixer->num_channels; i++){
+            int32_t sample = mixer->mix[i];
+            *samples++ = sample > 32767 ? 32767 : (sample < -32768 ? -32768 : sample);
+        }
+        num_samples -= count;
     }
+    for(voice = 0; voice < mixer->max_voices; voice++)
+        active += mixer->voices[voice].active;
+    return active;
+}
 
+int mixer_destroy(adpcm_mixer_t *mixer){
+    int voice;
+    if(!mixer) return ADPCM_ERR_ARGS;
+    for(voice = 0; voice < mixer->max_voices; voice++)
+        mixer_release_voice(mixer->voices + voice);
+    free_p(mixer->voices);
+    free_p(mixer);
+    return ADPCM_ERR_OK;
+}
+
+int decoder_set_output_rate(adpcm_decoder_t *decoder, int sample_rate, int quality){
+    resampler_t *resampler;
+    int16_t *pcm_block;
+    int pcm_samples, phase, k;
+
+    if(!decoder || !decoder->pcm_block || decoder->async || decoder->sample_cousume || sample_rate < 1 ||
+        (quality != ADPCM_RESAMPLE_LINEAR && quality != ADPCM_RESAMPLE_POLYPHASE))
+        return ADPCM_ERR_ARGS;
+    if(decoder->resampler){
+        free_p(decoder->resampler);
+        decoder->resampler = NULL;
+    }
+    if(sample_rate == decoder->sample_rate)
+        return ADPCM_ERR_OK;
+
+    resampler = malloc_p(sizeof(resampler_t));
+    if(!resampler)
+        return ADPCM_ERR_ALLOC_MEMORY;
+    memset(resampler, 0, sizeof(resampler_t));
+    resampler->in_rate = decoder->sample_rate;
+    resampler->out_rate = sample_rate;
+    resampler->taps = quality == ADPCM_RESAMPLE_LINEAR ? 2 : RESAMPLE_MAX_TAPS;
+    // first output sample lines up with first input sample once history is half full
+    resampler->frac = (uint32_t)sample_rate * (resampler->taps / 2);
+
+    if(quality == ADPCM_RESAMPLE_POLYPHASE){
+        // Hann windowed sinc, cutoff lowered when downsampling, each phase normalized to unity gain
+        double cutoff = sample_rate < decoder->sample_rate ? (double)sample_rate / decoder->sample_rate : 1.0;
+        for(phase = 0; phase <= RESAMPLE_PHASES; phase++){
+            double coefs[RESAMPLE_MAX_TAPS], sum = 0.0;
+            for(k = 0; k < RESAMPLE_MAX_TAPS; k++){
+                double x = k - (RESAMPLE_MAX_TAPS / 2 - 1) - (double)phase / RESAMPLE_PHASES;
+                double window = 0.5 + 0.5 * cos(M_PI * x / (RESAMPLE_MAX_TAPS / 2));
+                coefs[k] = (x == 0.0 ? 1.0 : sin(M_PI * cutoff * x) / (M_PI * cutoff * x)) * window;
+                sum += coefs[k];
+            }
+            for(k = 0; k < RESAMPLE_MAX_TAPS; k++)
+                resampler->coefs[phase][k] = (int16_t)floor(coefs[k] / sum * 16384.0 + 0.5);
+        }
+    }
+
+    // output of one block, plus what the flush at end can add
+    pcm_samples = (int)(((int64_t)decoder->samples_per_block + resampler->taps) * sample_rate / decoder->sample_rate) + 2;
+    if(pcm_samples > decoder->pcm_samples){
+        pcm_block = malloc_p((size_t)pcm_samples * decoder->num_channels * 2);
+        if(!pcm_block){
+            free_p(resampler);
+            return ADPCM_ERR_ALLOC_MEMORY;
+        }
+        free_p(decoder->pcm_block);
+        decoder->pcm_block = pcm_block;
+        decoder->pcm_samples = pcm_samples;
+    }
+    decoder->resampler = resampler;
+    return ADPCM_ERR_OK;
+}
+
+int decoder_set_output_format(adpcm_decoder_t *decoder, int format, int gain, int dither){
+    if(!decoder || decoder->async || format < ADPCM_FORMAT_S16 || format > ADPCM_FORMAT_U8 || gain < 0)
+        return ADPCM_ERR_ARGS;
+    decoder->format = format;
+    decoder->gain = gain;
+    decoder->use_dither = dither ? 1 : 0;
+    decoder->dither = 0x2545f491;
+    decoder->convert = format != ADPCM_FORMAT_S16 || gain != ADPCM_MIX_UNITY || dither;
+    return ADPCM_ERR_OK;
+}
+
+int decoder_set_loop(adpcm_decoder_t *decoder, int enable){
+    if(!decoder || !decoder->reader)
+        return ADPCM_ERR_ARGS;
+    if(decoder->async || (enable && (!decoder->has_loop || !decoder->reader->seek)))
+        return ADPCM_ERR_ARGS;
+    decoder->looping = enable ? 1 : 0;
     return ADPCM_ERR_OK;
 }
 
 int decoder_destroy(adpcm_decoder_t *decoder){
     if(!decoder) return ADPCM_ERR_ARGS;
+#ifdef __DECODER_ASYNC__
+    if(decoder->async)
+        decoder_async_stop(decoder);
+#endif
     if(decoder->pcm_block) {
         free_p(decoder->pcm_block);
         decoder->pcm_block = NULL;
@@ -310,13 +1086,165 @@ int decoder_destroy(adpcm_decoder_t *decoder){
         free_p(decoder->adpcm_block);
         decoder->adpcm_block = NULL;
     }
+    if(decoder->resampler){
+        free_p(decoder->resampler);
+        decoder->resampler = NULL;
+    }
     free_p(decoder);
     return ADPCM_ERR_OK;
 }
 
+#define BUFFERED_READER_ALIGN 32
+
+/*
+  window [start, end) of buffer hold source bytes up to position (absolute, like seek). source reads
+  end at multiples of buffer size where possible, so a sector or page sized buffer read whole ones.
+*/
+struct adpcm_buffered_reader_s{
+    adpcm_reader_t reader;
+    adpcm_reader_t *source;
+    uint8_t *memory, *buffer;
+    size_t size, start, end, position, source_size;
+};
+
+// read source into buffer from end until the window hold at least want bytes, return ADPCM_ERR_XXX
+static int buffered_reader_fill(adpcm_buffered_reader_t *br, size_t want){
+    size_t avail = br->end - br->start, count;
+    int ret;
+
+    if(br->start){
+        memmove(br->buffer, br->buffer + br->start, avail);
+        br->start = 0;
+        br->end = avail;
+    }
+    while(br->end < want){
+        // up to the aligned source position past want that still fit, or just what is missing
+        count = br->position + want - br->end;
+        count = (count + br->size - 1) / br->size * br->size - br->position;
+        if(count > br->size - br->end)
+            count = want - br->end;
+        if(br->source_size && br->position + count > br->source_size)
+            count = br->source_size - br->position;
+        if(!count || (ret = br->source->read(br->source->reader, br->buffer + br->end, count)) <= 0)
+            return ADPCM_ERR_INVALID_FILE;
+        br->end += ret;
+        br->position += ret;
+    }
+    return ADPCM_ERR_OK;
+}
+
+static int buffered_reader_read(void *reader, void *buffer, size_t buff_sz){
+    adpcm_buffered_reader_t *br = reader;
+    uint8_t *out = buffer;
+    size_t left = buff_sz, count;
+    int ret;
+
+    while(left){
+        if(br->start == br->end){
+            // large read at an aligned position go straight to caller
+            if(left >= br->size && !(br->position % br->size)){
+                count = left - left % br->size;
+                if((ret = br->source->read(br->source->reader, out, count)) <= 0)
+                    return -1;
+                br->start = br->end = 0;
+                br->position += ret;
+                out += ret;
+                left -= ret;
+                continue;
+            }
+            if(buffered_reader_fill(br, 1) != ADPCM_ERR_OK)
+                return -1;
+        }
+        count = br->end - br->start < left ? br->end - br->start : left;
+        memcpy(out, br->buffer + br->start, count);
+        br->start += count;
+        out += count;
+        left -= count;
+    }
+    return (int)buff_sz;
+}
+
+static int buffered_reader_view(void *reader, const void **data, size_t buff_sz){
+    adpcm_buffered_reader_t *br = reader;
+
+    if(buff_sz > br->size)
+        return -1;
+    if(br->end - br->start < buff_sz && buffered_reader_fill(br, buff_sz) != ADPCM_ERR_OK)
+        return -1;
+    *data = br->buffer + br->start;
+    br->start += buff_sz;
+    return (int)buff_sz;
+}
+
+static int buffered_reader_skip(void *reader, size_t buff_sz){
+    adpcm_buffered_reader_t *br = reader;
+    size_t avail = br->end - br->start;
+
+    if(buff_sz <= avail){
+        br->start += buff_sz;
+        return (int)buff_sz;
+    }
+    if(br->source->skip(br->source->reader, buff_sz - avail) < 0)
+        return -1;
+    br->position += buff_sz - avail;
+    br->start = br->end = 0;
+    return (int)buff_sz;
+}
+
+static int buffered_reader_seek(void *reader, size_t position){
+    adpcm_buffered_reader_t *br = reader;
+
+    // still in buffer (looping over a short sound never touch source again)
+    if(position <= br->position && br->position - position <= br->end){
+        br->start = br->end - (br->position - position);
+        return 0;
+    }
+    if(br->source->seek(br->source->reader, position))
+        return -1;
+    br->position = position;
+    br->start = br->end = 0;
+    return 0;
+}
+
+adpcm_buffered_reader_t *buffered_reader_create(adpcm_reader_t *source, size_t buffer_size, size_t source_size){
+    adpcm_buffered_reader_t *br;
+
+    if(!source || !source->read || !source->skip || !buffer_size)
+        return NULL;
+    if(!(br = malloc_p(sizeof(adpcm_buffered_reader_t))))
+        return NULL;
+    memset(br, 0, sizeof(adpcm_buffered_reader_t));
+    if(!(br->memory = malloc_p(buffer_size + BUFFERED_READER_ALIGN - 1))){
+        free_p(br);
+        return NULL;
+    }
+    br->buffer = (uint8_t *)(((uintptr_t)br->memory + BUFFERED_READER_ALIGN - 1) & ~(uintptr_t)(BUFFERED_READER_ALIGN - 1));
+    br->size = buffer_size;
+    br->source = source;
+    br->source_size = source_size;
+    br->reader.read = buffered_reader_read;
+    br->reader.skip = buffered_reader_skip;
+    br->reader.seek = source->seek ? buffered_reader_seek : NULL;
+    br->reader.view = buffered_reader_view;
+    br->reader.reader = br;
+    return br;
+}
+
+adpcm_reader_t *buffered_reader_get(adpcm_buffered_reader_t *br){
+    return br ? &br->reader : NULL;
+}
+
+int buffered_reader_destroy(adpcm_buffered_reader_t *br){
+    if(!br) return ADPCM_ERR_ARGS;
+    free_p(br->memory);
+    free_p(br);
+    return ADPCM_ERR_OK;
+}
+
 #ifdef __TEST_DECODER__
 /*
-gcc -O2 -D__DBG_MALLOC__ -D__TEST_DECODER__ adpcm-lib.c decoder.c -o decoder
+gcc -O2 -D__DBG_MALLOC__ -D__TEST_DECODER__ adpcm-lib.c adpcm-riff.c decoder.c -o decoder -lm
+gcc -O2 -D__DBG_MALLOC__ -D__TEST_DECODER__ -D__DECODER_ASYNC__ -pthread adpcm-lib.c adpcm-riff.c decoder.c -o decoder -lm
 
 */
 
@@ -357,6 +1285,15 @@ static int progm_skip(void* r, size_t buff_sz){
     return -1;
 }
 
+static int progm_seek(void* r, size_t position){
+    progm_reader_t *reader;
+    if(!r) return -1;
+    reader = (progm_reader_t *)r;
+    if(position > reader->progm->content_size) return -1;
+    reader->position = position;
+    return 0;
+}
+
 int main () {
     int ret;
     progm_reader_t progm_reader = {
@@ -366,7 +1303,8 @@ int main () {
     adpcm_reader_t reader = {
         .read = progm_reader_read,
         .skip = progm_skip,
-        .reader = &progm_reader
+        .reader = &progm_reader,
+        .seek = progm_seek
     };
     pcm_block_t block;
     adpcm_decoder_t *decoder = decoder_create();
@@ -379,7 +1317,16 @@ int main () {
         fprintf(stderr, "decoder_init error: %d\n", ret);
         return ret;
     }
+#ifdef __DECODER_ASYNC__
+    ret = decoder_start_async(decoder, 3);
+    if(ret != ADPCM_ERR_OK){
+        fprintf(stderr, "decoder_start_async error: %d\n", ret);
+        return ret;
+    }
+#endif
     while((ret = decoder_next_block(decoder, &block)) >= ADPCM_ERR_OK){
+        if(ret == ADPCM_ERR_PENDING)
+            continue;
         fprintf(stderr, "block -> rate: %d,  samples: %d, num_channels: %d\n", block.sample_rate, block.num_samples, block.num_channels);
         if(ret == ADPCM_ERR_OK){
             fprintf(stderr, "decoder_next_block done\n");
@@ -5,8 +5,10 @@ extern "C" {
 #endif // __cplusplus
 
 #include <stdint.h>
+#include "adpcm-lib.h"
 
 enum{
+  ADPCM_ERR_PENDING = 2,
   ADPCM_ERR_CONTINUE = 1,
   ADPCM_ERR_OK = 0,
   ADPCM_ERR_UNKNOWN = -1,
@@ -14,22 +16,62 @@ enum{
   ADPCM_ERR_INVALID_FILE = -3,
   ADPCM_ERR_NO_SAMPLES = -4,
   ADPCM_ERR_ALLOC_MEMORY = -5,
-  ADPCM_ERR_DECODE_BLOCK = -6
+  ADPCM_ERR_DECODE_BLOCK = -6,
+  ADPCM_ERR_NOT_SUPPORTED = -7,
+  ADPCM_ERR_ENCODE_BLOCK = -8,
+  ADPCM_ERR_WRITE = -9
+};
+
+enum{
+  ADPCM_RESAMPLE_LINEAR = 0,
+  ADPCM_RESAMPLE_POLYPHASE = 1
 };
 
 typedef struct pcm_block_s {
-  int16_t *samples;
+  int16_t *samples;   // NULL unless format is ADPCM_FORMAT_S16
   int32_t num_samples, num_channels, sample_rate;
+  void *data;         // samples in format
+  int32_t format;     // ADPCM_FORMAT_XXX (adpcm-lib.h)
 }pcm_block_t;
 
 typedef struct adpcm_reader_s{
   int (*read)(void* reader, void *buffer, size_t buff_sz);
   int (*skip)(void* reader, size_t buff_sz);
   void *reader;
+  // optional, absolute position from where decoder_init() started reading, return 0 on success.
+  int (*seek)(void* reader, size_t position);
+  // optional, point data at the next buff_sz bytes (valid until next call) instead of copying, return
+  // buff_sz, or -1 when it can't (then read is used).
+  int (*view)(void* reader, const void **data, size_t buff_sz);
 }adpcm_reader_t;
 
+typedef struct adpcm_buffered_reader_s adpcm_buffered_reader_t;
+
 typedef struct adpcm_decoder_s adpcm_decoder_t;
 
+typedef struct pcm_ring_s pcm_ring_t;
+
+typedef struct adpcm_mixer_s adpcm_mixer_t;
+
+#define ADPCM_MIXER_UNITY ADPCM_MIX_UNITY
+
+/*
+  pack of clips (adpcm-xq -p), all little endian:
+    header  "XQPK", uint16 version, uint16 num_clips, uint16 entry_size, uint16 alignment, uint32 total_size
+    index   num_clips entries of entry_size bytes: uint32 offset (from pack start), data_size, num_samples,
+            sample_rate, loop_start (ADPCM_PACK_NO_LOOP if none), loop_end, loop_offset (of the block holding
+            loop_start, from offset), uint16 num_channels, block_size, flags, bits_per_sample (2, 3, or 0 for 4)
+  followed by the raw IMA ADPCM blocks of each clip, starting at a multiple of alignment. with
+  ADPCM_PACK_SILENT_RUNS in flags, runs of silent blocks are stored as 4 bytes: uint16 number of blocks,
+  0, and ADPCM_PACK_SILENT_MARKER in place of the reserved byte of a block header, and are output as
+  zeros (the block holding loop_start is always stored). silent means decoding to all zeros, or at 2
+  and 3 bits (which can't) to within +/-3 and +/-1, which is what those encode digital silence to.
+*/
+#define ADPCM_PACK_VERSION 1
+#define ADPCM_PACK_NO_LOOP 0xffffffff
+#define ADPCM_PACK_SILENT_RUNS 0x1
+#define ADPCM_PACK_SILENT_MARKER 0xff
+
 
 /*
   success return adpcm_decoder_t* pointer, error return NULL.
@@ -38,15 +80,119 @@ adpcm_decoder_t *decoder_create();
 
 /*
   return ADPCM_ERR_OK mean source in valid, other mean a error.
+  source is a RIFF, RF64 or BW64 wav (ds64 sizes are used, so files over 4GB are fine).
 */
 int decoder_init(adpcm_decoder_t *decoder, adpcm_reader_t *reader);
 
+/*
+  same as decoder_init() for clip number clip of a pack, reader must be at the start of the pack.
+  the clip is found from the index in O(1), skipping straight to it (loop need reader seek as usual).
+*/
+int decoder_init_clip(adpcm_decoder_t *decoder, adpcm_reader_t *reader, int clip);
+
 /*
 return ADPCM_ERR_OK mean decode complete, ADPCM_ERR_CONTIUNE mean have next block.
 pass pcm_block_t to hold decode pcm.
 */
 int decoder_next_block(adpcm_decoder_t *decoder, pcm_block_t *block);
 
+/*
+  resample to sample_rate while decoding, call after decoder_init() and before the first block (and
+  before decoder_start_async()). quality is ADPCM_RESAMPLE_LINEAR or ADPCM_RESAMPLE_POLYPHASE (8 taps,
+  32 phases windowed sinc). samples are resampled as they are decoded, blocks then hold a varying
+  number of samples at sample_rate. return ADPCM_ERR_OK, or ADPCM_ERR_XXX.
+*/
+int decoder_set_output_rate(adpcm_decoder_t *decoder, int sample_rate, int quality);
+
+/*
+  decode straight into format (ADPCM_FORMAT_XXX of adpcm-lib.h, default ADPCM_FORMAT_S16), applying
+  gain (ADPCM_MIXER_UNITY = 1.0) and, if dither is 1, TPDF dither of the output resolution in the same
+  pass. call before decoder_start_async(). pcm_block_t.data then hold samples in format (and .samples
+  is NULL unless it is ADPCM_FORMAT_S16). ring output needs ADPCM_FORMAT_S16.
+*/
+int decoder_set_output_format(adpcm_decoder_t *decoder, int format, int gain, int dither);
+
+/*
+  start a worker thread that read and decode ahead into a pool of num_blocks pcm blocks (at least 2),
+  call after decoder_init() (and decoder_set_loop()). afterwards decoder_next_block() never block, it
+  return ADPCM_ERR_PENDING when no block is decoded yet. the block is valid until the next call.
+  return ADPCM_ERR_NOT_SUPPORTED unless built with -D__DECODER_ASYNC__ (needs pthreads).
+*/
+int decoder_start_async(adpcm_decoder_t *decoder, int num_blocks);
+
+/*
+  lock-free single producer/single consumer ring of interleaved pcm, for pushing decoded audio to an
+  audio callback. capacity is in samples per channel and rounded up to power of 2. default watermarks
+  are capacity/4 (low) and capacity (high). return NULL on error or when built without C11 atomics.
+*/
+pcm_ring_t *pcm_ring_create(int capacity, int num_channels);
+int pcm_ring_set_watermarks(pcm_ring_t *ring, int low, int high);
+int pcm_ring_destroy(pcm_ring_t *ring);
+
+/*
+  consumer side. pcm_ring_read() return number of samples (per channel) copied, may be less than asked.
+  pcm_ring_needs_refill() return 1 when less than low watermark samples are left, to wake producer.
+*/
+int pcm_ring_read(pcm_ring_t *ring, int16_t *samples, int num_samples);
+int pcm_ring_available(pcm_ring_t *ring);
+int pcm_ring_needs_refill(pcm_ring_t *ring);
+
+/*
+  producer side. pcm_ring_write() return number of samples (per channel) copied, may be less than asked.
+  decoder_fill_ring() decode blocks into ring until it hold high watermark samples or is full, a block
+  which doesn't fit is kept and pushed first next time. return ADPCM_ERR_CONTINUE when more to come,
+  ADPCM_ERR_OK when all samples are in ring (ADPCM_ERR_PENDING in async mode if no block is ready).
+*/
+int pcm_ring_write(pcm_ring_t *ring, const int16_t *samples, int num_samples);
+int decoder_fill_ring(adpcm_decoder_t *decoder, pcm_ring_t *ring);
+
+/*
+  mixer of up to max_voices sources playing at once into num_channels (1 or 2) output. voices are
+  decoded straight into one 32-bit mix buffer (no pcm buffer per voice) that is clipped once at the
+  end. sources must have the sample rate of the output. sources of more channels are mixed down, in
+  left/right pairs for stereo output. return NULL on error.
+*/
+adpcm_mixer_t *mixer_create(int max_voices, int num_channels);
+
+/*
+  start playing source of reader (which must stay valid while the voice is active) with gain
+  (ADPCM_MIXER_UNITY = 1.0) and pan (-ADPCM_MIXER_UNITY left .. 0 center .. ADPCM_MIXER_UNITY right),
+  looping between its loop points if loop is 1. return voice number >= 0, or ADPCM_ERR_XXX
+  (ADPCM_ERR_ARGS when all voices are busy). mixer_play_clip() play clip of a pack (see decoder_init_clip()).
+*/
+int mixer_play(adpcm_mixer_t *mixer, adpcm_reader_t *reader, int gain, int pan, int loop);
+int mixer_play_clip(adpcm_mixer_t *mixer, adpcm_reader_t *reader, int clip, int gain, int pan, int loop);
+int mixer_set_voice(adpcm_mixer_t *mixer, int voice, int gain, int pan);
+int mixer_stop(adpcm_mixer_t *mixer, int voice);
+int mixer_voice_active(adpcm_mixer_t *mixer, int voice);
+
+/*
+  mix next num_samples samples (per channel) of all voices into samples. voices that end (or fail) are
+  stopped. return number of voices still active.
+*/
+int mixer_render(adpcm_mixer_t *mixer, int16_t *samples, int num_samples);
+int mixer_destroy(adpcm_mixer_t *mixer);
+
+/*
+  buffered reader over source, for sources where each read is costly (sd card, spi flash). small reads
+  are served from one buffer_size buffer refilled with large reads aligned to buffer_size (from where
+  source is at), blocks up to buffer_size are viewed in place by the decoder without copying.
+  source_size is the number of bytes left in source, or 0 if unknown (source read must then return
+  fewer bytes than asked at the end instead of failing). pass buffered_reader_get() to the decoder.
+  return NULL on error.
+*/
+adpcm_buffered_reader_t *buffered_reader_create(adpcm_reader_t *source, size_t buffer_size, size_t source_size);
+adpcm_reader_t *buffered_reader_get(adpcm_buffered_reader_t *br);
+int buffered_reader_destroy(adpcm_buffered_reader_t *br);
+
+/*
+  enable(1) or disable(0) looping between the loop points of the source "smpl" chunk.
+  reader must support seek. return ADPCM_ERR_OK, or ADPCM_ERR_ARGS if source has no loop.
+  when enabled decoder_next_block() never return ADPCM_ERR_OK, the block with loop end sample
+  is cut there and next block start at loop start (using stored decoder state, when available).
+*/
+int decoder_set_loop(adpcm_decoder_t *decoder, int enable);
+
 /*
   destory decoder, return ADPCM_ERR_OK
 */
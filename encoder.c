@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "adpcm-lib.h"
+#include "adpcm-riff.h"
+#include "encoder.h"
+
+typedef struct {
+    char ckID [4];
+    uint32_t ckSize;
+    uint32_t TotalSamples;
+} FactHeader;
+
+#define FactHeaderFormat "4LL"
+
+// only the first 20 bytes of the WaveHeader are written in the "fmt " chunk for IMA-ADPCM
+#define ENCODER_HEADER_SIZE (sizeof(RiffChunkHeader) + sizeof(ChunkHeader) + 20 + sizeof(FactHeader) + sizeof(ChunkHeader))
+
+#ifdef __DBG_MALLOC__
+static void *malloc_p(size_t sz){
+    void *p = malloc(sz);
+    fprintf(stderr, "malloc_p: %p, size: %zu\n", p, sz);
+    return p;
+}
+
+static void free_p(void *p){
+    fprintf(stderr, "free_p: %p\n", p);
+    free(p);
+}
+#else
+
+#define malloc_p malloc
+#define free_p free
+
+#endif
+
+typedef struct adpcm_encoder_s{
+    size_t num_samples, sample_pushed, data_bytes;
+    int num_channels, block_size, samples_per_block, sample_rate;
+    int lookahead, noise_shaping, raw, header_written;
+    int16_t *pcm_block;
+    int pcm_samples;
+    // low latency mode (encoder_set_low_latency), samples of current block already encoded
+    int low_latency, encoded_samples;
+    uint8_t *adpcm_block;
+    void *adpcm_cnxt;
+    adpcm_writer_t *writer;
+}adpcm_encoder_t;
+
+static int sink_write(adpcm_encoder_t *encoder, const void *buffer, size_t buff_sz){
+    adpcm_writer_t *writer = encoder->writer;
+    if(writer->write(writer->writer, buffer, buff_sz) != (int)buff_sz)
+        return ADPCM_ERR_WRITE;
+    return ADPCM_ERR_OK;
+}
+
+// bytes of data chunk holding num_samples, the last block being shorter
+static size_t data_chunk_size(adpcm_encoder_t *encoder, size_t num_samples){
+    int leftover_samples = num_samples % encoder->samples_per_block;
+    size_t total_data_bytes = num_samples / encoder->samples_per_block * encoder->block_size;
+
+    if (leftover_samples)
+        total_data_bytes += adpcm_block_size(leftover_samples, encoder->num_channels, 4);
+    return total_data_bytes;
+}
+
+// same header as adpcm-xq write for num_samples
+static int write_header(adpcm_encoder_t *encoder, size_t num_samples){
+    RiffChunkHeader riffhdr;
+    ChunkHeader datahdr, fmthdr;
+    WaveHeader wavhdr;
+    FactHeader facthdr;
+    size_t total_data_bytes = data_chunk_size(encoder, num_samples);
+    int ret;
+
+    memset (&wavhdr, 0, sizeof (wavhdr));
+    wavhdr.FormatTag = WAVE_FORMAT_IMA_ADPCM;
+    wavhdr.NumChannels = encoder->num_channels;
+    wavhdr.SampleRate = encoder->sample_rate;
+    wavhdr.BytesPerSecond = encoder->sample_rate * encoder->block_size / encoder->samples_per_block;
+    wavhdr.BlockAlign = encoder->block_size;
+    wavhdr.BitsPerSample = 4;
+    wavhdr.cbSize = 2;
+    wavhdr.Samples.SamplesPerBlock = encoder->samples_per_block;
+
+    memcpy (riffhdr.ckID, "RIFF", sizeof (riffhdr.ckID));
+    memcpy (riffhdr.formType, "WAVE", sizeof (riffhdr.formType));
+    riffhdr.ckSize = ENCODER_HEADER_SIZE - 8 + total_data_bytes;
+    memcpy (fmthdr.ckID, "fmt ", sizeof (fmthdr.ckID));
+    fmthdr.ckSize = 20;
+    memcpy (facthdr.ckID, "fact", sizeof (facthdr.ckID));
+    facthdr.ckSize = 4;
+    facthdr.TotalSamples = num_samples;
+    memcpy (datahdr.ckID, "data", sizeof (datahdr.ckID));
+    datahdr.ckSize = total_data_bytes;
+
+    adpcm_native_to_little_endian (&riffhdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&fmthdr, ChunkHeaderFormat);
+    adpcm_native_to_little_endian (&wavhdr, WaveHeaderFormat);
+    adpcm_native_to_little_endian (&facthdr, FactHeaderFormat);
+    adpcm_native_to_little_endian (&datahdr, ChunkHeaderFormat);
+
+    if((ret = sink_write(encoder, &riffhdr, sizeof (riffhdr))) != ADPCM_ERR_OK ||
+        (ret = sink_write(encoder, &fmthdr, sizeof (fmthdr))) != ADPCM_ERR_OK ||
+        (ret = sink_write(encoder, &wavhdr, 20)) != ADPCM_ERR_OK ||
+        (ret = sink_write(encoder, &facthdr, sizeof (facthdr))) != ADPCM_ERR_OK)
+        return ret;
+    return sink_write(encoder, &datahdr, sizeof (datahdr));
+}
+
+// a short last block, duplicate the last sample(s) so we don't create problems for the lookahead.
+// return the number of samples the block is encoded with
+static int pad_block(adpcm_encoder_t *encoder){
+    int num_channels = encoder->num_channels, pcm_samples = encoder->pcm_samples, adpcm_samples = encoder->samples_per_block;
+
+    if (pcm_samples < adpcm_samples) {
+        int16_t *dst = encoder->pcm_block + pcm_samples * num_channels, *src = dst - num_channels;
+        int dups;
+
+        adpcm_samples = ((pcm_samples + 6) & ~7) + 1;
+        dups = (adpcm_samples - pcm_samples) * num_channels;
+
+        while (dups--)
+            *dst++ = *src++;
+    }
+    return adpcm_samples;
+}
+
+// first block, compute a decaying average (in reverse) over its first num_samples samples so that
+// we can let the encoder know what kind of initial deltas to expect (helps initializing index)
+static int create_context(adpcm_encoder_t *encoder, int num_samples){
+    int num_channels = encoder->num_channels;
+    int16_t *pcm_block = encoder->pcm_block;
+    int32_t average_deltas [ADPCM_MAX_CHANNELS];
+    int i, ch;
+
+    memset(average_deltas, 0, sizeof(average_deltas));
+
+    for (i = num_samples * num_channels; i -= num_channels;)
+        for (ch = 0; ch < num_channels; ch++) {
+            average_deltas [ch] -= average_deltas [ch] >> 3;
+            average_deltas [ch] += abs ((int32_t) pcm_block [i + ch] - pcm_block [i + ch - num_channels]);
+        }
+
+    for (ch = 0; ch < num_channels; ch++)
+        average_deltas [ch] >>= 3;
+
+    encoder->adpcm_cnxt = adpcm_create_context (num_channels, encoder->lookahead, encoder->noise_shaping, average_deltas);
+    if(!encoder->adpcm_cnxt)
+        return ADPCM_ERR_ALLOC_MEMORY;
+    return ADPCM_ERR_OK;
+}
+
+// write header (unless raw, or done) and then num_bytes of encoded data
+static int write_data(adpcm_encoder_t *encoder, const uint8_t *data, size_t num_bytes){
+    int ret;
+
+    if(!encoder->raw && !encoder->header_written){
+        if((ret = write_header(encoder, encoder->num_samples)) != ADPCM_ERR_OK)
+            return ret;
+        encoder->header_written = 1;
+    }
+    if((ret = sink_write(encoder, data, num_bytes)) != ADPCM_ERR_OK)
+        return ret;
+    encoder->data_bytes += num_bytes;
+    return ADPCM_ERR_OK;
+}
+
+// encode the pcm_samples samples in pcm_block as one block and write it
+static int encode_block(adpcm_encoder_t *encoder){
+    int num_channels = encoder->num_channels, adpcm_samples = pad_block(encoder);
+    size_t num_bytes;
+    int ret;
+
+    if(!encoder->adpcm_cnxt && (ret = create_context(encoder, adpcm_samples)) != ADPCM_ERR_OK)
+        return ret;
+
+    adpcm_encode_block (encoder->adpcm_cnxt, encoder->adpcm_block, &num_bytes, encoder->pcm_block, adpcm_samples);
+    if(num_bytes != adpcm_block_size(adpcm_samples, num_channels, 4))
+        return ADPCM_ERR_ENCODE_BLOCK;
+    if((ret = write_data(encoder, encoder->adpcm_block, num_bytes)) != ADPCM_ERR_OK)
+        return ret;
+
+    encoder->pcm_samples = 0;
+    return ADPCM_ERR_OK;
+}
+
+// low latency, write block header and every interleave group of the block whose lookahead samples
+// are in pcm_block. last is set for the short last block, which is then completed
+static int encode_groups(adpcm_encoder_t *encoder, int last){
+    int num_channels = encoder->num_channels, block_samples = encoder->samples_per_block, available = encoder->pcm_samples;
+    int lookahead = encoder->lookahead, needed, ret;
+    size_t num_bytes;
+
+    if(last)
+        block_samples = available = pad_block(encoder);
+
+    // only the start of the first block is used for the initial deltas, so we don't wait for all of it
+    if(!encoder->adpcm_cnxt){
+        needed = 9 + lookahead < block_samples ? 9 + lookahead : block_samples;
+        if(available < needed)
+            return ADPCM_ERR_OK;
+        if((ret = create_context(encoder, needed)) != ADPCM_ERR_OK)
+            return ret;
+    }
+
+    if(!encoder->encoded_samples){
+        if(!available)
+            return ADPCM_ERR_OK;
+        adpcm_encode_block_header (encoder->adpcm_cnxt, encoder->adpcm_block, &num_bytes, encoder->pcm_block);
+        if((ret = write_data(encoder, encoder->adpcm_block, num_bytes)) != ADPCM_ERR_OK)
+            return ret;
+        encoder->encoded_samples = 1;
+    }
+
+    while(encoder->encoded_samples + 8 <= block_samples){
+        needed = encoder->encoded_samples + 8 + lookahead;
+        if(available < (needed < block_samples ? needed : block_samples))
+            return ADPCM_ERR_OK;
+        adpcm_encode_block_chunk (encoder->adpcm_cnxt, encoder->adpcm_block, &num_bytes,
+            encoder->pcm_block + encoder->encoded_samples * num_channels, block_samples - encoder->encoded_samples);
+        if((ret = write_data(encoder, encoder->adpcm_block, num_bytes)) != ADPCM_ERR_OK)
+            return ret;
+        encoder->encoded_samples += 8;
+    }
+
+    encoder->pcm_samples = encoder->encoded_samples = 0;
+    return ADPCM_ERR_OK;
+}
+
+// (re)allocate block buffers for block_size, return ADPCM_ERR_XXX
+static int alloc_blocks(adpcm_encoder_t *encoder, int block_size){
+    int num_channels = encoder->num_channels;
+    int samples_per_block = adpcm_block_samples(block_size, num_channels, 4);
+    int16_t *pcm_block = malloc_p(samples_per_block * num_channels * 2);
+    uint8_t *adpcm_block = malloc_p(block_size);
+
+    if(!pcm_block || !adpcm_block){
+        if(pcm_block)
+            free_p(pcm_block);
+        if(adpcm_block)
+            free_p(adpcm_block);
+        return ADPCM_ERR_ALLOC_MEMORY;
+    }
+    if(encoder->pcm_block)
+        free_p(encoder->pcm_block);
+    if(encoder->adpcm_block)
+        free_p(encoder->adpcm_block);
+    encoder->pcm_block = pcm_block;
+    encoder->adpcm_block = adpcm_block;
+    encoder->block_size = block_size;
+    encoder->samples_per_block = samples_per_block;
+    return ADPCM_ERR_OK;
+}
+
+/*
+    PUBLIC API IMPL
+*/
+
+adpcm_encoder_t *encoder_create(){
+    adpcm_encoder_t *encoder = malloc_p(sizeof(adpcm_encoder_t));
+    if(encoder)
+        memset(encoder, 0, sizeof(adpcm_encoder_t));
+    return encoder;
+}
+
+int encoder_init(adpcm_encoder_t *encoder, adpcm_writer_t *writer, int num_channels, int sample_rate, size_t num_samples){
+    if(!encoder || !writer || !writer->write || num_channels < 1 || num_channels > ADPCM_MAX_CHANNELS || sample_rate <= 0)
+        return ADPCM_ERR_ARGS;
+    if(encoder->adpcm_cnxt)
+        adpcm_free_context(encoder->adpcm_cnxt);
+    if(encoder->pcm_block)
+        free_p(encoder->pcm_block);
+    if(encoder->adpcm_block)
+        free_p(encoder->adpcm_block);
+    memset(encoder, 0, sizeof(adpcm_encoder_t));
+
+    encoder->writer = writer;
+    encoder->num_channels = num_channels;
+    encoder->sample_rate = sample_rate;
+    encoder->num_samples = num_samples;
+    encoder->lookahead = 3;
+    encoder->noise_shaping = sample_rate > 64000 ? NOISE_SHAPING_STATIC : NOISE_SHAPING_DYNAMIC;
+    return alloc_blocks(encoder, 256 * num_channels * (sample_rate < 11000 ? 1 : sample_rate / 11000));
+}
+
+int encoder_set_options(adpcm_encoder_t *encoder, int block_size, int lookahead, int noise_shaping, int raw){
+    if(!encoder || !encoder->writer || encoder->sample_pushed)
+        return ADPCM_ERR_ARGS;
+    if(block_size && (block_size <= encoder->num_channels * 4 || block_size > 32768 || block_size % (encoder->num_channels * 4)))
+        return ADPCM_ERR_ARGS;
+    if(lookahead < 0 || lookahead > 8 || noise_shaping < NOISE_SHAPING_OFF || noise_shaping > NOISE_SHAPING_DYNAMIC)
+        return ADPCM_ERR_ARGS;
+    if(!block_size)
+        block_size = 256 * encoder->num_channels * (encoder->sample_rate < 11000 ? 1 : encoder->sample_rate / 11000);
+    if(block_size != encoder->block_size && alloc_blocks(encoder, block_size) != ADPCM_ERR_OK)
+        return ADPCM_ERR_ALLOC_MEMORY;
+    encoder->lookahead = lookahead;
+    encoder->noise_shaping = noise_shaping;
+    encoder->raw = raw ? 1 : 0;
+    return ADPCM_ERR_OK;
+}
+
+int encoder_set_low_latency(adpcm_encoder_t *encoder, int enable){
+    if(!encoder || !encoder->writer || encoder->sample_pushed)
+        return ADPCM_ERR_ARGS;
+    encoder->low_latency = enable ? 1 : 0;
+    return ADPCM_ERR_OK;
+}
+
+int encoder_push_samples(adpcm_encoder_t *encoder, const int16_t *samples, int num_samples){
+    int num_channels, count, ret;
+
+    if(!encoder || !encoder->pcm_block || (!samples && num_samples) || num_samples < 0)
+        return ADPCM_ERR_ARGS;
+    num_channels = encoder->num_channels;
+
+    while(num_samples){
+        count = encoder->samples_per_block - encoder->pcm_samples;
+        if(count > num_samples)
+            count = num_samples;
+        memcpy(encoder->pcm_block + encoder->pcm_samples * num_channels, samples, count * num_channels * 2);
+        encoder->pcm_samples += count;
+        encoder->sample_pushed += count;
+        samples += count * num_channels;
+        num_samples -= count;
+
+        if(encoder->low_latency){
+            if((ret = encode_groups(encoder, 0)) != ADPCM_ERR_OK)
+                return ret;
+        }
+        else if(encoder->pcm_samples == encoder->samples_per_block && (ret = encode_block(encoder)) != ADPCM_ERR_OK)
+            return ret;
+    }
+    return ADPCM_ERR_OK;
+}
+
+int encoder_finish(adpcm_encoder_t *encoder){
+    adpcm_writer_t *writer;
+    int ret;
+
+    if(!encoder || !encoder->pcm_block)
+        return ADPCM_ERR_ARGS;
+    writer = encoder->writer;
+
+    if(encoder->pcm_samples && (ret = encoder->low_latency ? encode_groups(encoder, 1) : encode_block(encoder)) != ADPCM_ERR_OK)
+        return ret;
+    if(encoder->raw)
+        return ADPCM_ERR_OK;
+    if(!encoder->header_written){
+        encoder->header_written = 1;
+        return write_header(encoder, encoder->sample_pushed);
+    }
+    if(encoder->sample_pushed == encoder->num_samples)
+        return ADPCM_ERR_OK;
+
+    // go back and write the header for the samples we really got
+    if(!writer->seek || writer->seek(writer->writer, 0) ||
+        write_header(encoder, encoder->sample_pushed) != ADPCM_ERR_OK ||
+        writer->seek(writer->writer, ENCODER_HEADER_SIZE + encoder->data_bytes))
+        return ADPCM_ERR_WRITE;
+    encoder->num_samples = encoder->sample_pushed;
+    return ADPCM_ERR_OK;
+}
+
+int encoder_destroy(adpcm_encoder_t *encoder){
+    if(!encoder) return ADPCM_ERR_ARGS;
+    if(encoder->adpcm_cnxt)
+        adpcm_free_context(encoder->adpcm_cnxt);
+    if(encoder->pcm_block)
+        free_p(encoder->pcm_block);
+    if(encoder->adpcm_block)
+        free_p(encoder->adpcm_block);
+    free_p(encoder);
+    return ADPCM_ERR_OK;
+}
@@ -0,0 +1,73 @@
+#ifndef __encoder_h__
+#define __encoder_h__
+#ifdef __cplusplus
+extern "C" {
+#endif // __cplusplus
+
+#include <stdint.h>
+#include "decoder.h"
+
+typedef struct adpcm_writer_s{
+  // return buff_sz on success
+  int (*write)(void* writer, const void *buffer, size_t buff_sz);
+  void *writer;
+  // optional, absolute position from where encoder_init() started writing, return 0 on success.
+  int (*seek)(void* writer, size_t position);
+}adpcm_writer_t;
+
+typedef struct adpcm_encoder_s adpcm_encoder_t;
+
+
+/*
+  success return adpcm_encoder_t* pointer, error return NULL.
+*/
+adpcm_encoder_t *encoder_create();
+
+/*
+  encode num_channels (1 to ADPCM_MAX_CHANNELS) 16-bit pcm at sample_rate to IMA-ADPCM WAV written to writer.
+  num_samples (per channel) is what go in the header, 0 if unknown (the header is then fixed up by
+  encoder_finish() when writer can seek). defaults are those of adpcm-xq: block size by sample rate,
+  lookahead 3 and dynamic noise shaping. return ADPCM_ERR_OK, or ADPCM_ERR_XXX.
+*/
+int encoder_init(adpcm_encoder_t *encoder, adpcm_writer_t *writer, int num_channels, int sample_rate, size_t num_samples);
+
+/*
+  override defaults, call after encoder_init() and before the first push. block_size is in bytes
+  (0 = by sample rate, else a multiple of 4 * num_channels up to 32768), lookahead 0-8, noise_shaping
+  NOISE_SHAPING_XXX (adpcm-lib.h), raw 1 write blocks only (no WAV header). return ADPCM_ERR_XXX.
+*/
+int encoder_set_options(adpcm_encoder_t *encoder, int block_size, int lookahead, int noise_shaping, int raw);
+
+/*
+  enable(1) or disable(0) low latency mode, call after encoder_init() and before the first push.
+  block header is written as soon as the first sample of a block is pushed and each 4 bytes per
+  channel interleave group once the lookahead samples past it are, so a sample is out at most
+  8 + lookahead samples after it was pushed (instead of a whole block). blocks are the same as in
+  normal mode except the initial deltas of the first block, which only use its first samples.
+*/
+int encoder_set_low_latency(adpcm_encoder_t *encoder, int enable);
+
+/*
+  push num_samples (per channel) interleaved samples, any number at a time. every block completed is
+  encoded and written right away. return ADPCM_ERR_OK, or ADPCM_ERR_XXX.
+*/
+int encoder_push_samples(adpcm_encoder_t *encoder, const int16_t *samples, int num_samples);
+
+/*
+  encode samples left as a shorter last block (padded like adpcm-xq), and fix up the header if the
+  number of samples pushed differ from the one given to encoder_init(). return ADPCM_ERR_OK, or
+  ADPCM_ERR_WRITE when the header could not be fixed up (writer can't seek, data is complete).
+*/
+int encoder_finish(adpcm_encoder_t *encoder);
+
+/*
+  destroy encoder, return ADPCM_ERR_OK
+*/
+int encoder_destroy(adpcm_encoder_t *encoder);
+
+#ifdef __cplusplus
+}
+#endif // __cplusplus
+
+
+#endif // __encoder_h__